@@ -19,6 +19,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <unistd.h>
@@ -27,14 +28,56 @@
 #include <sys/socket.h>
 #include <time.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#ifdef HAVE_LINUX_TCP_H
+#include <linux/tcp.h>	/* struct tcp_info is more complete here */
+#else
 #include <netinet/tcp.h>
+#endif
+#include <sys/un.h>
 #include <math.h>
 #include <pthread.h>
+#include <sched.h>
+#include <poll.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+#include <fcntl.h>
+#include <ctype.h>
+#include <signal.h>
+#ifdef HAVE_PERF_EVENT
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509.h>
+#include <openssl/pem.h>
+#include <openssl/ec.h>
+#endif
+
+#if defined(HAVE_LINUX_TCP_H) && defined(TCP_INFO)
+#define	HAVE_TCPINFO
+#endif
+
+#if defined(SO_TIMESTAMPNS) && defined(HAVE_CLOCK_GETTIME)
+#define	HAVE_RXSTAMP
+#endif
+
+#if defined(HAVE_SPLICE) && defined(HAVE_EPOLL)
+#define	HAVE_PROXY
+#endif
 
 #define	FLAG_REPLY	(1u << 0)
 #define	FLAG_ERROR	(1u << 1)
+#define	FLAG_ECHO	(1u << 2)
+#define	FLAG_TLS	(1u << 3)
+#define	FLAG_KTLS	(1u << 4)
+#define	FLAG_UDP	(1u << 5)
+#define	FLAG_REORDER	(1u << 6)
 
 #define	min(x, y) ((x) < (y) ? (x) : (y))
 #define	max(x, y) ((x) > (y) ? (x) : (y))
@@ -44,20 +87,76 @@ static int start_ready = 0;
 static pthread_cond_t waitcv;
 static pthread_cond_t startcv;
 static pthread_mutex_t startmx;
+static uint64_t start_time;
+static int trial_gen = 0;	/* bumped to start each trial */
+static int trial_idle = 0;	/* workers waiting for a trial */
+static int trial_live = 0;	/* workers that have not exited */
+static int trial_over = 0;	/* no more trials will be run */
 
 typedef struct sample {
 	uint64_t	when;
 	uint64_t	lat;
+	int64_t		fwd;	/* replier recv less sender send, raw */
+	int32_t		queue;	/* in the replier's receive queue, or -1 */
+	uint32_t	svc;	/* replier service time */
+	uint32_t	rdly;	/* of which, asked for */
 	uint16_t	ssz;
 	uint16_t	rsz;
 } sample_t;
 
+/*
+ * A span bounds a part of a run, either as a time (ns) or as a number of
+ * messages.
+ */
+typedef struct span {
+	uint64_t	v;
+	int		time;		/* v is a time, not a count */
+} span_t;
+
+/*
+ * The phases of a trial.  Only replies to messages sent during the
+ * measurement phase are counted in the results, but replies in every
+ * phase are checked.
+ */
+enum phase {
+	PHASE_WARMUP,
+	PHASE_MEASURE,
+	PHASE_COOLDOWN,
+	PHASE_DONE
+};
+
+/*
+ * A hist_t is a log-linear histogram of nanosecond values.  Each power of
+ * two is split into HIST_SUB linear buckets, so that values are kept to
+ * within about 6%, in a fixed amount of memory, for a few instructions.
+ */
+#define	HIST_SUBBITS	4
+#define	HIST_SUB	(1 << HIST_SUBBITS)
+#define	HIST_BUCKETS	((64 - HIST_SUBBITS + 1) * HIST_SUB)
+
+typedef struct hist {
+	uint64_t	count;
+	uint64_t	sum;
+	uint64_t	min;
+	uint64_t	max;
+	uint64_t	b[HIST_BUCKETS];
+} hist_t;
+
+/*
+ * A pacer spaces out events on a schedule: each deadline follows the
+ * previous one (rather than the time the caller got around to asking),
+ * so time spent between waits doesn't stretch the intervals.  How late
+ * each wakeup actually was is recorded.
+ */
+typedef struct pacer {
+	uint64_t	next;		/* the last deadline */
+	hist_t		err;		/* lateness of each wakeup */
+} pacer_t;
+
 #ifndef HAVE_STRLCPY
 int
 strlcpy(char *dst, const char *src, size_t dstsize)
 {
-	int len;
-	char *end;
 	/* poor mans strlcpy, not as fast as a smarter implementation */
 	(void) strncpy(dst, src, dstsize);
 	if (dstsize > 0) {
@@ -109,8 +208,207 @@ uint32_t maxmsg = 8000;
 int debug = 0;
 
 /*
- * Test header, used at the start of every message.
+ * A replier can be told to run its timestamps off a clock that is offset
+ * from, and drifts against, its own, as if it were on another host, so
+ * that one-way latency estimation can be tried on one box.
+ */
+int64_t clock_offset = 0;	/* ns */
+double clock_drift = 0;		/* ppm */
+uint64_t clock_epoch;
+
+static inline uint64_t
+replier_clock(uint64_t now)
+{
+	if (clock_offset == 0 && clock_drift == 0) {
+		return (now);
+	}
+	return (now + clock_offset +
+	    (int64_t)((int64_t)(now - clock_epoch) * clock_drift / 1e6));
+}
+
+/*
+ * Counters for the metrics endpoint.  A block is only written by the one
+ * thread using it, without locks: as there is no other writer, a relaxed
+ * atomic store of the new value is enough, and costs no locked
+ * instruction.  The scraper reads with relaxed atomic loads, so neither
+ * side can tear a 64-bit count, even on a 32-bit machine.  The
+ * blocks of each target (a destination) are never freed: when the
+ * connection using one closes, it is kept for the next, so that counts
+ * only go up.
+ */
+#define	METRIC_BUCKETS	22
+
+typedef struct mblock {
+	uint64_t	sent;		/* messages */
+	uint64_t	received;
+	uint64_t	sbytes;
+	uint64_t	rbytes;
+	uint64_t	errors;
+	uint64_t	latsum;		/* ns */
+	uint64_t	lat[METRIC_BUCKETS + 1];
+	struct mblock	*next;		/* every block of the target */
+	struct mblock	*spare;		/* next on the target's free list */
+} mblock_t;
+
+typedef struct mtarget {
+	char		dest[128];
+	mblock_t	*blocks;
+	mblock_t	*spare;
+	pthread_mutex_t	mx;		/* for blocks and spare */
+	struct mtarget	*next;
+} mtarget_t;
+
+/* upper bounds of the latency buckets (ns) */
+static const uint64_t metric_le[METRIC_BUCKETS] = {
+	1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000,
+	1000000, 2000000, 5000000, 10000000, 20000000, 50000000, 100000000,
+	200000000, 500000000, 1000000000, 2000000000, 5000000000ull,
+	10000000000ull
+};
+
+static mtarget_t	*mtargets = NULL;
+static pthread_mutex_t	mtargetmx = PTHREAD_MUTEX_INITIALIZER;
+static const char	*metric_mode = "";
+static int		metrics_on = 0;
+
+/*
+ * metric_add adds to a count of a block owned by the calling thread.
+ */
+static inline void
+metric_add(uint64_t *c, uint64_t v)
+{
+	__atomic_store_n(c, *c + v, __ATOMIC_RELAXED);
+}
+
+/*
+ * The counting functions do nothing for a test without a block, which is
+ * every test when the endpoint isn't running.
+ */
+static inline void
+metric_tx(mblock_t *m, uint64_t msgs, uint64_t bytes)
+{
+	if (m != NULL) {
+		metric_add(&m->sent, msgs);
+		metric_add(&m->sbytes, bytes);
+	}
+}
+
+static inline void
+metric_rx(mblock_t *m, uint64_t msgs, uint64_t bytes)
+{
+	if (m != NULL) {
+		metric_add(&m->received, msgs);
+		metric_add(&m->rbytes, bytes);
+	}
+}
+
+static inline void
+metric_err(mblock_t *m)
+{
+	if (m != NULL) {
+		metric_add(&m->errors, 1);
+	}
+}
+
+static inline void
+metric_lat(mblock_t *m, uint64_t ns)
+{
+	int i;
+
+	if (m == NULL) {
+		return;
+	}
+	for (i = 0; i < METRIC_BUCKETS && ns > metric_le[i]; i++)
+		;
+	metric_add(&m->lat[i], 1);
+	metric_add(&m->latsum, ns);
+}
+
+/*
+ * addr_name formats an address as host:port, or a unix socket's path.
+ */
+static void
+addr_name(const struct sockaddr *sa, socklen_t len, char *buf, size_t bufsz)
+{
+	char	hbuf[64], pbuf[16];
+
+	if (sa->sa_family == AF_UNIX) {
+		strlcpy(buf, ((const struct sockaddr_un *)sa)->sun_path,
+		    bufsz);
+	} else if (getnameinfo(sa, len, hbuf, sizeof (hbuf), pbuf,
+	    sizeof (pbuf), NI_NUMERICHOST | NI_NUMERICSERV) == 0) {
+		(void) snprintf(buf, bufsz, "%s:%s", hbuf, pbuf);
+	} else {
+		strlcpy(buf, "?", bufsz);
+	}
+}
+
+/*
+ * mtarget_get finds the metrics target for a destination, adding it if it
+ * is new.
+ */
+static mtarget_t *
+mtarget_get(const struct sockaddr *sa, socklen_t len)
+{
+	mtarget_t	*mt;
+	char		dest[128];
+
+	addr_name(sa, len, dest, sizeof (dest));
+	pthread_mutex_lock(&mtargetmx);
+	for (mt = mtargets; mt != NULL; mt = mt->next) {
+		if (strcmp(mt->dest, dest) == 0) {
+			break;
+		}
+	}
+	if (mt == NULL) {
+		mt = calloc(1, sizeof (*mt));
+		strlcpy(mt->dest, dest, sizeof (mt->dest));
+		pthread_mutex_init(&mt->mx, NULL);
+		mt->next = mtargets;
+		__atomic_store_n(&mtargets, mt, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&mtargetmx);
+	return (mt);
+}
+
+/*
+ * mblock_get takes a block of counters for a new connection to a target,
+ * and mblock_put gives it back when the connection closes.
  */
+static mblock_t *
+mblock_get(mtarget_t *mt)
+{
+	mblock_t *m;
+
+	pthread_mutex_lock(&mt->mx);
+	if ((m = mt->spare) != NULL) {
+		mt->spare = m->spare;
+	} else {
+		m = calloc(1, sizeof (*m));
+		m->next = mt->blocks;
+		__atomic_store_n(&mt->blocks, m, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&mt->mx);
+	return (m);
+}
+
+static void
+mblock_put(mtarget_t *mt, mblock_t *m)
+{
+	pthread_mutex_lock(&mt->mx);
+	m->spare = mt->spare;
+	mt->spare = m;
+	pthread_mutex_unlock(&mt->mx);
+}
+
+/*
+ * Test header, used at the start of every message.  Its layout changes as
+ * features are added, so each carries HDR_MAGIC, the low byte of which is
+ * HDR_VERSION; bump that whenever the header changes.
+ */
+#define	HDR_VERSION	1
+#define	HDR_MAGIC	(0x53515400u | HDR_VERSION)	/* "SQT" */
+
 typedef struct test_header {
 	uint64_t	seqno;
 	uint64_t	ts1;	/* senders send time */
@@ -119,8 +417,399 @@ typedef struct test_header {
 	uint32_t	rdly;	/* reply delay (ns) */
 	uint16_t	ssz;	/* send size */
 	uint16_t	rsz;	/* reply size */
+	uint64_t	tsq;	/* repliers arrival time, or 0 if unknown */
+	uint32_t	cdly;	/* delay between reply chunks (ns) */
+	uint16_t	nchunk;	/* replies wanted, if more than one */
+	uint16_t	chunk;	/* which reply this is, from 0 */
+	uint64_t	tsp;	/* senders previous send on the flow, or 0 */
+	uint32_t	magic;	/* HDR_MAGIC */
+	uint32_t	pad;
 } test_header_t;
 
+/*
+ * Datagrams, unlike a TCP stream, may be lost, duplicated or reordered.
+ * A seqtrack accounts for these, using a sliding bitmap to remember which
+ * of the most recent SEQWIN sequence numbers have already been seen.
+ * Sequence numbers are divided by the stride first, so that a receiver
+ * only expecting every Nth sequence number (rinterval) sees no gaps.
+ */
+#define	SEQWIN	4096
+
+typedef struct seqtrack {
+	uint64_t	next;		/* one past the highest seen */
+	uint64_t	unique;		/* distinct sequence numbers seen */
+	uint64_t	dups;		/* duplicates */
+	uint64_t	reordered;	/* arrived after a later one */
+	uint64_t	late;		/* too old to check for duplicates */
+	uint64_t	maxdist;	/* greatest reordering distance */
+	uint64_t	sumdist;	/* for the mean reordering distance */
+	uint64_t	bits[SEQWIN / 64];
+} seqtrack_t;
+
+typedef struct transport transport_t;
+
+/*
+ * A tcpsample is one reading of TCP_INFO for a connection.  These are
+ * taken by the sampler thread, so that the I/O paths never pay for them.
+ */
+typedef struct tcpsample {
+	uint64_t	when;
+	uint32_t	rtt;		/* smoothed rtt (us) */
+	uint32_t	rttvar;		/* rtt variance (us) */
+	uint32_t	cwnd;		/* congestion window (segments) */
+	uint32_t	snd_wnd;	/* peer's receive window (bytes) */
+	uint32_t	rcv_space;	/* our receive window (bytes) */
+	uint32_t	unacked;	/* segments in flight */
+	uint32_t	retrans;	/* total retransmits */
+	uint64_t	busy;		/* time busy sending (us) */
+	uint64_t	rwnd_limited;	/* of which, receive window limited */
+	uint64_t	sndbuf_limited;	/* of which, send buffer limited */
+} tcpsample_t;
+
+/*
+ * A replayed message, from a trace: when it is to be sent (ns after the
+ * start, already scaled by the replay speed), its sizes, and the delay
+ * the replier is to add before replying.
+ */
+typedef struct tentry {
+	uint64_t	when;
+	uint64_t	conn;		/* only while loading */
+	uint16_t	ssz;
+	uint16_t	rsz;
+	uint32_t	rdly;
+} tentry_t;
+
+typedef struct trace {
+	int		nconns;
+	tentry_t	**e;		/* each connection's messages, in order */
+	uint64_t	*n;
+	uint64_t	nmsgs;
+	uint64_t	span;		/* from the first message to the last */
+	double		speed;
+} trace_t;
+
+/* a replayed message sent later than this is counted as behind */
+#define	REPLAY_LATE	100000
+
+/*
+ * With the outlier option, each receiving thread keeps a ring of the
+ * samples over the threshold, with what else it knew when each arrived.
+ * Only that thread writes to the ring, and only the logger reads it, so
+ * neither needs a lock; if the logger falls behind, outliers are dropped
+ * (and counted) rather than holding up the thread.  With a percentile
+ * for the threshold, each thread estimates it from the latencies it has
+ * seen so far, and logs nothing until it has seen OUTLIER_LEARN.
+ */
+#define	OUTLIER_RING	1024
+#define	OUTLIER_LEARN	1024
+
+typedef struct outlier {
+	uint64_t	when;		/* sent (ts1) */
+	uint64_t	seqno;
+	uint64_t	lat;
+	int64_t		fwd;
+	uint32_t	svc;
+	int32_t		queue;
+	uint64_t	gap;		/* since the flow's previous message */
+	uint64_t	inflight;	/* requests still awaiting replies */
+	uint16_t	ssz;
+	uint16_t	rsz;
+} outlier_t;
+
+typedef struct oring {
+	outlier_t	e[OUTLIER_RING];
+	uint64_t	head;		/* written by the test's thread */
+	uint64_t	tail;		/* written by the logger */
+	uint64_t	dropped;
+	uint64_t	lim;		/* the threshold */
+	double		pct;		/* estimate lim at this, if not 0 */
+	hist_t		seen;		/* for the estimate */
+	int		thread;
+} oring_t;
+
+/*
+ * Per-thread counters, for the perf option.  Each thread opens its own,
+ * counting only itself, and reads them before and after its work, so that
+ * waiting between trials isn't counted.  Any that perf_event_open won't
+ * give us (a VM without a PMU, or perf_event_paranoid) are left out, but
+ * CPU time and context switches fall back to getrusage, so there is
+ * always something to show.
+ */
+#define	PC_CYCLES	0
+#define	PC_INSNS	1
+#define	PC_CMISS	2
+#define	PC_CPU		3	/* ns on the CPU */
+#define	PC_CSW		4
+#define	PC_MIGR		5
+#define	PC_NUM		6
+
+typedef struct pcount {
+	int		fd[PC_NUM];	/* -1 if not available */
+	int		user;		/* counting user time only */
+	uint64_t	base[PC_NUM];	/* at pc_start */
+	uint64_t	v[PC_NUM];	/* accumulated */
+	uint64_t	msgs;
+	uint32_t	have;		/* bit for each counter with values */
+	uint32_t	rusage;		/* bit for each from getrusage */
+} pcount_t;
+
+static int	perfcount = 0;
+
+/*
+ * pc_read gets each counter's total so far, scaled up for any time the
+ * kernel had it multiplexed off the PMU.
+ */
+static void
+pc_read(pcount_t *p, uint64_t *v)
+{
+	int		i;
+#ifdef HAVE_PERF_EVENT
+	uint64_t	r[3];	/* value, time enabled, time running */
+
+	for (i = 0; i < PC_NUM; i++) {
+		v[i] = 0;
+		if (p->fd[i] >= 0 && read(p->fd[i], r, sizeof (r)) ==
+		    sizeof (r) && r[2] != 0) {
+			v[i] = (r[2] < r[1]) ?
+			    (uint64_t)((double)r[0] * r[1] / r[2]) : r[0];
+		}
+	}
+#else
+	for (i = 0; i < PC_NUM; i++) {
+		v[i] = 0;
+	}
+#endif
+#ifdef RUSAGE_THREAD
+	if (p->rusage != 0) {
+		struct rusage ru;
+
+		(void) getrusage(RUSAGE_THREAD, &ru);
+		if (p->rusage & (1u << PC_CPU)) {
+			v[PC_CPU] = (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) *
+			    1000000000ull + (ru.ru_utime.tv_usec +
+			    ru.ru_stime.tv_usec) * 1000ull;
+		}
+		if (p->rusage & (1u << PC_CSW)) {
+			v[PC_CSW] = ru.ru_nvcsw + ru.ru_nivcsw;
+		}
+	}
+#endif
+}
+
+/*
+ * pc_open opens the counters for the calling thread.  Kernel time is
+ * counted too, since so much of a message's cost is in the network stack,
+ * unless that isn't allowed.
+ */
+static void
+pc_open(pcount_t *p)
+{
+	int	i;
+#ifdef HAVE_PERF_EVENT
+	static const struct {
+		uint32_t	type;
+		uint64_t	config;
+	} ev[PC_NUM] = {
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+		{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+		{ PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+	};
+	struct perf_event_attr	attr;
+#endif
+
+	memset(p, 0, sizeof (*p));
+	for (i = 0; i < PC_NUM; i++) {
+		p->fd[i] = -1;
+#ifdef HAVE_PERF_EVENT
+		memset(&attr, 0, sizeof (attr));
+		attr.size = sizeof (attr);
+		attr.type = ev[i].type;
+		attr.config = ev[i].config;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+		    PERF_FORMAT_TOTAL_TIME_RUNNING;
+		attr.exclude_hv = 1;
+		attr.exclude_kernel = p->user;
+		p->fd[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1,
+		    PERF_FLAG_FD_CLOEXEC);
+		if (p->fd[i] < 0 && errno == EACCES && !p->user) {
+			/* perf_event_paranoid; start again without kernel */
+			while (--i >= 0) {
+				(void) close(p->fd[i]);
+			}
+			p->user = 1;
+			p->have = 0;
+			continue;
+		}
+#endif
+		if (p->fd[i] >= 0) {
+			p->have |= 1u << i;
+		}
+	}
+#ifdef RUSAGE_THREAD
+	for (i = PC_CPU; i <= PC_CSW; i++) {
+		if (p->fd[i] < 0) {
+			p->rusage |= 1u << i;
+			p->have |= 1u << i;
+		}
+	}
+#endif
+}
+
+static void
+pc_start(pcount_t *p)
+{
+	pc_read(p, p->base);
+}
+
+static void
+pc_stop(pcount_t *p, uint64_t msgs)
+{
+	uint64_t	now[PC_NUM];
+	int		i;
+
+	pc_read(p, now);
+	for (i = 0; i < PC_NUM; i++) {
+		p->v[i] += now[i] - p->base[i];
+	}
+	p->msgs += msgs;
+}
+
+static void
+pc_merge(pcount_t *sum, const pcount_t *p)
+{
+	int	i;
+
+	for (i = 0; i < PC_NUM; i++) {
+		sum->v[i] += p->v[i];
+	}
+	sum->msgs += p->msgs;
+	sum->have |= p->have;
+	sum->rusage |= p->rusage;
+	sum->user |= p->user;
+}
+
+static void
+pc_close(pcount_t *p)
+{
+	int	i;
+
+	for (i = 0; i < PC_NUM; i++) {
+		if (p->fd[i] >= 0) {
+			(void) close(p->fd[i]);
+			p->fd[i] = -1;
+		}
+	}
+}
+
+/*
+ * report_pc prints counters as the cost of each message.
+ */
+static void
+report_pc(const char *title, const pcount_t *p)
+{
+	static const char	*names[PC_NUM] = {
+		"Cycles:", "Instrs:", "LLC miss:", "CPU time:", "Switches:",
+		"Migrate:"
+	};
+	double			n = p->msgs ? (double)p->msgs : 1.0;
+	int			i;
+
+	printf("%s (%" PRIu64 " messages%s):\n", title, p->msgs,
+	    p->user ? ", user only" : "");
+	for (i = 0; i < PC_NUM; i++) {
+		printf("%-10s", names[i]);
+		if (!(p->have & (1u << i))) {
+			printf("n/a\n");
+		} else if (i == PC_CPU) {
+			printf("%.2f us%s\n", p->v[i] / n / 1000.0,
+			    (p->rusage & (1u << i)) ? " (getrusage)" : "");
+		} else {
+			printf("%.3f%s\n", p->v[i] / n,
+			    (p->rusage & (1u << i)) ? " (getrusage)" : "");
+		}
+	}
+	if ((p->have & (1u << PC_CYCLES)) && (p->have & (1u << PC_INSNS)) &&
+	    p->v[PC_CYCLES] != 0) {
+		printf("IPC:      %.2f\n",
+		    (double)p->v[PC_INSNS] / p->v[PC_CYCLES]);
+	}
+}
+
+/*
+ * With the busy_poll option, a receive doesn't block at once: it is tried
+ * without waiting, over and over, until something comes, sparing the
+ * wakeup that a blocked thread pays.  Given a time, the receive gives up
+ * spinning after that long and blocks as before, so that a quiet
+ * connection doesn't hold a CPU.  The time spent spinning is counted, so
+ * that it can be weighed against the latency it saves.
+ */
+typedef struct spin {
+	uint64_t	recvs;		/* receives made */
+	uint64_t	waits;		/* of those, that found nothing at once */
+	uint64_t	blocked;	/* of those, that spun out and blocked */
+	uint64_t	spun;		/* ns spent spinning */
+} spin_t;
+
+static int	busy_poll = 0;
+static uint64_t	spin_limit = 0;		/* 0 spins without limit */
+
+/*
+ * spin_again is called each time a receive finds nothing; *begin is 0 on
+ * the first.  It returns 1 to try again, or 0 if it is time to block.
+ */
+static int
+spin_again(spin_t *sp, uint64_t *begin)
+{
+	uint64_t	now = gethrtime();
+
+	if (*begin == 0) {
+		*begin = now;
+		sp->waits++;
+		return (1);
+	}
+	if (spin_limit != 0 && now - *begin >= spin_limit) {
+		sp->spun += now - *begin;
+		sp->blocked++;
+		*begin = 0;
+		return (0);
+	}
+	return (1);
+}
+
+/*
+ * spin_done ends a receive's spinning, if it had not already blocked.
+ */
+static void
+spin_done(spin_t *sp, uint64_t begin)
+{
+	sp->recvs++;
+	if (begin != 0) {
+		sp->spun += gethrtime() - begin;
+	}
+}
+
+/*
+ * report_spin reports on busy polling, over elapsed ns of thread time.
+ */
+static void
+report_spin(const char *title, const spin_t *sp, uint64_t elapsed)
+{
+	printf("%s:\n", title);
+	printf("Waited:   %" PRIu64 " of %" PRIu64 " receives\n",
+	    sp->waits, sp->recvs);
+	printf("Spinning: %.1f ms, %.2f us per wait", sp->spun / 1e6,
+	    sp->waits ? sp->spun / 1000.0 / sp->waits : 0.0);
+	if (elapsed != 0) {
+		printf(", %.1f%% of the time", sp->spun * 100.0 / elapsed);
+	}
+	printf("\n");
+	printf("Blocked:  %" PRIu64 " (%.1f%% of waits)\n", sp->blocked,
+	    sp->waits ? sp->blocked * 100.0 / sp->waits : 0.0);
+}
+
 /*
  * Each thread in the sending system is driven by a single state.
  * This allows us to set up the test, but otherwise each thread runs
@@ -128,6 +817,7 @@ typedef struct test_header {
  */
 typedef struct test {
 	int		sock;
+	const transport_t *tp;		/* transport for the socket */
 	uint64_t	sseqno;
 	uint64_t	rseqno;
 	uint32_t	rdly_min;	/* reply delay (ns) */
@@ -147,35 +837,64 @@ typedef struct test {
 	struct addrinfo *lai;		/* local addr to bind (client only) */
 	socklen_t	addrlen;
 	sample_t	*samples;
+	uint64_t	nsamples;	/* room in samples */
+	uint32_t	bufsz;		/* stream/replier buffer size */
+	uint64_t	tsintvl;	/* time series interval (ns) */
+	uint64_t	sbytes;		/* bytes sent */
+	uint64_t	rbytes;		/* bytes received */
+	uint64_t	begin;		/* time of first send */
+	uint64_t	end;		/* time of last receive */
+	uint64_t	*tseries;	/* bytes per time series interval */
+	uint32_t	ntseries;
+	uint32_t	batch;		/* datagrams per system call */
+	uint32_t	window;		/* requests in flight (sync mode) */
+	uint64_t	expect;		/* replies asked for */
+	int		done;		/* sender has finished */
+	int		skip;		/* sits out the current trial */
+	span_t		warmup;		/* excluded from the results */
+	span_t		cooldown;	/* likewise */
+	uint64_t	duration;	/* measure for this long, not count */
+	enum phase	phase;
+	uint64_t	pbegin;		/* when the current phase began */
+	uint64_t	pfirst;		/* and its first message */
+	uint64_t	mbegin;		/* measurement window, by send time */
+	uint64_t	mend;
+	unsigned int	seed;		/* for range(), at each trial */
+	struct test	*peer;		/* other half of a sender pair */
+	seqtrack_t	st;		/* datagram sequence accounting */
+	pacer_t		pace;		/* send schedule */
+	tentry_t	*trace;		/* messages to replay, if any */
+	pcount_t	pc;		/* the perf option's counters */
+	spin_t		spin;		/* the busy_poll option's counts */
+	oring_t		*oring;		/* the outlier option's ring */
+	uint64_t	behind;		/* replayed later than REPLAY_LATE */
+	uint64_t	tprev;		/* time of the previous send */
+	hist_t		scall;		/* time spent in send calls */
+	uint16_t	nchunk;		/* replies to ask for, per request */
+	uint32_t	cdly;		/* and the delay between them */
+	hist_t		cfirst;		/* time to the first reply chunk */
+	hist_t		clast;		/* and to the last */
+	hist_t		cgap;		/* time between chunks */
+	uint64_t	cprev;		/* arrival of the previous chunk */
+	mtarget_t	*mt;		/* metrics, by destination */
+	mblock_t	*m;
+	int		nbio;		/* socket is non-blocking */
+	int		rxstamp;	/* kernel stamps arrivals */
+	uint64_t	rxtime;		/* arrival of the last data read */
+	tcpsample_t	*tcpinfo;	/* TCP_INFO samples */
+	uint32_t	ntcpinfo;
+#ifdef HAVE_OPENSSL
+	SSL		*ssl;		/* TLS session, if any */
+	pthread_mutex_t	*tlsmx;		/* shared by sender and receiver */
+	int		tlsfast;	/* kernel does all record I/O */
+	int		ktls;		/* kTLS in use: 1 = tx, 2 = rx */
+	uint64_t	hslat;		/* TLS handshake latency (ns) */
+	uint64_t	hsbegin;	/* when the handshake began */
+	const char	*tlsver;	/* negotiated protocol */
+	const char	*tlscipher;	/* negotiated cipher */
+#endif
 } test_t;
 
-/*
- * randtime determines the number of nsec used for each call to random().
- * The idea here is that we can use random() as a busy worker to spin.  This
- * will prevent it from being optimized away, and gives us some idea of the
- * involved with each iteration.
- */
-uint64_t
-randtime(void)
-{
-	uint64_t now, end;
-	static uint64_t rtime;
-	int i;
-
-	if (rtime < 1) {
-		now = gethrtime();
-		for (i = 0; i < 1U << 20; i++) {
-			random();
-		}
-		end = gethrtime();
-		rtime = (end - now) >> 20;
-	}
-	if (rtime < 1) {
-		rtime = 1;
-	}
-	return rtime;
-}
-
 int
 cmpu64(const void *u1, const void *u2)
 {
@@ -198,67 +917,243 @@ pctile(uint64_t *samples, size_t nsamples, double pctile)
 	return ((samples[(int)k-1]+samples[(int)k])/2.0);
 }
 
-/*
- * ndelay waits a given number of nsec.  It does this by sleeping for large
- * values of nsec, but will spin when a smaller delay is required.
- */
-void
-ndelay(uint32_t nsec)
+static inline int
+hist_bucket(uint64_t v)
 {
-	uint64_t now, end;
-	end = gethrtime() + nsec;
-	while ((now = gethrtime()) < end) {
-		if ((end - now) > 1000000) {
-			struct timespec ts;
-			ts.tv_sec = 0;
-			ts.tv_nsec = end - now;
-			/* we'll probably sleep too long, that's ok */
-			nanosleep(&ts, NULL);
-			continue;
-		}
-		/*
-		 * Do some work, shouldn't take long, but this eases the pressure
-		 * we put on gethrtime.
-		 */
-		random();
+	int e;
+
+	if (v < HIST_SUB) {
+		return ((int)v);
 	}
+	e = 63 - __builtin_clzll(v);
+	return (((e - HIST_SUBBITS + 1) << HIST_SUBBITS) |
+	    (int)((v >> (e - HIST_SUBBITS)) & (HIST_SUB - 1)));
 }
 
 /*
- * range returns a value chosen at random between a min and a max.  The value
- * is chosen using rand(), so this is not suitable for cryptographic purposes.
+ * hist_value returns the smallest value that lands in bucket i.
  */
-uint32_t
-range(uint32_t minval, uint32_t maxval)
+uint64_t
+hist_value(int i)
 {
-	uint32_t val = minval;
+	int e;
 
-	if (maxval > minval) {
-		val += (rand() % (maxval - minval));
+	if (i < HIST_SUB) {
+		return (i);
 	}
-	return (val);
+	e = (i >> HIST_SUBBITS) + HIST_SUBBITS - 1;
+	return ((1ull << e) |
+	    ((uint64_t)(i & (HIST_SUB - 1)) << (e - HIST_SUBBITS)));
 }
 
-/*
- * senderreceiver is a pthread worker that sends a single message and expects
- * a reply.
- */
-void *
-senderreceiver(void *arg)
+static inline void
+hist_add(hist_t *h, uint64_t v)
 {
-	test_t		*t = arg;
-	char		*sbuf, *rbuf, *sptr, *rptr;
-	uint64_t	stime, now, deltat;
-	uint32_t	nbytes = 0;
-	int		rv;
-	test_header_t	*sh, *rh;
-	int		i;
-	int		good = 0;
-	int		count;
+	if (h->count == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->count++;
+	h->sum += v;
+	h->b[hist_bucket(v)]++;
+}
 
-	sbuf = malloc(maxmsg);
-	rbuf = malloc(maxmsg);
+void
+hist_merge(hist_t *dst, const hist_t *src)
+{
+	int i;
+
+	if (src->count == 0) {
+		return;
+	}
+	if (dst->count == 0 || src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+	dst->count += src->count;
+	dst->sum += src->sum;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		dst->b[i] += src->b[i];
+	}
+}
+
+/*
+ * hist_pctile estimates a percentile as the middle of the bucket holding
+ * it, kept within the smallest and largest values actually seen.
+ */
+double
+hist_pctile(const hist_t *h, double pctile)
+{
+	uint64_t	rank, seen = 0;
+	double		v;
+	int		i;
+
+	if (h->count == 0) {
+		return (0.0);
+	}
+	rank = (uint64_t)ceil(h->count * pctile / 100.0);
+	rank = max(rank, 1);
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		if ((seen += h->b[i]) >= rank)
+			break;
+	}
+	v = (hist_value(i) + (hist_value(i + 1) - 1)) / 2.0;
+	v = max(v, (double)h->min);
+	v = min(v, (double)h->max);
+	return (v);
+}
+
+/*
+ * cpu_relax tells the CPU that we're spinning, which saves power and
+ * gives a hyperthread sibling more of the core.
+ */
+static inline void
+cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/*
+ * Sleeping always wakes up late, by an amount that depends on the system.
+ * pace_margin is how far ahead of a deadline we aim to wake, before spinning
+ * the rest of the way; it is measured by pace_calibrate().
+ */
+uint64_t pace_margin = 100000;
+
+static void
+sleep_until(uint64_t when)
+{
+	struct timespec ts;
+
+#if defined(HAVE_CLOCK_NANOSLEEP) && !defined(HAVE_GETHRTIME)
+	/* same clock as gethrtime(), so sleep to the absolute time */
+	ts.tv_sec = when / 1000000000ull;
+	ts.tv_nsec = when % 1000000000ull;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	    EINTR)
+		;
+#else
+	uint64_t now = gethrtime();
+
+	if (when <= now) {
+		return;
+	}
+	ts.tv_sec = (when - now) / 1000000000ull;
+	ts.tv_nsec = (when - now) % 1000000000ull;
+	(void) nanosleep(&ts, NULL);
+#endif
+}
+
+/*
+ * pace_until waits until the deadline, returning the time it got there.
+ * It sleeps until pace_margin before the deadline, then spins.
+ */
+uint64_t
+pace_until(uint64_t deadline)
+{
+	uint64_t now = gethrtime();
+
+	if (deadline > now + pace_margin) {
+		sleep_until(deadline - pace_margin);
+		now = gethrtime();
+	}
+	while (now < deadline) {
+		cpu_relax();
+		now = gethrtime();
+	}
+	return (now);
+}
+
+/*
+ * pace_calibrate measures how late sleeps wake up, and sets pace_margin
+ * to cover all but the worst of them.
+ */
+void
+pace_calibrate(void)
+{
+	uint64_t	late[64];
+	uint64_t	when;
+	int		i;
+
+	for (i = 0; i < 64; i++) {
+		when = gethrtime() + 100000;
+		sleep_until(when);
+		late[i] = gethrtime() - when;
+	}
+	qsort(late, 64, sizeof (uint64_t), cmpu64);
+	pace_margin = late[60] + 5000;
+	pace_margin = max(pace_margin, 10000);
+	pace_margin = min(pace_margin, 2000000);
+}
+
+/*
+ * ndelay waits a given number of nsec.
+ */
+void
+ndelay(uint32_t nsec)
+{
+	if (nsec != 0) {
+		(void) pace_until(gethrtime() + nsec);
+	}
+}
+
+/*
+ * pace waits until interval nsec after the pacer's previous deadline.  If
+ * the caller has fallen more than an interval behind, the schedule restarts
+ * from now, rather than sending a burst to catch up.
+ */
+void
+pace(pacer_t *p, uint32_t interval)
+{
+	uint64_t now, deadline;
+
+	if (interval == 0) {
+		return;
+	}
+	now = gethrtime();
+	if (p->next == 0 || p->next + interval < now) {
+		p->next = now;
+	}
+	deadline = p->next + interval;
+	now = pace_until(deadline);
+	hist_add(&p->err, now - deadline);
+	p->next = deadline;
+}
+
+/*
+ * Each thread draws its random values from its own sequence, which it
+ * seeds from its test, so that two tests given the same seed send the
+ * same sizes at the same intervals.
+ */
+static __thread unsigned int range_seed = 1;
+
+/*
+ * range returns a value chosen at random between a min and a max.  The value
+ * is chosen using rand_r(), so this is not suitable for cryptographic
+ * purposes.
+ */
+uint32_t
+range(uint32_t minval, uint32_t maxval)
+{
+	uint32_t val = minval;
+
+	if (maxval > minval) {
+		val += (rand_r(&range_seed) % (maxval - minval));
+	}
+	return (val);
+}
 
+/*
+ * wait_start blocks the calling worker until main() releases all of the
+ * workers together, so that they begin the test at the same moment.
+ */
+void
+wait_start(void)
+{
 	pthread_mutex_lock(&startmx);
 	start_wait++;
 	pthread_cond_signal(&waitcv);
@@ -266,584 +1161,6448 @@ senderreceiver(void *arg)
 		pthread_cond_wait(&startcv, &startmx);
 	}
 	pthread_mutex_unlock(&startmx);
+}
 
-	rptr = rbuf;
-	count = t->count;
-	t->rintvl = 1;
+/*
+ * A vlist holds the values given for an option that may be swept.  It is
+ * written either as a list, "a:b:c", or as a range "lo..hi", which steps
+ * by one, "lo..hi+step", or "lo..hi*factor".
+ */
+typedef struct vlist {
+	uint64_t	*v;
+	int		n;
+} vlist_t;
 
-	if (count < 1) {
-		fprintf(stderr, "count must be at least 1\n");
-		exit(1);
+#define	VLIST_MAX	1000
+
+/*
+ * vlist_parse parses str into l, returning 0 on success or -1 if it is
+ * malformed.  A single value is a list of one.
+ */
+int
+vlist_parse(vlist_t *l, const char *str)
+{
+	uint64_t lo, hi, step = 1, v;
+	char *end;
+	int mul = 0;
+
+	l->v = realloc(l->v, VLIST_MAX * sizeof (uint64_t));
+	l->n = 0;
+
+	lo = strtoull(str, &end, 10);
+	if (end == str) {
+		return (-1);
+	}
+	if (strncmp(end, "..", 2) != 0) {
+		l->v[l->n++] = lo;
+		while (*end == ':') {
+			str = end + 1;
+			v = strtoull(str, &end, 10);
+			if (end == str || l->n == VLIST_MAX) {
+				return (-1);
+			}
+			l->v[l->n++] = v;
+		}
+		return (*end == '\0' ? 0 : -1);
+	}
+
+	str = end + 2;
+	hi = strtoull(str, &end, 10);
+	if (end == str || hi < lo) {
+		return (-1);
+	}
+	if (*end == '+' || *end == '*') {
+		mul = (*end == '*');
+		str = end + 1;
+		step = strtoull(str, &end, 10);
+		if (end == str || step < (mul ? 2 : 1)) {
+			return (-1);
+		}
+	}
+	if (*end != '\0' || (mul && lo == 0)) {
+		return (-1);
+	}
+	for (v = lo; v <= hi; v = mul ? v * step : v + step) {
+		if (l->n == VLIST_MAX) {
+			return (-1);
+		}
+		l->v[l->n++] = v;
+	}
+	return (0);
+}
+
+/*
+ * span_parse parses str into sp: a number of messages, or a time if it
+ * has one of the suffixes ns, us, ms or s.  Returns 0 on success or -1
+ * if it is malformed.
+ */
+int
+span_parse(span_t *sp, const char *str)
+{
+	static const struct {
+		const char	*sfx;
+		uint64_t	mult;
+	} units[] = {
+		{ "ns", 1 },
+		{ "us", 1000 },
+		{ "ms", 1000000 },
+		{ "s", 1000000000 },
+	};
+	char *end;
+	int i;
+
+	sp->v = strtoull(str, &end, 10);
+	sp->time = 0;
+	if (end == str) {
+		return (-1);
+	}
+	if (*end == '\0') {
+		return (0);
+	}
+	for (i = 0; i < sizeof (units) / sizeof (units[0]); i++) {
+		if (strcmp(end, units[i].sfx) == 0) {
+			sp->v *= units[i].mult;
+			sp->time = 1;
+			return (0);
+		}
+	}
+	return (-1);
+}
+
+/*
+ * vlist_default makes an empty list hold the single value v.
+ */
+void
+vlist_default(vlist_t *l, uint64_t v)
+{
+	if (l->n == 0) {
+		l->v = realloc(l->v, sizeof (uint64_t));
+		l->v[l->n++] = v;
+	}
+}
+
+/*
+ * vlist_max returns the largest value in a list.
+ */
+uint64_t
+vlist_max(const vlist_t *l)
+{
+	uint64_t m = 0;
+	int i;
+
+	for (i = 0; i < l->n; i++) {
+		m = max(m, l->v[i]);
+	}
+	return (m);
+}
+
+/*
+ * trial_wait is called by a worker each time it is ready for a trial,
+ * including before the first.  It returns 1 when main() starts the next
+ * trial, or 0 once there are to be no more.  gen tracks the last trial
+ * this worker ran.
+ */
+int
+trial_wait(int *gen)
+{
+	int rv;
+
+	pthread_mutex_lock(&startmx);
+	trial_idle++;
+	pthread_cond_signal(&waitcv);
+	while (*gen == trial_gen && !trial_over) {
+		pthread_cond_wait(&startcv, &startmx);
+	}
+	*gen = trial_gen;
+	rv = !trial_over;
+	pthread_mutex_unlock(&startmx);
+	return (rv);
+}
+
+/*
+ * trial_exit is called by a worker that is leaving, possibly part way
+ * through a trial, so that main() does not wait for it to finish.
+ */
+void
+trial_exit(void)
+{
+	pthread_mutex_lock(&startmx);
+	trial_live--;
+	pthread_cond_signal(&waitcv);
+	pthread_mutex_unlock(&startmx);
+}
+
+/*
+ * trial_run waits until every worker is ready, clears the results of any
+ * earlier trial, starts the workers on a trial together, and waits for
+ * them all to finish it.  The times at which the trial began and ended
+ * are returned.
+ */
+void
+trial_run(test_t *tests, int nthreads, uint64_t *begin, uint64_t *end)
+{
+	int i;
+
+	pthread_mutex_lock(&startmx);
+	while (trial_idle < trial_live) {
+		pthread_cond_wait(&waitcv, &startmx);
+	}
+	for (i = 0; i < nthreads; i++) {
+		test_t *t = &tests[i];
+		t->replies = 0;
+		t->expect = 0;
+		t->done = 0;
+		t->mbegin = 0;
+		t->mend = UINT64_MAX;
+	}
+	trial_idle = 0;
+	*begin = start_time = gethrtime();
+	trial_gen++;
+	pthread_cond_broadcast(&startcv);
+	while (trial_idle < trial_live) {
+		pthread_cond_wait(&waitcv, &startmx);
+	}
+	*end = gethrtime();
+	pthread_mutex_unlock(&startmx);
+}
+
+/*
+ * span_over returns 1 once a phase that began at time begin, with message
+ * first, has run for the span sp by the time message n is sent at now.
+ */
+static int
+span_over(const span_t *sp, uint64_t begin, uint64_t first, uint64_t n,
+    uint64_t now)
+{
+	return (sp->time ? now - begin >= sp->v : n - first >= sp->v);
+}
+
+/*
+ * phase_advance moves a trial on from phase ph through any phases that
+ * are over by the time message n is sent at now, updating the start of
+ * the current phase in *begin and *first.
+ */
+static enum phase
+phase_advance(const test_t *t, enum phase ph, uint64_t *begin,
+    uint64_t *first, uint64_t n, uint64_t now)
+{
+	int over;
+
+	for (;;) {
+		switch (ph) {
+		case PHASE_WARMUP:
+			over = span_over(&t->warmup, *begin, *first, n, now);
+			break;
+		case PHASE_MEASURE:
+			over = t->duration ? now - *begin >= t->duration :
+			    n - *first >= t->count;
+			break;
+		case PHASE_COOLDOWN:
+			over = span_over(&t->cooldown, *begin, *first, n, now);
+			break;
+		default:
+			return (ph);
+		}
+		if (!over) {
+			return (ph);
+		}
+		ph++;
+		*begin = now;
+		*first = n;
+	}
+}
+
+/*
+ * trial_last is called by a sender as it sends message n of a trial, at
+ * now.  It keeps track of the trial's phases, recording the measurement
+ * window, and returns 1 if this is the last message to send: either the
+ * count of messages will run out with it, or time ran out before it.
+ * The last message always asks for a reply, so that the receiver can
+ * tell when the trial is over.
+ */
+int
+trial_last(test_t *t, uint64_t n, uint64_t now)
+{
+	enum phase ph;
+	uint64_t begin, first;
+
+	if (n == 0) {
+		t->phase = PHASE_WARMUP;
+		t->pbegin = now;
+		t->pfirst = 0;
+	}
+	ph = phase_advance(t, t->phase, &t->pbegin, &t->pfirst, n, now);
+	if (t->phase < PHASE_MEASURE && ph >= PHASE_MEASURE) {
+		t->mbegin = now;
+	}
+	if (t->phase < PHASE_COOLDOWN && ph >= PHASE_COOLDOWN) {
+		t->mend = now;
+	}
+	t->phase = ph;
+	if (ph == PHASE_DONE) {
+		return (1);
+	}
+
+	/* would the next message find the trial over, by count alone? */
+	begin = t->pbegin;
+	first = t->pfirst;
+	return (phase_advance(t, ph, &begin, &first, n + 1, now) ==
+	    PHASE_DONE);
+}
+
+/*
+ * in_window returns 1 if a reply to a message sent at when is within the
+ * measurement window of test t.  The receiving half of a pair uses the
+ * window of its sender.
+ */
+static int
+in_window(const test_t *t, uint64_t when)
+{
+	const test_t *w = (t->peer != NULL && t->peer < t) ? t->peer : t;
+
+	return (when >= w->mbegin && when < w->mend);
+}
+
+/*
+ * sample_next returns the slot for the sample of the next reply, making
+ * room when a run goes on past the space reserved for it.
+ */
+static sample_t *
+sample_next(test_t *t)
+{
+	if (t->replies >= t->nsamples) {
+		t->nsamples = max(2 * t->nsamples, 1024);
+		t->samples = realloc(t->samples,
+		    t->nsamples * sizeof (sample_t));
+		if (t->samples == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	return (&t->samples[t->replies]);
+}
+
+/*
+ * outlier_check logs a sample if it is over the threshold, along with the
+ * time since the flow's previous message was sent (which the sender puts
+ * in each header, so that it counts messages that wanted no reply), and
+ * inflight, the number of requests still waiting for replies.
+ */
+static void
+outlier_check(test_t *t, const test_header_t *h, const sample_t *sp,
+    uint64_t inflight)
+{
+	oring_t		*r = t->oring;
+	outlier_t	*o;
+	uint64_t	gap;
+
+	if (r == NULL) {
+		return;
+	}
+	gap = (h->tsp != 0 && h->ts1 > h->tsp) ? h->ts1 - h->tsp : 0;
+	if (r->pct != 0) {
+		hist_add(&r->seen, sp->lat);
+		if (r->seen.count % OUTLIER_LEARN == 0) {
+			r->lim = (uint64_t)hist_pctile(&r->seen, r->pct);
+		}
+	}
+	if (sp->lat <= r->lim) {
+		return;
+	}
+	if (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >=
+	    OUTLIER_RING) {
+		r->dropped++;
+		return;
+	}
+	o = &r->e[r->head % OUTLIER_RING];
+	o->when = sp->when;
+	o->seqno = h->seqno;
+	o->lat = sp->lat;
+	o->fwd = sp->fwd;
+	o->svc = sp->svc;
+	o->queue = sp->queue;
+	o->gap = gap;
+	o->inflight = inflight;
+	o->ssz = h->ssz;
+	o->rsz = h->rsz;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * sample_set records the timings of a reply, received at now.  The round
+ * trip leaves out the time the replier spent on it (svc), which is kept
+ * alongside, as is how long the request sat in the replier's receive
+ * queue, if the replier could tell.
+ */
+static inline void
+sample_set(sample_t *sp, const test_header_t *h, uint64_t now)
+{
+	sp->when = h->ts1;
+	sp->lat = (now - h->ts1) - (h->ts3 - h->ts2);
+	sp->fwd = (int64_t)(h->ts2 - h->ts1);
+	sp->svc = (uint32_t)min(h->ts3 - h->ts2, UINT32_MAX);
+	sp->rdly = h->rdly;
+	if (h->tsq == 0) {
+		sp->queue = -1;
+	} else if (h->tsq >= h->ts2) {
+		sp->queue = 0;		/* clocks read a little apart */
+	} else {
+		sp->queue = (int32_t)min(h->ts2 - h->tsq, INT32_MAX);
+	}
+}
+
+/*
+ * trial_end releases the workers once the last trial has been run.
+ */
+void
+trial_end(void)
+{
+	pthread_mutex_lock(&startmx);
+	trial_over = 1;
+	pthread_cond_broadcast(&startcv);
+	pthread_mutex_unlock(&startmx);
+}
+
+/*
+ * frame_len looks at the (possibly unaligned) header at the start of buf,
+ * and returns the length of the frame it describes if the entire frame is
+ * present, 0 if more data is needed, or -1 if the header is garbage.  The
+ * length is the send size for requests, or the reply size for replies.
+ */
+int
+frame_len(const char *buf, uint32_t nbytes, int reply)
+{
+	test_header_t	h;
+	uint16_t	sz;
+
+	/* the sizes come early, so a frame too short is refused at once */
+	if (nbytes < offsetof(test_header_t, tsq)) {
+		return (0);
+	}
+	memcpy(&h, buf, min(nbytes, sizeof (h)));
+	sz = reply ? h.rsz : h.ssz;
+	if ((sz < sizeof (h)) || (sz > maxmsg)) {
+		return (-1);
+	}
+	if (nbytes < sizeof (h)) {
+		return (0);
+	}
+	if (h.magic != HDR_MAGIC) {
+		return (-1);
+	}
+	return (nbytes < sz ? 0 : sz);
+}
+
+/*
+ * hdr_check looks at the (possibly unaligned) header at the start of buf,
+ * and complains and returns -1 if it came from a seqtest with a different
+ * header.  Such a peer would otherwise only show up as bad sizes, or
+ * nonsense.  A message too short to hold the header is taken to be one.
+ */
+int
+hdr_check(const char *buf, uint32_t nbytes, const char *who)
+{
+	uint32_t	magic = 0;
+
+	if (nbytes >= sizeof (test_header_t)) {
+		memcpy(&magic, buf + offsetof(test_header_t, magic),
+		    sizeof (magic));
+	}
+	if (magic == HDR_MAGIC) {
+		return (0);
+	}
+	if ((magic & ~0xffu) == (HDR_MAGIC & ~0xffu)) {
+		fprintf(stderr, "%s: peer has header version %u, this seqtest "
+		    "has %u\n", who, magic & 0xff, HDR_VERSION);
+	} else {
+		fprintf(stderr, "%s: peer is not seqtest with header version "
+		    "%u\n", who, HDR_VERSION);
+	}
+	return (-1);
+}
+
+/*
+ * seqtrack_add accounts for the arrival of seqno, returning 1 if it
+ * hasn't been seen before, and 0 if it is a duplicate.
+ */
+int
+seqtrack_add(seqtrack_t *st, uint64_t seqno, uint32_t stride)
+{
+	uint64_t	n = seqno / (stride ? stride : 1);
+	uint64_t	dist, k;
+
+	if (n >= st->next) {
+		/* forget whatever was in the slots being moved into */
+		if (n - st->next >= SEQWIN) {
+			memset(st->bits, 0, sizeof (st->bits));
+		} else {
+			for (k = st->next; k < n; k++) {
+				st->bits[(k % SEQWIN) / 64] &=
+				    ~(1ull << (k % 64));
+			}
+		}
+		st->bits[(n % SEQWIN) / 64] |= 1ull << (n % 64);
+		st->next = n + 1;
+		st->unique++;
+		return (1);
+	}
+
+	dist = st->next - 1 - n;
+	if (dist >= SEQWIN) {
+		st->late++;
+		st->unique++;
+		return (1);
+	}
+	if (st->bits[(n % SEQWIN) / 64] & (1ull << (n % 64))) {
+		st->dups++;
+		return (0);
+	}
+	st->bits[(n % SEQWIN) / 64] |= 1ull << (n % 64);
+	st->unique++;
+	st->reordered++;
+	st->sumdist += dist;
+	st->maxdist = max(st->maxdist, dist);
+	return (1);
+}
+
+/*
+ * tseries_add accounts bytes moved at time now into the thread's
+ * throughput time series, growing it as needed.
+ */
+void
+tseries_add(test_t *t, uint64_t now, uint64_t bytes)
+{
+	uint64_t	b;
+
+	if (now < start_time || t->tsintvl == 0) {
+		return;
+	}
+	b = (now - start_time) / t->tsintvl;
+	if (b >= t->ntseries) {
+		uint32_t n = max(b + 1, t->ntseries * 2);
+		t->tseries = realloc(t->tseries, n * sizeof (uint64_t));
+		if (t->tseries == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+		memset(t->tseries + t->ntseries, 0,
+		    (n - t->ntseries) * sizeof (uint64_t));
+		t->ntseries = n;
+	}
+	t->tseries[b] += bytes;
+}
+
+/*
+ * The sampler thread reads TCP_INFO for a set of connections, every
+ * interval, until it is told to stop.  A test may finish and close its
+ * socket first, and the fd may then be reused, e.g. by an idle connection,
+ * so sock_close retires the fd under sock_mx, which the sampler holds
+ * while it reads.
+ */
+static pthread_mutex_t sock_mx = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct sampler {
+	pthread_t	tid;
+	test_t		*tests;
+	int		first;		/* first test to sample */
+	int		step;		/* and then every step'th one */
+	int		ntests;
+	uint64_t	intvl;
+	volatile int	stop;
+} sampler_t;
+
+static void
+tcpinfo_sample(test_t *t, uint64_t now)
+{
+#ifdef HAVE_TCPINFO
+	struct tcp_info	ti;
+	socklen_t	len = sizeof (ti);
+	tcpsample_t	*s;
+	int		sock = t->sock;
+
+	memset(&ti, 0, sizeof (ti));
+	if (sock < 0 ||
+	    getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) != 0) {
+		return;
+	}
+	/* grow by doubling, whenever the count reaches a power of two */
+	if (t->ntcpinfo == 0 || (t->ntcpinfo >= 64 &&
+	    (t->ntcpinfo & (t->ntcpinfo - 1)) == 0)) {
+		t->tcpinfo = realloc(t->tcpinfo,
+		    max(t->ntcpinfo * 2, 64) * sizeof (tcpsample_t));
+		if (t->tcpinfo == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	s = &t->tcpinfo[t->ntcpinfo++];
+	memset(s, 0, sizeof (*s));
+	s->when = now;
+	s->rtt = ti.tcpi_rtt;
+	s->rttvar = ti.tcpi_rttvar;
+	s->cwnd = ti.tcpi_snd_cwnd;
+	s->rcv_space = ti.tcpi_rcv_space;
+	s->unacked = ti.tcpi_unacked;
+	s->retrans = ti.tcpi_total_retrans;
+#ifdef HAVE_TCPI_SND_WND
+	s->snd_wnd = ti.tcpi_snd_wnd;
+#endif
+#ifdef HAVE_TCPI_BUSY_TIME
+	s->busy = ti.tcpi_busy_time;
+	s->rwnd_limited = ti.tcpi_rwnd_limited;
+	s->sndbuf_limited = ti.tcpi_sndbuf_limited;
+#endif
+#endif /* HAVE_TCPINFO */
+}
+
+void *
+sampler_run(void *arg)
+{
+	sampler_t	*sp = arg;
+	uint64_t	next = gethrtime();
+	int		i;
+
+	while (!sp->stop) {
+		uint64_t now = gethrtime();
+		pthread_mutex_lock(&sock_mx);
+		for (i = sp->first; i < sp->ntests; i += sp->step) {
+			tcpinfo_sample(&sp->tests[i], now);
+		}
+		pthread_mutex_unlock(&sock_mx);
+		next += sp->intvl;
+		sleep_until(next);
+	}
+	return (NULL);
+}
+
+/*
+ * The outlier logger empties the tests' rings to the log every 10 ms, so
+ * that a ring only has to hold the outliers of a burst.
+ */
+typedef struct ologger {
+	pthread_t	tid;
+	test_t		*tests;
+	int		ntests;
+	FILE		*f;
+	uint64_t	epoch;
+	uint64_t	logged;
+	volatile int	stop;
+} ologger_t;
+
+static void
+outlier_drain(ologger_t *lg)
+{
+	oring_t		*r;
+	outlier_t	*o;
+	uint64_t	head;
+	int		i;
+
+	for (i = 0; i < lg->ntests; i++) {
+		if ((r = lg->tests[i].oring) == NULL) {
+			continue;
+		}
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (; r->tail < head; lg->logged++) {
+			o = &r->e[r->tail % OUTLIER_RING];
+			fprintf(lg->f, "%" PRId64 " %d %" PRIu64 " %u %u %"
+			    PRIu64 " %" PRId64 " %u %d %" PRIu64 " %" PRIu64
+			    "\n", (int64_t)(o->when - lg->epoch), r->thread,
+			    o->seqno, o->ssz, o->rsz, o->lat, o->fwd, o->svc,
+			    o->queue, o->gap, o->inflight);
+			__atomic_store_n(&r->tail, r->tail + 1,
+			    __ATOMIC_RELEASE);
+		}
+	}
+	fflush(lg->f);
+}
+
+static void *
+outlier_run(void *arg)
+{
+	ologger_t	*lg = arg;
+
+	fprintf(lg->f, "# time thread seqno ssz rsz latency fwd svc queue "
+	    "gap inflight\n");
+	while (!lg->stop) {
+		outlier_drain(lg);
+		sleep_until(gethrtime() + 10000000);
+	}
+	outlier_drain(lg);
+	return (NULL);
+}
+
+/*
+ * The jitter option runs a probe in the manner of cyclictest: a thread,
+ * at real-time priority if it can get it, that sleeps for a fixed interval
+ * and measures how late it wakes.  Lateness the sender and replier didn't
+ * cause, such as the host scheduler or a hypervisor taking the CPU away,
+ * shows up here too.  Each wakeup later than the stall threshold is kept
+ * as a stall, from when the probe should have woken until it did, so that
+ * slow messages can be checked against them.
+ */
+#define	JITTER_STALLS	(1u << 20)	/* the most stalls kept */
+#define	JITTER_EVERY	10000000000ull	/* summary interval, with no end */
+
+typedef struct stall {
+	uint64_t	start;
+	uint64_t	end;
+} stall_t;
+
+typedef struct jprobe {
+	pthread_t	tid;
+	uint64_t	intvl;
+	uint64_t	thresh;		/* lateness that counts as a stall */
+	int		summary;	/* print a summary now and then */
+	int		rt;		/* running at real-time priority */
+	volatile int	stop;
+	hist_t		late;
+	stall_t		*stalls;
+	uint64_t	nstalls;
+	uint64_t	dropped;	/* past JITTER_STALLS */
+	uint64_t	begin;
+	uint64_t	end;
+} jprobe_t;
+
+/*
+ * jitter_summary prints a line for the stalls since the last one, with the
+ * wall clock time of the longest, for comparing with the other end.
+ */
+static void
+jitter_summary(jprobe_t *jp, uint64_t since, uint64_t now)
+{
+	stall_t		*lg = NULL;
+	struct timeval	tv;
+	struct tm	tm;
+	time_t		sec;
+	uint64_t	i, ago;
+	char		buf[32];
+
+	for (i = 0; i < jp->nstalls; i++) {
+		if (lg == NULL || jp->stalls[i].end - jp->stalls[i].start >
+		    lg->end - lg->start) {
+			lg = &jp->stalls[i];
+		}
+	}
+	printf("Jitter: %" PRIu64 " wakeups in %.1f s, p99 %.1f us, max "
+	    "%.1f us, %" PRIu64 " stalls over %.1f us", jp->late.count,
+	    (now - since) / 1e9, hist_pctile(&jp->late, 99.0) / 1000.0,
+	    jp->late.max / 1000.0, jp->nstalls + jp->dropped,
+	    jp->thresh / 1000.0);
+	if (lg != NULL) {
+		(void) gettimeofday(&tv, NULL);
+		ago = gethrtime() - lg->start;
+		sec = tv.tv_sec - (time_t)(ago / 1000000000ull);
+		if (tv.tv_usec < (ago % 1000000000ull) / 1000) {
+			sec--;
+			tv.tv_usec += 1000000;
+		}
+		tv.tv_usec -= (ago % 1000000000ull) / 1000;
+		(void) localtime_r(&sec, &tm);
+		(void) strftime(buf, sizeof (buf), "%H:%M:%S", &tm);
+		printf(", longest %.1f us at %s.%06ld",
+		    (lg->end - lg->start) / 1000.0, buf, (long)tv.tv_usec);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+static void *
+jitter_run(void *arg)
+{
+	jprobe_t		*jp = arg;
+	struct sched_param	sp;
+	uint64_t		next, now, since;
+
+	/* as high as we may, but below the kernel's own threads */
+	memset(&sp, 0, sizeof (sp));
+	sp.sched_priority = sched_get_priority_max(SCHED_FIFO) / 2;
+	jp->rt = (pthread_setschedparam(pthread_self(), SCHED_FIFO,
+	    &sp) == 0);
+
+	jp->begin = since = next = gethrtime();
+	while (!jp->stop) {
+		next += jp->intvl;
+		sleep_until(next);
+		now = gethrtime();
+		hist_add(&jp->late, now > next ? now - next : 0);
+		if (now > next + jp->thresh) {
+			if (jp->nstalls < JITTER_STALLS) {
+				jp->stalls[jp->nstalls].start = next;
+				jp->stalls[jp->nstalls].end = now;
+				jp->nstalls++;
+			} else {
+				jp->dropped++;
+			}
+		}
+		if (now > next + jp->intvl) {
+			/* don't try to make up the wakeups we missed */
+			next = now;
+		}
+		if (jp->summary && now - since >= JITTER_EVERY) {
+			if (jp->nstalls + jp->dropped != 0) {
+				jitter_summary(jp, since, now);
+			}
+			memset(&jp->late, 0, sizeof (jp->late));
+			jp->nstalls = jp->dropped = 0;
+			since = now;
+		}
+	}
+	jp->end = gethrtime();
+	return (NULL);
+}
+
+static void
+jitter_start(jprobe_t *jp, int summary)
+{
+	jp->summary = summary;
+	if ((jp->stalls = malloc(JITTER_STALLS * sizeof (stall_t))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	pthread_create(&jp->tid, NULL, jitter_run, jp);
+}
+
+/*
+ * Transports.  All socket handling for a test goes through the transport
+ * chosen for its address, so the workers needn't care whether they are
+ * speaking plain TCP, TLS, or using a Unix domain socket.  Each operation
+ * returns -1 (with errno set) on failure, and send and recv behave as the
+ * system calls do.  accept() fills in the socket of a new test, which is
+ * otherwise a copy of the listening test.
+ */
+struct transport {
+	const char	*name;
+	int		(*open)(test_t *);
+	int		(*connect)(test_t *);
+	int		(*listen)(test_t *);
+	int		(*accept)(test_t *, test_t *);
+	int		(*send)(test_t *, const void *, size_t);
+	int		(*recv)(test_t *, void *, size_t);
+	void		(*close)(test_t *);
+};
+
+/*
+ * Socket tuning given with -o, applied to every socket as it is opened
+ * (and so inherited by the replier's accepted sockets).  Zero (or NULL)
+ * leaves the system's default alone.
+ */
+int sock_sndbuf = 0;
+int sock_rcvbuf = 0;
+int sock_lowat = 0;
+int sock_busypoll = 0;
+const char *sock_cc = NULL;
+
+static void
+sock_tune(test_t *t, int tcp)
+{
+	if (sock_sndbuf != 0 && setsockopt(t->sock, SOL_SOCKET, SO_SNDBUF,
+	    &sock_sndbuf, sizeof (sock_sndbuf)) != 0)
+		perror("setting SO_SNDBUF");
+	if (sock_rcvbuf != 0 && setsockopt(t->sock, SOL_SOCKET, SO_RCVBUF,
+	    &sock_rcvbuf, sizeof (sock_rcvbuf)) != 0)
+		perror("setting SO_RCVBUF");
+#ifdef SO_BUSY_POLL
+	if (sock_busypoll != 0 && setsockopt(t->sock, SOL_SOCKET,
+	    SO_BUSY_POLL, &sock_busypoll, sizeof (sock_busypoll)) != 0)
+		perror("setting SO_BUSY_POLL");
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+	if (sock_busypoll != 0 && setsockopt(t->sock, SOL_SOCKET,
+	    SO_PREFER_BUSY_POLL, &sock_busypoll, sizeof (sock_busypoll)) != 0)
+		perror("setting SO_PREFER_BUSY_POLL");
+#endif
+	if (!tcp) {
+		return;
+	}
+#ifdef TCP_NOTSENT_LOWAT
+	if (sock_lowat != 0 && setsockopt(t->sock, IPPROTO_TCP,
+	    TCP_NOTSENT_LOWAT, &sock_lowat, sizeof (sock_lowat)) != 0)
+		perror("setting TCP_NOTSENT_LOWAT");
+#endif
+#ifdef TCP_CONGESTION
+	if (sock_cc != NULL && setsockopt(t->sock, IPPROTO_TCP,
+	    TCP_CONGESTION, sock_cc, strlen(sock_cc)) != 0)
+		perror("setting TCP_CONGESTION");
+#endif
+}
+
+static int
+tcp_open(test_t *t)
+{
+	int on = 1;
+
+	if ((t->sock = socket(t->addr->sa_family, SOCK_STREAM, 0)) < 0) {
+		return (-1);
+	}
+	if (setsockopt(t->sock, IPPROTO_TCP, TCP_NODELAY,
+	    &on, sizeof (on)) != 0)
+		perror("setting TCP_NODELAY");
+	sock_tune(t, 1);
+
+	if (t->lai != NULL) {
+		if (bind(t->sock, (struct sockaddr *) t->lai->ai_addr,
+		    t->lai->ai_addrlen) == -1) {
+			perror("binding sender");
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+static int
+unix_open(test_t *t)
+{
+	if ((t->sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return (-1);
+	}
+	sock_tune(t, 0);
+	return (0);
+}
+
+static int
+sock_connect(test_t *t)
+{
+	return (connect(t->sock, t->addr, t->addrlen));
+}
+
+static int
+sock_listen(test_t *t)
+{
+	if (bind(t->sock, t->addr, t->addrlen) < 0) {
+		return (-1);
+	}
+	return (listen(t->sock, SOMAXCONN));
+}
+
+static int
+unix_listen(test_t *t)
+{
+	/* a stale socket left by an earlier run would make bind fail */
+	(void) unlink(((struct sockaddr_un *)t->addr)->sun_path);
+	return (sock_listen(t));
+}
+
+static int
+sock_accept(test_t *l, test_t *t)
+{
+	struct sockaddr_storage	sa;
+	socklen_t		slen = sizeof (sa);
+
+	t->sock = accept(l->sock, (void *)&sa, &slen);
+	return (t->sock < 0 ? -1 : 0);
+}
+
+static int
+sock_send(test_t *t, const void *buf, size_t len)
+{
+	return (send(t->sock, buf, len, 0));
+}
+
+#ifdef HAVE_RXSTAMP
+#define	RXSTAMP_SPACE	CMSG_SPACE(sizeof (struct timespec))
+
+/*
+ * rx_stamp finds the kernel's receive timestamp in the control data of a
+ * recvmsg(), and returns it on our clock.  The kernel stamps with the wall
+ * clock, so it is taken to be as long before now as it is before the wall
+ * clock now.  Returns 0 if there is none.
+ */
+static uint64_t
+rx_stamp(struct msghdr *mh, uint64_t now)
+{
+	struct cmsghdr	*cm;
+	struct timespec	ts, wall;
+	int64_t		ago;
+
+	for (cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET ||
+		    cm->cmsg_type != SCM_TIMESTAMPNS) {
+			continue;
+		}
+		memcpy(&ts, CMSG_DATA(cm), sizeof (ts));
+		(void) clock_gettime(CLOCK_REALTIME, &wall);
+		ago = (int64_t)(wall.tv_sec - ts.tv_sec) * 1000000000 +
+		    (wall.tv_nsec - ts.tv_nsec);
+		return (now - (uint64_t)min(max(ago, 0), (int64_t)now - 1));
+	}
+	return (0);
+}
+
+/*
+ * rx_stamp_enable asks the kernel to stamp what arrives on a socket.
+ * Returns 1 if it will.
+ */
+static int
+rx_stamp_enable(int sock)
+{
+	int on = 1;
+
+	return (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on,
+	    sizeof (on)) == 0);
+}
+
+/*
+ * sock_recv_stamped is sock_recv, also noting when the data arrived.  For
+ * a stream that is when the last segment read arrived, so for anything
+ * read with it that came earlier, it is late.
+ */
+static int
+sock_recv_stamped(test_t *t, void *buf, size_t len, int flags)
+{
+	struct msghdr	mh;
+	struct iovec	iov;
+	char		ctl[RXSTAMP_SPACE];
+	int		rv;
+
+	memset(&mh, 0, sizeof (mh));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctl;
+	mh.msg_controllen = sizeof (ctl);
+	rv = recvmsg(t->sock, &mh, flags);
+	t->rxtime = (rv > 0) ? rx_stamp(&mh, gethrtime()) : 0;
+	return (rv);
+}
+#endif
+
+static int
+sock_recv_flags(test_t *t, void *buf, size_t len, int flags)
+{
+#ifdef HAVE_RXSTAMP
+	if (t->rxstamp) {
+		return (sock_recv_stamped(t, buf, len, flags));
+	}
+#endif
+	return (recv(t->sock, buf, len, flags));
+}
+
+/*
+ * sock_recv spins on the receive if busy_poll is set.  The replier's
+ * workers (nbio) do their own waiting, and spin in worker_spin instead.
+ */
+static int
+sock_recv(test_t *t, void *buf, size_t len)
+{
+	uint64_t	begin = 0;
+	int		rv;
+
+	if (!busy_poll || t->nbio) {
+		return (sock_recv_flags(t, buf, len, 0));
+	}
+	for (;;) {
+		rv = sock_recv_flags(t, buf, len, MSG_DONTWAIT);
+		if (rv >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			break;
+		}
+		if (!spin_again(&t->spin, &begin)) {
+			rv = sock_recv_flags(t, buf, len, 0);
+			break;
+		}
+	}
+	spin_done(&t->spin, begin);
+	return (rv);
+}
+
+static void
+sock_close(test_t *t)
+{
+	int	sock;
+
+	pthread_mutex_lock(&sock_mx);
+	sock = t->sock;
+	t->sock = -1;
+	pthread_mutex_unlock(&sock_mx);
+	(void) close(sock);
+}
+
+const transport_t tcp_transport = {
+	"tcp", tcp_open, sock_connect, sock_listen, sock_accept,
+	sock_send, sock_recv, sock_close
+};
+
+const transport_t unix_transport = {
+	"unix", unix_open, sock_connect, unix_listen, sock_accept,
+	sock_send, sock_recv, sock_close
+};
+
+#ifdef HAVE_OPENSSL
+SSL_CTX *tls_ctx = NULL;
+
+/*
+ * TLS is layered over either of the stream transports above.
+ */
+static const transport_t *
+tls_base(test_t *t)
+{
+	return (t->addr->sa_family == AF_UNIX ?
+	    &unix_transport : &tcp_transport);
+}
+
+/*
+ * tls_handshake completes the TLS handshake, recording how long it took.
+ * If kTLS took over both directions, the kernel does all of the record
+ * processing, and plain socket calls are used from then on.  On a
+ * non-blocking socket it may need calling again, failing with EAGAIN.
+ */
+static int
+tls_handshake(test_t *t)
+{
+	int	rv, err;
+
+	if (t->hsbegin == 0) {
+		t->hsbegin = gethrtime();
+	}
+	if ((rv = SSL_do_handshake(t->ssl)) != 1) {
+		err = SSL_get_error(t->ssl, rv);
+		if (t->nbio &&
+		    (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)) {
+			errno = EAGAIN;
+			return (-1);
+		}
+		ERR_print_errors_fp(stderr);
+		errno = EPROTO;
+		return (-1);
+	}
+	t->hslat = gethrtime() - t->hsbegin;
+	t->tlsver = SSL_get_version(t->ssl);
+	t->tlscipher = SSL_get_cipher_name(t->ssl);
+#if defined(BIO_get_ktls_send) && defined(BIO_get_ktls_recv)
+	t->ktls = (BIO_get_ktls_send(SSL_get_wbio(t->ssl)) ? 1 : 0) |
+	    (BIO_get_ktls_recv(SSL_get_rbio(t->ssl)) ? 2 : 0);
+	t->tlsfast = (t->ktls == 3) && !SSL_has_pending(t->ssl);
+#endif
+	return (0);
+}
+
+static int
+tls_new(test_t *t, int server)
+{
+	if ((t->ssl = SSL_new(tls_ctx)) == NULL ||
+	    SSL_set_fd(t->ssl, t->sock) != 1) {
+		ERR_print_errors_fp(stderr);
+		errno = EPROTO;
+		return (-1);
+	}
+	if (server) {
+		SSL_set_accept_state(t->ssl);
+	} else {
+		SSL_set_connect_state(t->ssl);
+	}
+	return (0);
+}
+
+static int
+tls_open(test_t *t)
+{
+	return (tls_base(t)->open(t));
+}
+
+static int
+tls_listen(test_t *t)
+{
+	return (tls_base(t)->listen(t));
+}
+
+/*
+ * The client handshake is done at connect time, so that it can be timed
+ * on its own.  The server handshake is left for the replier thread to
+ * complete on first use, so that a slow client doesn't hold up acceptor.
+ */
+static int
+tls_connect(test_t *t)
+{
+	if (sock_connect(t) != 0 || tls_new(t, 0) != 0) {
+		return (-1);
+	}
+	return (tls_handshake(t));
+}
+
+static int
+tls_accept(test_t *l, test_t *t)
+{
+	if (sock_accept(l, t) != 0) {
+		return (-1);
+	}
+	if (tls_new(t, 1) != 0) {
+		sock_close(t);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * tls_io performs a single SSL_read or SSL_write.  When the sender and
+ * receiver threads share a session, OpenSSL requires that they not use it
+ * at the same time, so the socket is non-blocking and the session lock is
+ * only held across the call itself; we wait for the socket outside of it.
+ * The replier's workers do their own waiting, so for them (nbio) it fails
+ * with EAGAIN instead.
+ */
+static int
+tls_io(test_t *t, void *buf, size_t len, int wr)
+{
+	struct pollfd	pfd;
+	int		rv, err;
+
+	if (!SSL_is_init_finished(t->ssl) && tls_handshake(t) != 0) {
+		return (-1);
+	}
+	if (t->tlsfast) {
+		return (wr ? send(t->sock, buf, len, 0) :
+		    recv(t->sock, buf, len, 0));
+	}
+
+	for (;;) {
+		if (t->tlsmx != NULL)
+			pthread_mutex_lock(t->tlsmx);
+		rv = wr ? SSL_write(t->ssl, buf, len) :
+		    SSL_read(t->ssl, buf, len);
+		err = (rv > 0) ? SSL_ERROR_NONE : SSL_get_error(t->ssl, rv);
+		if (t->tlsmx != NULL)
+			pthread_mutex_unlock(t->tlsmx);
+
+		switch (err) {
+		case SSL_ERROR_NONE:
+			return (rv);
+		case SSL_ERROR_ZERO_RETURN:
+			return (0);
+		case SSL_ERROR_WANT_READ:
+			pfd.events = POLLIN;
+			break;
+		case SSL_ERROR_WANT_WRITE:
+			pfd.events = POLLOUT;
+			break;
+		case SSL_ERROR_SYSCALL:
+			if (errno == 0) {
+				return (0);
+			}
+			return (-1);
+		default:
+			ERR_print_errors_fp(stderr);
+			errno = EPROTO;
+			return (-1);
+		}
+		if (t->nbio) {
+			errno = EAGAIN;
+			return (-1);
+		}
+		pfd.fd = t->sock;
+		(void) poll(&pfd, 1, -1);
+	}
+}
+
+static int
+tls_send(test_t *t, const void *buf, size_t len)
+{
+	return (tls_io(t, (void *)buf, len, 1));
+}
+
+static int
+tls_recv(test_t *t, void *buf, size_t len)
+{
+	return (tls_io(t, buf, len, 0));
+}
+
+static void
+tls_close(test_t *t)
+{
+	if (t->ssl != NULL) {
+		SSL_free(t->ssl);
+		t->ssl = NULL;
+	}
+	sock_close(t);
+}
+
+const transport_t tls_transport = {
+	"tls", tls_open, tls_connect, tls_listen, tls_accept,
+	tls_send, tls_recv, tls_close
+};
+#endif /* HAVE_OPENSSL */
+
+/*
+ * UDP sockets are connected on the sending side, so that only replies from
+ * the replier are received.  They don't accept; the replier serves every
+ * peer from its one bound socket.  The socket buffers are enlarged (as far
+ * as the system allows) to absorb bursts of datagrams.
+ */
+static int
+udp_open(test_t *t)
+{
+	int bufsz = 4 * 1024 * 1024;
+
+	if ((t->sock = socket(t->addr->sa_family, SOCK_DGRAM, 0)) < 0) {
+		return (-1);
+	}
+	(void) setsockopt(t->sock, SOL_SOCKET, SO_RCVBUF,
+	    &bufsz, sizeof (bufsz));
+	(void) setsockopt(t->sock, SOL_SOCKET, SO_SNDBUF,
+	    &bufsz, sizeof (bufsz));
+	sock_tune(t, 0);
+
+	if (t->lai != NULL) {
+		if (bind(t->sock, (struct sockaddr *) t->lai->ai_addr,
+		    t->lai->ai_addrlen) == -1) {
+			perror("binding sender");
+			return (-1);
+		}
+	}
+	return (0);
+}
+
+static int
+udp_listen(test_t *t)
+{
+	return (bind(t->sock, t->addr, t->addrlen));
+}
+
+static int
+udp_accept(test_t *l, test_t *t)
+{
+	errno = EOPNOTSUPP;
+	return (-1);
+}
+
+const transport_t udp_transport = {
+	"udp", udp_open, sock_connect, udp_listen, udp_accept,
+	sock_send, sock_recv, sock_close
+};
+
+/*
+ * transport_for selects the transport for a test's address.
+ */
+const transport_t *
+transport_for(const struct sockaddr *sa, uint32_t flags)
+{
+	if (flags & FLAG_UDP) {
+		return (&udp_transport);
+	}
+#ifdef HAVE_OPENSSL
+	if (flags & FLAG_TLS) {
+		return (&tls_transport);
+	}
+#endif
+	return (sa->sa_family == AF_UNIX ? &unix_transport : &tcp_transport);
+}
+
+/*
+ * send_all sends the entire buffer, returning -1 on error.
+ */
+int
+send_all(test_t *t, const char *buf, uint32_t len)
+{
+	int	rv;
+
+	while (len > 0) {
+		rv = t->tp->send(t, buf, len);
+		if (rv < 0) {
+			return (-1);
+		}
+		len -= rv;
+		buf += rv;
+	}
+	return (0);
+}
+
+/*
+ * A pipelining sender keeps the requests it has in flight in an outstanding
+ * table, so that each reply can be matched to its request by seqno, in
+ * whatever order the replies come back.  This is a small open addressed
+ * hash table, kept at most half full.
+ */
+typedef struct pending {
+	uint64_t	seqno;
+	uint64_t	ts1;
+	uint16_t	ssz;
+	uint16_t	used;
+} pending_t;
+
+typedef struct outstanding {
+	pending_t	*e;
+	uint32_t	mask;
+	uint32_t	count;
+} outstanding_t;
+
+static void
+outstanding_init(outstanding_t *o, uint32_t window)
+{
+	uint32_t	size = 2;
+
+	while (size < window * 2) {
+		size <<= 1;
+	}
+	if ((o->e = calloc(size, sizeof (pending_t))) == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	o->mask = size - 1;
+	o->count = 0;
+}
+
+static void
+outstanding_add(outstanding_t *o, uint64_t seqno, uint64_t ts1, uint16_t ssz)
+{
+	uint32_t	i;
+
+	for (i = seqno & o->mask; o->e[i].used; i = (i + 1) & o->mask)
+		;
+	o->e[i].seqno = seqno;
+	o->e[i].ts1 = ts1;
+	o->e[i].ssz = ssz;
+	o->e[i].used = 1;
+	o->count++;
+}
+
+/*
+ * outstanding_take removes the request with the given seqno, returning -1
+ * if there is none.  The entries after it are shifted back into the gap,
+ * so that later lookups don't stop short (Knuth's Algorithm R).
+ */
+static int
+outstanding_take(outstanding_t *o, uint64_t seqno, pending_t *p)
+{
+	uint32_t	i, j, k;
+
+	for (i = seqno & o->mask; o->e[i].seqno != seqno;
+	    i = (i + 1) & o->mask) {
+		if (!o->e[i].used) {
+			return (-1);
+		}
+	}
+	if (!o->e[i].used) {
+		return (-1);
+	}
+	*p = o->e[i];
+	o->count--;
+
+	for (;;) {
+		o->e[i].used = 0;
+		j = i;
+		for (;;) {
+			j = (j + 1) & o->mask;
+			if (!o->e[j].used) {
+				return (0);
+			}
+			k = o->e[j].seqno & o->mask;
+			/* may the entry at j move to i? */
+			if ((i <= j) ? (k <= i || k > j) : (k <= i && k > j)) {
+				break;
+			}
+		}
+		o->e[i] = o->e[j];
+		i = j;
+	}
+}
+
+/*
+ * exchange runs one trial for senderreceiver, sending count messages and
+ * receiving a reply to each.  With window=N, up to N requests are kept in
+ * flight, each reply making way for the next request; replies are matched
+ * to requests by seqno.  Unless the replier was asked to reorder them,
+ * they must still arrive in order.  Returns 0 on success, or -1 if the
+ * exchange failed.
+ */
+int
+exchange(test_t *t, char *sbuf, char *rbuf, outstanding_t *ot)
+{
+	char		*sptr, *rptr;
+	uint64_t	stime, now = 0;
+	uint32_t	nbytes = 0;
+	int		rv;
+	test_header_t	*sh, *rh;
+	pending_t	p;
+	uint64_t	sent = 0;
+	sample_t	*sp;
+	int		last = 0;
+
+	range_seed = t->seed;
+	t->tprev = 0;
+	rptr = rbuf;
+
+	for (;;) {
+
+		while (!last && ot->count < t->window) {
+			uint16_t ssz, rsz;
+			uint32_t sdly, rdly;
+			sh = (void *)sbuf;
+			sptr = sbuf;
+
+			ssz = (uint16_t) range(t->ssz_min, t->ssz_max);
+			rsz = (uint16_t) range(t->rsz_min, t->rsz_max);
+			sdly = range(t->sdly_min, t->sdly_max);
+			rdly = range(t->rdly_min, t->rdly_max);
+
+			sh->ssz = ssz;
+			sh->rsz = rsz;
+			sh->rdly = rsz ? rdly : 0;
+			sh->seqno = t->sseqno++;
+
+			pace(&t->pace, sdly);
+
+			stime = gethrtime();
+			last = trial_last(t, sent, stime);
+			sh->ts3 = 0;
+			sh->ts2 = 0;
+			sh->tsq = 0;
+			sh->cdly = 0;
+			sh->nchunk = 0;
+			sh->chunk = 0;
+			sh->magic = HDR_MAGIC;
+			sh->tsp = t->tprev;
+			sh->ts1 = t->tprev = stime;
+			outstanding_add(ot, sh->seqno, stime, ssz);
+
+			while (ssz > 0) {
+				rv = t->tp->send(t, sptr, ssz);
+				if (rv < 0) {
+					perror("sender/send");
+					return (-1);
+				}
+				ssz -= rv;
+				sptr += rv;
+			}
+			hist_add(&t->scall, gethrtime() - stime);
+			metric_tx(t->m, 1, sh->ssz);
+			sent++;
+			if (debug)
+				write(1, ">", 1);
+		}
+		if (ot->count == 0) {
+			break;
+		}
+
+		rh = (void *)rbuf;
+		for (;;) {
+			size_t resid;
+			if (nbytes < sizeof (*rh)) {
+				/* suck in as much as we can */
+				resid = maxmsg - sizeof (*rh);
+			} else if (hdr_check(rbuf, nbytes, "sender") != 0) {
+				return (-1);
+			} else if (rh->rsz > maxmsg) {
+				fprintf(stderr, "h->rsz too big\n");
+				return (-1);
+			} else if (nbytes < rh->rsz) {
+				resid = rh->rsz - nbytes;
+			} else {
+				break;
+			}
+			rv = t->tp->recv(t, rptr, resid);
+			now = gethrtime();
+			if (rv < 0) {
+				perror("rcvr/recv");
+				return (-1);
+			}
+			if (rv == 0) {
+				fprintf(stderr,
+				    "sender: recv closed too soon "
+				    "(%" PRIu64 " rx, %" PRIu64 " sent)\n",
+				    t->replies, sent);
+				return (-1);
+			}
+			nbytes += rv;
+			rptr += rv;
+		}
+		assert(nbytes >= sizeof (*rh));
+		assert(nbytes >= rh->rsz);
+
+		if (!(t->flags & FLAG_REORDER) && rh->seqno != t->rseqno) {
+			fprintf(stderr,
+			    "reply seqno out of order (%"
+			    PRIu64 " != %" PRIu64 ")!!\n",
+			    rh->seqno, t->rseqno);
+			return (-1);
+		}
+		if (outstanding_take(ot, rh->seqno, &p) != 0) {
+			fprintf(stderr, "reply to unknown request %" PRIu64
+			    "!!\n", rh->seqno);
+			return (-1);
+		}
+		if (rh->ts3 < rh->ts2) {
+			fprintf(stderr, "negative packet processing cost\n");
+			return (-1);
+		}
+		if (rh->ts1 != p.ts1) {
+			fprintf(stderr, "mismatched timestamps: %" PRIu64
+			    " != %" PRIu64 "\n", rh->ts1, p.ts1);
+			return (-1);
+		}
+		(void) seqtrack_add(&t->st, rh->seqno, 1);
+		sp = sample_next(t);
+		sample_set(sp, rh, now);
+		sp->ssz = p.ssz;
+		sp->rsz = rh->rsz;
+		metric_rx(t->m, 1, rh->rsz);
+		metric_lat(t->m, sp->lat);
+		outlier_check(t, rh, sp, ot->count);
+		t->rseqno++;
+		/* if seqno dropped or duplicate, we expect many error msgs */
+
+		t->replies++;
+
+		if (debug)
+			write(1, "<", 1);
+
+		nbytes -= rh->rsz;
+		memmove(rbuf, rbuf + rh->rsz, nbytes);
+		rptr = rbuf + nbytes;
+	}
+	return (0);
+}
+
+/*
+ * senderreceiver is a pthread worker that sends a message and expects a
+ * reply, running an exchange for each trial that main() starts.
+ */
+void *
+senderreceiver(void *arg)
+{
+	test_t		*t = arg;
+	char		*sbuf, *rbuf;
+	outstanding_t	ot;
+	int		good = 0;
+	int		gen = 0;
+
+	sbuf = malloc(maxmsg);
+	rbuf = malloc(maxmsg);
+	outstanding_init(&ot, t->window);
+
+	t->rintvl = 1;
+
+	if (t->count < 1) {
+		fprintf(stderr, "count must be at least 1\n");
+		exit(1);
+	}
+
+	if (perfcount) {
+		pc_open(&t->pc);
+	}
+	while (trial_wait(&gen)) {
+		if (t->skip) {
+			continue;
+		}
+		if (perfcount) {
+			pc_start(&t->pc);
+		}
+		if (exchange(t, sbuf, rbuf, &ot) != 0) {
+			goto out;
+		}
+		if (perfcount) {
+			pc_stop(&t->pc, t->replies);
+		}
+	}
+	good = 1;
+
+out:
+	trial_exit();
+	if (perfcount) {
+		pc_close(&t->pc);
+	}
+	t->tp->close(t);
+	free(ot.e);
+	free(rbuf);
+	free(sbuf);
+
+	if (!good) {
+		exit(1);
+	}
+	return (NULL);
+}
+
+/*
+ * sender is a pthread worker that sends the initial messages.
+ */
+void *
+sender(void *arg)
+{
+	test_t		*t = arg;
+	char		*buf, *ptr;
+	uint64_t	i, stime;
+	int		rv;
+	test_header_t	*h;
+	tentry_t	*e;
+	int		last;
+	int		gen = 0;
+
+	buf = malloc(maxmsg);
+
+	if (t->count < 1) {
+		fprintf(stderr, "count must be at least 1\n");
+		exit(1);
+	}
+
+	if (perfcount) {
+		pc_open(&t->pc);
+	}
+	while (trial_wait(&gen)) {
+		if (t->skip) {
+			continue;
+		}
+		if (perfcount) {
+			pc_start(&t->pc);
+		}
+		range_seed = t->seed;
+		t->tprev = 0;
+		for (i = 0, last = 0; !last; i++) {
+
+			uint16_t ssz, rsz;
+			uint32_t sdly, rdly;
+			h = (void *)buf;
+			ptr = buf;
+
+			if (t->trace != NULL) {
+				/* keep to the trace, however late the last was */
+				e = &t->trace[i];
+				ssz = e->ssz;
+				rsz = e->rsz;
+				rdly = e->rdly;
+				stime = pace_until(start_time + e->when);
+				hist_add(&t->pace.err,
+				    stime - (start_time + e->when));
+				if (stime - (start_time + e->when) >
+				    REPLAY_LATE) {
+					t->behind++;
+				}
+			} else {
+				ssz = (uint16_t) range(t->ssz_min, t->ssz_max);
+				rsz = (uint16_t) range(t->rsz_min, t->rsz_max);
+				sdly = range(t->sdly_min, t->sdly_max);
+				rdly = range(t->rdly_min, t->rdly_max);
+
+				pace(&t->pace, sdly);
+
+				stime = gethrtime();
+			}
+			last = trial_last(t, i, stime);
+
+			h->ssz = ssz;
+			h->rsz = (last ||
+			    (t->rintvl && ((i % t->rintvl) == 0))) ? rsz : 0;
+			h->rdly = h->rsz ? rdly : 0;
+			h->seqno = t->sseqno++;
+			h->ts3 = 0;
+			h->ts2 = 0;
+			h->tsq = 0;
+			h->cdly = h->rsz ? t->cdly : 0;
+			h->nchunk = h->rsz ? t->nchunk : 0;
+			h->chunk = 0;
+			h->magic = HDR_MAGIC;
+			h->tsp = t->tprev;
+			h->ts1 = t->tprev = stime;
+
+			/* the receiver must know of a reply before it comes */
+			__atomic_store_n(&t->expect, t->expect +
+			    (h->rsz ? max(h->nchunk, 1) : 0), __ATOMIC_RELEASE);
+			if (last) {
+				__atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+			}
+
+			while (ssz > 0) {
+				rv = t->tp->send(t, ptr, ssz);
+				if (rv < 0) {
+					perror("sender/send");
+					goto out;
+				}
+				ssz -= rv;
+				ptr += rv;
+			}
+			hist_add(&t->scall, gethrtime() - stime);
+			metric_tx(t->m, 1, h->ssz);
+			if (debug)
+				write(1, ">", 1);
+		}
+		if (perfcount) {
+			pc_stop(&t->pc, i);
+		}
+	}
+
+out:
+	trial_exit();
+	if (perfcount) {
+		pc_close(&t->pc);
+	}
+	free(buf);
+	return (NULL);
+}
+
+/*
+ * receiver is a pthread worker that receives any replies.  It runs in the
+ * same process as sender.
+ */
+void *
+receiver(void *arg)
+{
+	test_t		*t = arg;
+	test_t		*s = t->peer;
+	char		*buf, *ptr;
+	uint32_t	nbytes = 0;
+	uint64_t	ltime = 0, now = 0, expect;
+	test_header_t	*h;
+	sample_t	*sp;
+	int		rv;
+	int		gen = 0;
+	int		busy = 0;
+
+	buf = malloc(maxmsg);
+	ptr = buf;
+	if (perfcount) {
+		pc_open(&t->pc);
+	}
+
+	for (;;) {
+		/*
+		 * The trial is over once the sender is done, and every reply
+		 * that it asked for has come.
+		 */
+		if (busy && __atomic_load_n(&s->done, __ATOMIC_ACQUIRE) &&
+		    t->replies >=
+		    __atomic_load_n(&s->expect, __ATOMIC_ACQUIRE)) {
+			busy = 0;
+			if (perfcount) {
+				pc_stop(&t->pc, t->replies);
+			}
+		}
+		if (!busy) {
+			if (!trial_wait(&gen)) {
+				break;
+			}
+			busy = !t->skip;
+			if (busy && perfcount) {
+				pc_start(&t->pc);
+			}
+			continue;
+		}
+		h = (void *)buf;
+		for (;;) {
+			size_t resid;
+			if (nbytes < sizeof (*h)) {
+				/* suck in as much as we can */
+				resid = maxmsg - sizeof (*h);
+			} else if (hdr_check(buf, nbytes, "receiver") != 0) {
+				goto out;
+			} else if (h->rsz > maxmsg) {
+				fprintf(stderr, "h->rsz too big\n");
+				goto out;
+			} else if (nbytes < h->rsz) {
+				resid = h->rsz - nbytes;
+			} else {
+				break;
+			}
+			rv = t->tp->recv(t, ptr, resid);
+			now = gethrtime();
+			if (rv < 0) {
+				perror("rcvr/recv");
+				goto out;
+			}
+			if (rv == 0) {
+				fprintf(stderr, "receiver: recv closed too soon\n");
+				goto out;
+			}
+			nbytes += rv;
+			ptr += rv;
+		}
+		assert(nbytes >= sizeof (*h));
+		assert(nbytes >= h->rsz);
+
+		if (h->ts1 < ltime && !(t->flags & FLAG_REORDER)) {
+			fprintf(stderr, "ts1 backwards %" PRIu64
+			    " < %" PRIu64 " !!\n",
+			    h->ts1, ltime);
+			metric_err(t->m);
+		}
+		if (now < ltime) {
+			fprintf(stderr, "time-travelling packet\n");
+			metric_err(t->m);
+		}
+		if (h->ts3 < h->ts2) {
+			fprintf(stderr, "negative packet processing cost\n");
+			metric_err(t->m);
+		}
+		ltime = h->ts1;
+		if (t->flags & FLAG_REORDER) {
+			/* replies carry the request seqno; see replier */
+			if (!seqtrack_add(&t->st, h->seqno, t->rintvl)) {
+				fprintf(stderr, "duplicate reply %" PRIu64
+				    "!!\n", h->seqno);
+				metric_err(t->m);
+			}
+		} else if (h->seqno != t->rseqno) {
+			fprintf(stderr,
+			    "reply seqno out of order (%" PRIu64
+			    " != %" PRIu64 ")!!\n",
+			    h->seqno, t->rseqno);
+			metric_err(t->m);
+		}
+		sp = sample_next(t);
+		sample_set(sp, h, now);
+		sp->ssz = 0;	/* probably of no use here */
+		sp->rsz = 0;
+		metric_rx(t->m, 1, h->rsz);
+		metric_lat(t->m, sp->lat);
+		/* the sender may not have counted this one yet */
+		expect = __atomic_load_n(&s->expect, __ATOMIC_ACQUIRE);
+		outlier_check(t, h, sp,
+		    expect > t->replies + 1 ? expect - t->replies - 1 : 0);
+		if (h->nchunk > 1) {
+			/* chunks of a reply come in order, and together */
+			if (h->chunk == 0) {
+				hist_add(&t->cfirst, now - h->ts1);
+			} else {
+				hist_add(&t->cgap, now - t->cprev);
+			}
+			if (h->chunk == h->nchunk - 1) {
+				hist_add(&t->clast, now - h->ts1);
+			}
+			t->cprev = now;
+		}
+
+		t->rseqno++;
+		/* if seqno dropped or duplicate, we expect many error msgs */
+
+		/* XXX: we could check timestamps, figure latency, etc. */
+		t->replies++;
+
+		if (debug)
+			write(1, "<", 1);
+
+		nbytes -= h->rsz;
+		memmove(buf, buf + h->rsz, nbytes);
+		ptr = buf + nbytes;
+	}
+
+out:
+	trial_exit();
+	if (perfcount) {
+		pc_close(&t->pc);
+	}
+	free(buf);
+	return (NULL);
+}
+
+/*
+ * streamer is a pthread worker for bulk streaming mode.  Rather than paying
+ * a send() for every message, it packs as many frames as will fit into a
+ * large buffer and hands the whole buffer to the kernel at once.  Each frame
+ * still carries its own header, so ordering is checked per frame just as it
+ * is for individual messages.  When done, it shuts down the write side so
+ * that the replier sees EOF once it has consumed everything.
+ */
+void *
+streamer(void *arg)
+{
+	test_t		*t = arg;
+	char		*buf, *ptr;
+	uint64_t	i, stime, now;
+	uint32_t	len;
+	uint16_t	ssz;
+	test_header_t	h;
+	int		rv;
+
+	buf = malloc(t->bufsz);
+	range_seed = t->seed;
+
+	wait_start();
+	t->begin = gethrtime();
+
+	for (i = 0; i < t->count; ) {
+		pace(&t->pace, range(t->sdly_min, t->sdly_max));
+		stime = gethrtime();
+
+		for (len = 0; i < t->count; i++) {
+			ssz = (uint16_t) range(t->ssz_min, t->ssz_max);
+			if (len + ssz > t->bufsz) {
+				break;
+			}
+			h.seqno = t->sseqno++;
+			h.ssz = ssz;
+			h.rsz = 0;
+			if ((t->flags & FLAG_ECHO) &&
+			    t->rintvl && ((i % t->rintvl) == 0)) {
+				h.rsz = ssz;
+			}
+			h.rdly = h.rsz ? range(t->rdly_min, t->rdly_max) : 0;
+			h.tsp = t->tprev;
+			h.ts1 = t->tprev = stime;
+			h.ts2 = 0;
+			h.ts3 = 0;
+			h.tsq = 0;
+			h.cdly = 0;
+			h.nchunk = 0;
+			h.chunk = 0;
+			h.magic = HDR_MAGIC;
+			memcpy(buf + len, &h, sizeof (h));
+			len += ssz;
+			metric_tx(t->m, 1, 0);
+		}
+
+		for (ptr = buf; len > 0; ) {
+			rv = t->tp->send(t, ptr, len);
+			if (rv < 0) {
+				perror("streamer/send");
+				goto out;
+			}
+			len -= rv;
+			ptr += rv;
+			t->sbytes += rv;
+			metric_tx(t->m, 0, rv);
+		}
+		now = gethrtime();
+		hist_add(&t->scall, now - stime);
+		tseries_add(t, now, ptr - buf);
+		if (debug)
+			write(1, ">", 1);
+	}
+	if (shutdown(t->sock, SHUT_WR) < 0) {
+		perror("streamer/shutdown");
+	}
+
+out:
+	free(buf);
+	return (NULL);
+}
+
+/*
+ * streamreceiver is the receiving half of bulk streaming mode.  It drains
+ * the socket in large reads, checking the order of any echoed frames, and
+ * runs until the replier closes the connection.
+ */
+void *
+streamreceiver(void *arg)
+{
+	test_t		*t = arg;
+	char		*buf;
+	uint32_t	nbytes = 0, off;
+	uint64_t	now = 0;
+	test_header_t	h;
+	int		rv, flen = 0;
+
+	buf = malloc(t->bufsz);
+
+	for (;;) {
+		rv = t->tp->recv(t, buf + nbytes, t->bufsz - nbytes);
+		now = gethrtime();
+		if (rv < 0) {
+			perror("streamreceiver/recv");
+			break;
+		}
+		if (rv == 0) {
+			if (nbytes != 0) {
+				fprintf(stderr, "streamreceiver: "
+				    "%u bytes of partial frame at EOF\n",
+				    nbytes);
+			}
+			break;
+		}
+		nbytes += rv;
+		t->rbytes += rv;
+		tseries_add(t, now, rv);
+		metric_rx(t->m, 0, rv);
+
+		for (off = 0;
+		    (flen = frame_len(buf + off, nbytes - off, 1)) > 0;
+		    off += flen) {
+			memcpy(&h, buf + off, sizeof (h));
+			if (h.seqno != t->rseqno) {
+				fprintf(stderr,
+				    "reply seqno out of order (%" PRIu64
+				    " != %" PRIu64 ")!!\n",
+				    h.seqno, t->rseqno);
+				metric_err(t->m);
+			}
+			if (t->replies < t->count) {
+				sample_t *s = &t->samples[t->replies];
+				sample_set(s, &h, now);
+				s->ssz = h.ssz;
+				s->rsz = h.rsz;
+				metric_lat(t->m, s->lat);
+			}
+			metric_rx(t->m, 1, 0);
+			t->rseqno++;
+			t->replies++;
+		}
+		if (flen < 0) {
+			if (hdr_check(buf + off, nbytes - off,
+			    "streamreceiver") == 0) {
+				fprintf(stderr,
+				    "streamreceiver: bad frame header\n");
+			}
+			break;
+		}
+		nbytes -= off;
+		memmove(buf, buf + off, nbytes);
+	}
+	t->end = now;
+	free(buf);
+	return (NULL);
+}
+
+/*
+ * The replier serves its connections from worker threads, each running an
+ * event loop over the connections it was given.  By default every
+ * connection gets a worker of its own; with workers=N a fixed pool of N
+ * is shared by all connections, which are handed out round robin.
+ *
+ * A reply with a delay (rdly) is not waited for inline, which would stop
+ * the connection from reading.  It is put on the worker's timer wheel, and
+ * the connection carries on.  Replies are also kept on a queue for their
+ * connection, and one is only sent once all those ahead of it have been,
+ * so that they still go out in order.  With the reorder option, as in a
+ * multiplexed protocol, each is instead sent as soon as its delay is up,
+ * and carries the seqno of its request so that the sender can match them.
+ */
+typedef struct reply {
+	struct reply	*next;		/* on the timer wheel */
+	struct reply	*qnext;		/* on the connection's queue */
+	struct conn	*c;
+	uint64_t	due;		/* when it may be sent */
+	int		ready;		/* delay has elapsed */
+	uint16_t	left;		/* chunks still to send */
+	test_header_t	h;
+} reply_t;
+
+/*
+ * The timer wheel is hierarchical: each level has WHEEL_SLOTS slots, and
+ * each slot of a level spans all of the slots of the level below.  A timer
+ * is placed in the lowest level whose span reaches it, and as time moves
+ * on, timers are cascaded down to the lower levels, until they fire from
+ * level 0.  Adding and firing a timer is thus O(1) regardless of how many
+ * are pending.  Ticks are about a microsecond; three levels are good for
+ * 2^34 ns, which is more than the largest rdly.
+ */
+#define	WHEEL_TICK	10		/* log2 of ns per tick */
+#define	WHEEL_BITS	8
+#define	WHEEL_SLOTS	(1 << WHEEL_BITS)
+#define	WHEEL_MASK	(WHEEL_SLOTS - 1)
+#define	WHEEL_LEVELS	3
+
+typedef struct wheel {
+	uint64_t	tick;		/* current time, in ticks */
+	uint64_t	count;		/* timers pending */
+	reply_t		*slot[WHEEL_LEVELS][WHEEL_SLOTS];
+} wheel_t;
+
+typedef struct conn {
+	test_t		*t;
+	struct worker	*w;
+	char		*rbuf;
+	uint32_t	rlen;
+	char		*obuf;		/* replies not yet sent */
+	uint32_t	ooff;
+	uint32_t	olen;
+	uint32_t	osz;
+	reply_t		*head;		/* replies waiting, in order */
+	reply_t		*tail;
+	uint32_t	ntimers;	/* of those, still on the wheel */
+	uint64_t	ltime;
+	int		rmore;		/* recv filled the buffer */
+	int		eof;		/* peer is done sending */
+	int		dead;		/* closed; waiting for timers */
+	int		fflags;		/* file flags, less O_NONBLOCK */
+} conn_t;
+
+typedef struct worker {
+	pthread_t	tid;
+	int		wake[2];	/* new connections arrive here */
+	int		pooled;		/* part of the pool; never exits */
+	wheel_t		wheel;
+	reply_t		*free;		/* spare replies */
+	struct pollfd	*pfd;		/* pfd[0] is the wake pipe */
+	conn_t		**conns;	/* conns[i] polls on pfd[i] */
+	int		nconns;		/* including the wake pipe */
+	int		maxconns;
+	pcount_t	pc;		/* the perf option's counters */
+	spin_t		spin;		/* the busy_poll option's counts */
+	uint64_t	nreq;		/* requests since last reported */
+	uint64_t	nbegin;		/* when the first of them came */
+} worker_t;
+
+worker_t *workers;
+uint32_t nworkers;
+
+static void
+wheel_add(wheel_t *w, reply_t *r)
+{
+	uint64_t	when, delta;
+	int		l, s;
+
+	/* round up, so as never to fire early */
+	when = (r->due + (1u << WHEEL_TICK) - 1) >> WHEEL_TICK;
+	if (when <= w->tick) {
+		when = w->tick + 1;
+	}
+	delta = when - w->tick;
+	for (l = 0; l < WHEEL_LEVELS - 1; l++) {
+		if (delta < (1ull << (WHEEL_BITS * (l + 1)))) {
+			break;
+		}
+	}
+	s = (when >> (WHEEL_BITS * l)) & WHEEL_MASK;
+	r->next = w->slot[l][s];
+	w->slot[l][s] = r;
+	w->count++;
+}
+
+/*
+ * wheel_next returns the earliest time at which a timer might fire: the
+ * next occupied slot in level 0, or else the next cascade.
+ */
+static uint64_t
+wheel_next(const wheel_t *w)
+{
+	uint64_t	t;
+
+	if (w->count == 0) {
+		return (UINT64_MAX);
+	}
+	for (t = w->tick + 1; (t & WHEEL_MASK) != 0; t++) {
+		if (w->slot[0][t & WHEEL_MASK] != NULL) {
+			break;
+		}
+	}
+	return (t << WHEEL_TICK);
+}
+
+/*
+ * wheel_advance moves the wheel up to now, calling fire for every timer
+ * that has come due.
+ */
+static void
+wheel_advance(wheel_t *w, uint64_t now, void (*fire)(reply_t *))
+{
+	uint64_t	target = now >> WHEEL_TICK;
+	reply_t		*r, *list;
+	int		l, top;
+
+	while (w->tick < target) {
+		if (w->count == 0) {
+			w->tick = target;
+			break;
+		}
+		w->tick++;
+
+		/* cascade from the highest level whose slot just turned */
+		for (top = 0; top < WHEEL_LEVELS - 1; top++) {
+			if ((w->tick >> (WHEEL_BITS * top)) & WHEEL_MASK) {
+				break;
+			}
+		}
+		for (l = top; l > 0; l--) {
+			int s = (w->tick >> (WHEEL_BITS * l)) & WHEEL_MASK;
+			list = w->slot[l][s];
+			w->slot[l][s] = NULL;
+			while ((r = list) != NULL) {
+				list = r->next;
+				w->count--;
+				wheel_add(w, r);
+			}
+		}
+
+		list = w->slot[0][w->tick & WHEEL_MASK];
+		w->slot[0][w->tick & WHEEL_MASK] = NULL;
+		while ((r = list) != NULL) {
+			list = r->next;
+			w->count--;
+			fire(r);
+		}
+	}
+}
+
+static reply_t *
+reply_get(worker_t *w)
+{
+	reply_t *r;
+
+	if ((r = w->free) != NULL) {
+		w->free = r->next;
+		return (r);
+	}
+	if ((r = malloc(sizeof (*r))) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	return (r);
+}
+
+static void
+reply_put(worker_t *w, reply_t *r)
+{
+	r->next = w->free;
+	w->free = r;
+}
+
+static void
+conn_free(conn_t *c)
+{
+	if (c->t->m != NULL) {
+		mblock_put(c->t->mt, c->t->m);
+	}
+	free(c->rbuf);
+	free(c->obuf);
+	free(c->t);
+	free(c);
+}
+
+/*
+ * conn_flush sends as much of the pending output as the socket will take.
+ */
+static int
+conn_flush(conn_t *c)
+{
+	int	rv;
+
+	while (c->ooff < c->olen) {
+		rv = c->t->tp->send(c->t, c->obuf + c->ooff, c->olen - c->ooff);
+		if (rv < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("send");
+			return (-1);
+		}
+		c->ooff += rv;
+	}
+	if (c->ooff == c->olen) {
+		c->ooff = c->olen = 0;
+	}
+	return (0);
+}
+
+/*
+ * conn_emit stamps a reply and adds it to the connection's output.  Like
+ * the blocking replier before it, it sends once a buffer's worth has been
+ * gathered; if the peer isn't keeping up, the output simply grows, and
+ * reading stops until it drains (see conn_readable).
+ */
+static void
+conn_emit(conn_t *c, test_header_t *h)
+{
+	test_t	*t = c->t;
+
+	if (c->olen - c->ooff + h->rsz > t->bufsz && !c->dead &&
+	    conn_flush(c) != 0) {
+		c->dead = 1;
+	}
+	if (c->dead) {
+		return;
+	}
+	if (c->olen + h->rsz > c->osz && c->ooff != 0) {
+		memmove(c->obuf, c->obuf + c->ooff, c->olen - c->ooff);
+		c->olen -= c->ooff;
+		c->ooff = 0;
+	}
+	if (c->olen + h->rsz > c->osz) {
+		c->osz = max(c->osz * 2, c->olen + h->rsz);
+		if ((c->obuf = realloc(c->obuf, c->osz)) == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	if (!(t->flags & FLAG_REORDER)) {
+		h->seqno = t->rseqno++;
+	}
+	h->ts3 = replier_clock(gethrtime());
+	memcpy(c->obuf + c->olen, h, sizeof (*h));
+	c->olen += h->rsz;
+	metric_tx(t->m, 1, h->rsz);
+	metric_lat(t->m, h->ts3 - h->ts2);
+	if (debug) {
+		write(1, "+", 1);
+	}
+}
+
+/*
+ * reply_send sends what is due of a reply that comes in chunks: all that
+ * are left if there is no delay between them, or else just the next, with
+ * the reply going back on the wheel for the one after.  It returns 1 if
+ * there are more to come.
+ */
+static int
+reply_send(reply_t *r)
+{
+	conn_t	*c = r->c;
+
+	do {
+		r->h.chunk = max(r->h.nchunk, 1) - r->left;
+		conn_emit(c, &r->h);
+	} while (--r->left > 0 && r->h.cdly == 0);
+	if (r->left == 0) {
+		return (0);
+	}
+	r->ready = 0;
+	r->due = gethrtime() + r->h.cdly;
+	wheel_add(&c->w->wheel, r);
+	c->ntimers++;
+	return (1);
+}
+
+/*
+ * conn_drain sends every reply at the head of the queue that is ready.
+ * One still sending its chunks holds back those behind it.
+ */
+static void
+conn_drain(conn_t *c)
+{
+	reply_t	*r;
+
+	while ((r = c->head) != NULL && r->ready) {
+		if (reply_send(r)) {
+			break;
+		}
+		if ((c->head = r->qnext) == NULL) {
+			c->tail = NULL;
+		}
+		reply_put(c->w, r);
+	}
+}
+
+static void
+reply_fire(reply_t *r)
+{
+	conn_t	*c = r->c;
+
+	c->ntimers--;
+	if (c->dead) {
+		reply_put(c->w, r);
+		if (c->ntimers == 0) {
+			conn_free(c);
+		}
+		return;
+	}
+	if (c->t->flags & FLAG_REORDER) {
+		if (!reply_send(r)) {
+			reply_put(c->w, r);
+		}
+		return;
+	}
+	r->ready = 1;
+	conn_drain(c);
+}
+
+/*
+ * conn_request handles a request that wants a reply.  It is sent at once
+ * if it needn't wait, either for its delay or for an earlier reply, and
+ * is a single one.
+ */
+static void
+conn_request(conn_t *c, test_header_t *h, uint64_t now)
+{
+	reply_t	*r;
+
+	/* when reordering, the queue is never used, and so always empty */
+	if (h->rdly == 0 && c->head == NULL && h->nchunk <= 1) {
+		h->chunk = 0;
+		conn_emit(c, h);
+		return;
+	}
+	r = reply_get(c->w);
+	r->c = c;
+	r->h = *h;
+	r->qnext = NULL;
+	r->due = now + h->rdly;
+	r->ready = (h->rdly == 0);
+	r->left = max(h->nchunk, 1);
+	if (!r->ready) {
+		wheel_add(&c->w->wheel, r);
+		c->ntimers++;
+	}
+	if (c->t->flags & FLAG_REORDER) {
+		if (r->ready && !reply_send(r)) {
+			reply_put(c->w, r);
+		}
+		return;
+	}
+	if (c->tail != NULL) {
+		c->tail->qnext = r;
+	} else {
+		c->head = r;
+	}
+	c->tail = r;
+	if (r->ready && c->head == r) {
+		conn_drain(c);
+	}
+}
+
+/*
+ * conn_read does a single read, and processes every complete message in
+ * it.  Reads are done in large chunks, so that a busy stream of messages
+ * doesn't cost a system call per message.
+ */
+static int
+conn_read(conn_t *c)
+{
+	test_t		*t = c->t;
+	test_header_t	h;
+	uint32_t	off, want;
+	uint64_t	now;
+	int		rv, flen = 0;
+
+	want = t->bufsz - c->rlen;
+	rv = t->tp->recv(t, c->rbuf + c->rlen, want);
+	now = gethrtime();
+	if (rv < 0) {
+		c->rmore = 0;
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return (0);
+		}
+		perror("replier/recv");
+		return (-1);
+	}
+	if (rv == 0) {
+		c->eof = 1;
+		return (0);
+	}
+	/* a full read may have left data that poll can't see, e.g. in TLS */
+	c->rmore = (rv == want);
+	c->rlen += rv;
+
+	for (off = 0;
+	    (flen = frame_len(c->rbuf + off, c->rlen - off, 0)) > 0;
+	    off += flen) {
+		memcpy(&h, c->rbuf + off, sizeof (h));
+		if (debug)
+			write(1, "-", 1);
+
+		if (c->w->nreq++ == 0) {
+			c->w->nbegin = now;
+		}
+		metric_rx(t->m, 1, h.ssz);
+		if (h.ts1 < c->ltime) {
+			fprintf(stderr, "replier: ts1 backwards!!\n");
+			metric_err(t->m);
+		}
+		c->ltime = h.ts1;
+
+		if (h.seqno != t->sseqno++) {
+			fprintf(stderr, "reply seqno out of order!!\n");
+			metric_err(t->m);
+		}
+		/* if seqno dropped or duplicate, expect many errors */
+
+		if (h.rsz == 0) {
+			continue;
+		}
+		h.ts2 = replier_clock(now);
+		h.tsq = t->rxtime ? replier_clock(t->rxtime) : 0;
+		conn_request(c, &h, now);
+	}
+	if (flen < 0) {
+		if (hdr_check(c->rbuf + off, c->rlen - off, "replier") == 0) {
+			fprintf(stderr, "h->ssz bad\n");
+		}
+		metric_err(t->m);
+		return (-1);
+	}
+	c->rlen -= off;
+	memmove(c->rbuf, c->rbuf + off, c->rlen);
+	return (0);
+}
+
+/*
+ * A connection is only read while its output is below a buffer's worth,
+ * so that a peer that stops reading replies eventually stops us too.
+ */
+static int
+conn_readable(const conn_t *c)
+{
+	return (!c->eof && !c->dead && c->olen - c->ooff < c->t->bufsz);
+}
+
+/*
+ * conn_block switches a connection between blocking and non-blocking.
+ * A worker with only one connection and no timers has nothing to wait
+ * for but that connection, and then blocks in recv as the old replier
+ * did, saving a poll per request.
+ */
+static void
+conn_block(conn_t *c, int block)
+{
+	test_t	*t = c->t;
+
+	if (t->nbio == !block) {
+		return;
+	}
+	if (fcntl(t->sock, F_SETFL,
+	    block ? c->fflags : c->fflags | O_NONBLOCK) < 0) {
+		perror("fcntl");
+		exit(1);
+	}
+	t->nbio = !block;
+}
+
+static void
+worker_add(worker_t *w, test_t *t)
+{
+	conn_t	*c;
+
+	if (w->nconns == w->maxconns) {
+		w->maxconns = max(w->maxconns * 2, 8);
+		w->pfd = realloc(w->pfd, w->maxconns * sizeof (*w->pfd));
+		w->conns = realloc(w->conns, w->maxconns * sizeof (*w->conns));
+		if (w->pfd == NULL || w->conns == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	if ((c = calloc(1, sizeof (*c))) == NULL ||
+	    (c->rbuf = malloc(t->bufsz)) == NULL ||
+	    (c->obuf = malloc(t->bufsz)) == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	c->t = t;
+	c->w = w;
+	c->osz = t->bufsz;
+	c->fflags = fcntl(t->sock, F_GETFL) & ~O_NONBLOCK;
+	t->nbio = 0;
+	conn_block(c, 0);
+	if (t->mt != NULL) {
+		t->m = mblock_get(t->mt);
+	}
+#ifdef HAVE_RXSTAMP
+	/* so that replies can say how long requests waited to be read */
+	if (t->tp->recv == sock_recv) {
+		t->rxstamp = rx_stamp_enable(t->sock);
+	}
+#endif
+	w->conns[w->nconns] = c;
+	w->pfd[w->nconns].fd = t->sock;
+	w->pfd[w->nconns].events = POLLIN;
+	w->pfd[w->nconns].revents = 0;
+	w->nconns++;
+}
+
+/*
+ * worker_remove closes a connection.  Any of its replies still on the
+ * wheel keep it from being freed until they have fired.
+ */
+static void
+worker_remove(worker_t *w, int i)
+{
+	conn_t	*c = w->conns[i];
+	reply_t	*r;
+
+	c->t->tp->close(c->t);
+	c->dead = 1;
+	while ((r = c->head) != NULL) {
+		c->head = r->qnext;
+		if (r->ready) {
+			reply_put(w, r);
+		}
+	}
+	c->tail = NULL;
+	if (c->ntimers == 0) {
+		conn_free(c);
+	}
+	w->nconns--;
+	w->conns[i] = w->conns[w->nconns];
+	w->pfd[i] = w->pfd[w->nconns];
+}
+
+static void
+worker_new(worker_t *w, int pooled)
+{
+	memset(w, 0, sizeof (*w));
+	w->pooled = pooled;
+	w->wake[0] = w->wake[1] = -1;
+	if (pooled && pipe(w->wake) != 0) {
+		perror("pipe");
+		exit(1);
+	}
+	/* slot 0 is the wake pipe; poll ignores it when it's -1 */
+	w->maxconns = 8;
+	w->pfd = malloc(w->maxconns * sizeof (*w->pfd));
+	w->conns = malloc(w->maxconns * sizeof (*w->conns));
+	if (w->pfd == NULL || w->conns == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	w->pfd[0].fd = w->wake[0];
+	w->pfd[0].events = POLLIN;
+	w->conns[0] = NULL;
+	w->nconns = 1;
+}
+
+/*
+ * worker_wait polls for up to the given number of nsec.  Like pace_until,
+ * it doesn't trust the system to wake on time, so it stops pace_margin
+ * short of a deadline, and the rest is spent polling without waiting.
+ */
+static int
+worker_wait(worker_t *w, uint64_t nsec)
+{
+#ifdef HAVE_PPOLL
+	struct timespec	ts;
+
+	if (nsec != UINT64_MAX) {
+		nsec = (nsec > pace_margin) ? nsec - pace_margin : 0;
+		ts.tv_sec = nsec / 1000000000ull;
+		ts.tv_nsec = nsec % 1000000000ull;
+	}
+	return (ppoll(w->pfd, w->nconns,
+	    (nsec == UINT64_MAX) ? NULL : &ts, NULL));
+#else
+	int	ms = -1;
+
+	if (nsec != UINT64_MAX) {
+		nsec = (nsec > pace_margin) ? nsec - pace_margin : 0;
+		ms = (int)min(nsec / 1000000, INT32_MAX);
+	}
+	return (poll(w->pfd, w->nconns, ms));
+#endif
+}
+
+/*
+ * worker_spin is worker_wait for busy_poll: it polls without waiting until
+ * there is something to do, or the time given is up, spinning out after
+ * spin_limit to wait for the rest.  A worker without connections has
+ * nothing to spin for, and just waits.
+ */
+static int
+worker_spin(worker_t *w, uint64_t nsec)
+{
+	uint64_t	start, now, begin = 0;
+	int		rv;
+
+	if (!busy_poll || w->nconns == 1 || nsec == 0) {
+		return (worker_wait(w, nsec));
+	}
+	start = gethrtime();
+	for (;;) {
+		if ((rv = worker_wait(w, 0)) != 0) {
+			break;
+		}
+		now = gethrtime();
+		if (nsec != UINT64_MAX && now - start >= nsec) {
+			break;
+		}
+		if (!spin_again(&w->spin, &begin)) {
+			rv = worker_wait(w, (nsec == UINT64_MAX) ?
+			    nsec : nsec - (now - start));
+			break;
+		}
+	}
+	spin_done(&w->spin, begin);
+	return (rv);
+}
+
+/*
+ * replier is a pthread worker that services the initial sent messages,
+ * checking them for correctness and optionally sending a reply.  Note that
+ * the nature of the reply is driven by the message received, rather than
+ * by the test.  This allows this to run mostly configuration free.
+ */
+void *
+replier(void *arg)
+{
+	worker_t	*w = arg;
+	conn_t		*c;
+	test_t		*t;
+	uint64_t	now, next;
+	int		i, busy, block;
+
+	if (perfcount) {
+		pc_open(&w->pc);
+		pc_start(&w->pc);
+	}
+	for (;;) {
+		now = gethrtime();
+		wheel_advance(&w->wheel, now, reply_fire);
+
+		/* busy_poll does its spinning in worker_spin, so never blocks */
+		block = (!w->pooled && !busy_poll && w->nconns == 2 &&
+		    w->wheel.count == 0);
+		if (w->nconns == 2) {
+			conn_block(w->conns[1], block);
+		}
+
+		busy = 0;
+		for (i = w->nconns - 1; i > 0; i--) {
+			c = w->conns[i];
+			if (!c->dead && c->olen > c->ooff && conn_flush(c) != 0) {
+				c->dead = 1;
+			}
+			if (c->dead ||
+			    (c->eof && c->head == NULL && c->olen == c->ooff)) {
+				worker_remove(w, i);
+				continue;
+			}
+			w->pfd[i].events = (conn_readable(c) ? POLLIN : 0) |
+			    (c->olen > c->ooff ? POLLOUT : 0);
+			if (c->rmore && conn_readable(c)) {
+				busy = 1;
+			}
+		}
+		if (w->nconns == 1 && w->nreq != 0 &&
+		    (perfcount || busy_poll)) {
+			/* the replier has no end, so report when idle */
+			flockfile(stdout);
+			if (perfcount) {
+				pc_stop(&w->pc, w->nreq);
+				report_pc("REPLIER WORKER COUNTERS, PER REQUEST",
+				    &w->pc);
+				memset(w->pc.v, 0, sizeof (w->pc.v));
+				w->pc.msgs = 0;
+				pc_start(&w->pc);
+			}
+			if (busy_poll) {
+				report_spin("REPLIER WORKER BUSY POLL", &w->spin,
+				    gethrtime() - w->nbegin);
+				memset(&w->spin, 0, sizeof (w->spin));
+			}
+			fflush(stdout);
+			funlockfile(stdout);
+			w->nreq = 0;
+		}
+		/* closed connections are freed by their last timer */
+		if (w->nconns == 1 && !w->pooled && w->wheel.count == 0) {
+			break;
+		}
+		/* when blocking, the flush above has sent all there was */
+		if (block && w->nconns == 2) {
+			if (conn_read(w->conns[1]) != 0) {
+				w->conns[1]->dead = 1;
+			}
+			continue;
+		}
+
+		next = wheel_next(&w->wheel);
+		now = gethrtime();
+		if (busy) {
+			next = 0;
+		} else if (next != UINT64_MAX) {
+			next = (next > now) ? next - now : 0;
+		}
+		if (worker_spin(w, next) < 0 && errno != EINTR) {
+			perror("poll");
+			exit(1);
+		}
+
+		if (w->pfd[0].revents & POLLIN) {
+			if (read(w->wake[0], &t, sizeof (t)) == sizeof (t)) {
+				worker_add(w, t);
+			}
+		}
+		for (i = 1; i < w->nconns; i++) {
+			c = w->conns[i];
+			if (!conn_readable(c) ||
+			    (!(w->pfd[i].revents & (POLLIN | POLLHUP | POLLERR)) &&
+			    !c->rmore)) {
+				continue;
+			}
+			if (conn_read(c) != 0) {
+				c->dead = 1;
+			}
+		}
+	}
+
+	if (perfcount) {
+		pc_close(&w->pc);
+	}
+	free(w->pfd);
+	free(w->conns);
+	while ((w->free != NULL)) {
+		reply_t *r = w->free;
+		w->free = r->next;
+		free(r);
+	}
+	free(w);
+	return (NULL);
+}
+
+/*
+ * acceptor runs in the replier's process, and is reponsible for handing
+ * off each inbound connection to a worker.
+ */
+void *
+acceptor(void *arg)
+{
+	static pthread_mutex_t	mx = PTHREAD_MUTEX_INITIALIZER;
+	static uint32_t		next = 0;
+	test_t			*t = arg;
+	test_t			*newt;
+	worker_t		*w;
+
+	for (;;) {
+		newt = malloc(sizeof (*newt));
+		memcpy(newt, t, sizeof (*newt));
+		if (t->tp->accept(t, newt) != 0) {
+			perror("accept");
+			free(newt);
+			t->tp->close(t);
+			return (NULL);
+		}
+		newt->tid = 0;
+		if (nworkers != 0) {
+			pthread_mutex_lock(&mx);
+			w = &workers[next++ % nworkers];
+			pthread_mutex_unlock(&mx);
+			if (write(w->wake[1], &newt, sizeof (newt)) !=
+			    sizeof (newt)) {
+				perror("write");
+				exit(1);
+			}
+			continue;
+		}
+		if ((w = malloc(sizeof (*w))) == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		worker_new(w, 0);
+		worker_add(w, newt);
+		pthread_create(&w->tid, NULL, replier, w);
+		pthread_detach(w->tid);
+	}
+}
+
+#ifndef HAVE_SENDMMSG
+/*
+ * Where the batching calls are missing, do one datagram per call.
+ */
+struct mmsghdr {
+	struct msghdr	msg_hdr;
+	unsigned int	msg_len;
+};
+
+static int
+sendmmsg(int sock, struct mmsghdr *msgs, unsigned int n, int flags)
+{
+	unsigned int	i;
+	ssize_t		rv;
+
+	for (i = 0; i < n; i++) {
+		if ((rv = sendmsg(sock, &msgs[i].msg_hdr, flags)) < 0) {
+			return (i > 0 ? i : -1);
+		}
+		msgs[i].msg_len = rv;
+	}
+	return (i);
+}
+
+static int
+recvmmsg(int sock, struct mmsghdr *msgs, unsigned int n, int flags,
+    struct timespec *tmo)
+{
+	ssize_t		rv;
+
+	if ((rv = recvmsg(sock, &msgs[0].msg_hdr, flags)) < 0) {
+		return (-1);
+	}
+	msgs[0].msg_len = rv;
+	return (1);
+}
+#endif /* HAVE_SENDMMSG */
+
+#ifndef MSG_WAITFORONE
+#define	MSG_WAITFORONE	0
+#endif
+
+/*
+ * udp_msgs sets up a vector of n datagram headers, each with its own
+ * maxmsg sized slot in buf (and optionally its own address slot).
+ */
+static struct mmsghdr *
+udp_msgs(char *buf, int n, struct sockaddr_storage *names)
+{
+	struct mmsghdr	*msgs;
+	struct iovec	*iov;
+	int		i;
+
+	msgs = calloc(n, sizeof (*msgs));
+	iov = calloc(n, sizeof (*iov));
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = buf + (size_t)i * maxmsg;
+		iov[i].iov_len = maxmsg;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		if (names != NULL) {
+			msgs[i].msg_hdr.msg_name = &names[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof (names[i]);
+		}
+	}
+	return (msgs);
+}
+
+/*
+ * udp_sender is the datagram equivalent of sender.  Messages go out in
+ * batches with a single sendmmsg() call; the send delays of a batch are
+ * all taken together, before it is sent.
+ */
+void *
+udp_sender(void *arg)
+{
+	test_t		*t = arg;
+	char		*buf;
+	struct mmsghdr	*msgs;
+	uint64_t	i, stime, dly;
+	test_header_t	*h;
+	int		k, n, sent, rv;
+
+	buf = malloc((size_t)t->batch * maxmsg);
+	msgs = udp_msgs(buf, t->batch, NULL);
+	range_seed = t->seed;
+
+	for (i = 0; i < t->count; ) {
+		n = min(t->batch, t->count - i);
+		dly = 0;
+		for (k = 0; k < n; k++, i++) {
+			h = (void *)(buf + (size_t)k * maxmsg);
+			h->ssz = (uint16_t) range(t->ssz_min, t->ssz_max);
+			h->rsz = (t->rintvl && ((i % t->rintvl) == 0)) ?
+			    (uint16_t) range(t->rsz_min, t->rsz_max) : 0;
+			h->rdly = h->rsz ? range(t->rdly_min, t->rdly_max) : 0;
+			h->seqno = t->sseqno++;
+			h->ts2 = 0;
+			h->ts3 = 0;
+			h->tsq = 0;
+			h->cdly = 0;
+			h->nchunk = 0;
+			h->chunk = 0;
+			h->magic = HDR_MAGIC;
+			msgs[k].msg_hdr.msg_iov->iov_len = h->ssz;
+			__atomic_store_n(&t->expect, t->expect +
+			    (h->rsz ? 1 : 0), __ATOMIC_RELEASE);
+			dly += range(t->sdly_min, t->sdly_max);
+		}
+
+		pace(&t->pace, dly);
+
+		/* a batch goes out at once, so gaps are between batches */
+		stime = gethrtime();
+		for (k = 0; k < n; k++) {
+			h = (void *)(buf + (size_t)k * maxmsg);
+			h->tsp = t->tprev;
+			h->ts1 = stime;
+		}
+		t->tprev = stime;
+		for (sent = 0; sent < n; sent += rv) {
+			rv = sendmmsg(t->sock, msgs + sent, n - sent, 0);
+			if (rv < 0 && (errno == ENOBUFS || errno == EAGAIN)) {
+				/* local queue full, try again */
+				rv = 0;
+				continue;
+			}
+			if (rv < 0) {
+				perror("udp_sender/sendmmsg");
+				goto out;
+			}
+			for (k = sent; k < sent + rv; k++) {
+				t->sbytes += msgs[k].msg_len;
+				metric_tx(t->m, 1, msgs[k].msg_len);
+			}
+		}
+		hist_add(&t->scall, gethrtime() - stime);
+		if (debug)
+			write(1, ">", 1);
+	}
+
+out:
+	__atomic_store_n(&t->done, 1, __ATOMIC_RELEASE);
+	free(msgs[0].msg_hdr.msg_iov);
+	free(msgs);
+	free(buf);
+	return (NULL);
+}
+
+/*
+ * udp_receiver collects the replies for udp_sender.  Missing replies are
+ * not an error, so once the sender is done, it only waits until replies
+ * stop arriving for a while.  Loss, duplication and reordering are
+ * accounted for in the test's seqtrack.
+ */
+void *
+udp_receiver(void *arg)
+{
+	test_t		*t = arg;
+	test_t		*s = t->peer;
+	char		*buf;
+	struct mmsghdr	*msgs;
+	struct timeval	tv;
+	uint64_t	now, idle = 0, expect;
+	test_header_t	*h;
+	int		k, rv;
+
+	buf = malloc((size_t)t->batch * maxmsg);
+	msgs = udp_msgs(buf, t->batch, NULL);
+
+	/* wake up periodically to see if the sender has finished */
+	tv.tv_sec = 0;
+	tv.tv_usec = 100000;
+	(void) setsockopt(t->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+	for (;;) {
+		if (__atomic_load_n(&s->done, __ATOMIC_ACQUIRE) &&
+		    (t->st.unique >= __atomic_load_n(&s->expect,
+		    __ATOMIC_ACQUIRE) || idle >= 1000000000ull)) {
+			break;
+		}
+		rv = recvmmsg(t->sock, msgs, t->batch, MSG_WAITFORONE, NULL);
+		now = gethrtime();
+		if (rv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+		    errno == EINTR)) {
+			if (__atomic_load_n(&s->done, __ATOMIC_ACQUIRE))
+				idle += 100000000ull;
+			continue;
+		}
+		if (rv < 0) {
+			perror("udp_receiver/recvmmsg");
+			break;
+		}
+		idle = 0;
+		for (k = 0; k < rv; k++) {
+			h = (void *)(buf + (size_t)k * maxmsg);
+			if (hdr_check((char *)h, msgs[k].msg_len,
+			    "udp_receiver") != 0) {
+				metric_err(t->m);
+				continue;
+			}
+			if (msgs[k].msg_len != h->rsz) {
+				fprintf(stderr, "udp_receiver: bad reply\n");
+				metric_err(t->m);
+				continue;
+			}
+			t->rbytes += msgs[k].msg_len;
+			metric_rx(t->m, 1, msgs[k].msg_len);
+			if (!seqtrack_add(&t->st, h->seqno, t->rintvl)) {
+				continue;
+			}
+			if (t->replies < t->count) {
+				sample_t *sp = &t->samples[t->replies];
+				sample_set(sp, h, now);
+				sp->ssz = h->ssz;
+				sp->rsz = h->rsz;
+				expect = __atomic_load_n(&s->expect,
+				    __ATOMIC_ACQUIRE);
+				outlier_check(t, h, sp, expect > t->st.unique ?
+				    expect - t->st.unique : 0);
+				metric_lat(t->m, sp->lat);
+			}
+			t->replies++;
+		}
+		if (debug)
+			write(1, "<", 1);
+	}
+
+	free(msgs[0].msg_hdr.msg_iov);
+	free(msgs);
+	free(buf);
+	return (NULL);
+}
+
+/*
+ * The UDP replier serves all of its peers from a single socket, so it keeps
+ * sequence accounting for each peer it hears from.  When a peer goes quiet,
+ * its totals are printed, since a replier has no end of test to wait for.
+ */
+#define	UDP_PEERS	64
+#define	UDP_QUIET	1000000000ull
+
+typedef struct udp_peer {
+	struct sockaddr_storage	addr;
+	socklen_t		addrlen;
+	uint64_t		last;
+	uint64_t		msgs;
+	seqtrack_t		st;
+} udp_peer_t;
+
+static udp_peer_t *
+udp_peer(udp_peer_t *peers, const struct sockaddr_storage *sa, socklen_t len,
+    uint64_t now)
+{
+	udp_peer_t	*p, *oldest = NULL;
+	int		i;
+
+	for (i = 0; i < UDP_PEERS; i++) {
+		p = &peers[i];
+		if (p->addrlen == len && memcmp(&p->addr, sa, len) == 0) {
+			return (p);
+		}
+		if (oldest == NULL || p->last < oldest->last) {
+			oldest = p;
+		}
+	}
+	memset(oldest, 0, sizeof (*oldest));
+	memcpy(&oldest->addr, sa, len);
+	oldest->addrlen = len;
+	return (oldest);
+}
+
+static void
+udp_peer_report(udp_peer_t *p)
+{
+	char	hbuf[64], pbuf[16];
+
+	if (getnameinfo((struct sockaddr *)&p->addr, p->addrlen,
+	    hbuf, sizeof (hbuf), pbuf, sizeof (pbuf),
+	    NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+		strlcpy(hbuf, "?", sizeof (hbuf));
+		strlcpy(pbuf, "?", sizeof (pbuf));
+	}
+	printf("Peer %s:%s: %" PRIu64 " messages, %" PRIu64 " lost, %"
+	    PRIu64 " duplicate, %" PRIu64 " reordered (max distance %"
+	    PRIu64 ")\n", hbuf, pbuf, p->msgs, p->st.next - p->st.unique,
+	    p->st.dups, p->st.reordered, p->st.maxdist);
+	fflush(stdout);
+}
+
+/*
+ * udp_replier is the datagram equivalent of replier.  Requests are read,
+ * and replies sent, in batches.
+ */
+void *
+udp_replier(void *arg)
+{
+	test_t			*t = arg;
+	char			*rbuf, *sbuf;
+	struct mmsghdr		*rmsgs, *smsgs;
+	struct sockaddr_storage	*names;
+	udp_peer_t		*peers, *p;
+	struct timeval		tv;
+	uint64_t		now, lastscan = 0;
+	test_header_t		*h;
+	int			k, n, rv, nout;
+#ifdef HAVE_RXSTAMP
+	char			*ctl;
+	uint64_t		arrived;
+#endif
+
+	rbuf = malloc((size_t)t->batch * maxmsg);
+	sbuf = malloc((size_t)t->batch * maxmsg);
+	names = calloc(t->batch, sizeof (*names));
+	rmsgs = udp_msgs(rbuf, t->batch, names);
+	smsgs = udp_msgs(sbuf, t->batch, NULL);
+	peers = calloc(UDP_PEERS, sizeof (*peers));
+#ifdef HAVE_RXSTAMP
+	ctl = calloc(t->batch, RXSTAMP_SPACE);
+	t->rxstamp = rx_stamp_enable(t->sock);
+#endif
+
+	/* wake up now and then to report on peers that have gone quiet */
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	(void) setsockopt(t->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+	for (;;) {
+		for (k = 0; k < t->batch; k++) {
+			rmsgs[k].msg_hdr.msg_namelen = sizeof (names[k]);
+#ifdef HAVE_RXSTAMP
+			if (t->rxstamp) {
+				rmsgs[k].msg_hdr.msg_control =
+				    ctl + (size_t)k * RXSTAMP_SPACE;
+				rmsgs[k].msg_hdr.msg_controllen =
+				    RXSTAMP_SPACE;
+			}
+#endif
+		}
+		rv = recvmmsg(t->sock, rmsgs, t->batch, MSG_WAITFORONE, NULL);
+		now = gethrtime();
+		if (rv < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+		    errno != EINTR) {
+			perror("udp_replier/recvmmsg");
+			break;
+		}
+
+		nout = 0;
+		for (k = 0; k < rv; k++) {
+			h = (void *)(rbuf + (size_t)k * maxmsg);
+			if (hdr_check((char *)h, rmsgs[k].msg_len,
+			    "udp_replier") != 0) {
+				metric_err(t->m);
+				continue;
+			}
+			if (rmsgs[k].msg_len != h->ssz) {
+				fprintf(stderr, "udp_replier: bad request\n");
+				metric_err(t->m);
+				continue;
+			}
+			metric_rx(t->m, 1, rmsgs[k].msg_len);
+			p = udp_peer(peers, &names[k],
+			    rmsgs[k].msg_hdr.msg_namelen, now);
+			p->last = now;
+			p->msgs++;
+			(void) seqtrack_add(&p->st, h->seqno, 1);
+			if (debug)
+				write(1, "-", 1);
+
+			if (h->rsz == 0) {
+				continue;
+			}
+			if (h->rdly != 0 && nout > 0) {
+				/* don't hold earlier replies across a delay */
+				(void) sendmmsg(t->sock, smsgs, nout, 0);
+				nout = 0;
+			}
+			ndelay(h->rdly);
+
+			h->ts2 = replier_clock(now);
+			h->ts3 = replier_clock(gethrtime());
+			h->tsq = 0;
+#ifdef HAVE_RXSTAMP
+			arrived = t->rxstamp ?
+			    rx_stamp(&rmsgs[k].msg_hdr, gethrtime()) : 0;
+			h->tsq = arrived ? replier_clock(arrived) : 0;
+#endif
+			memcpy(sbuf + (size_t)nout * maxmsg, h, sizeof (*h));
+			smsgs[nout].msg_hdr.msg_iov->iov_len = h->rsz;
+			metric_tx(t->m, 1, h->rsz);
+			metric_lat(t->m, h->ts3 - h->ts2);
+			smsgs[nout].msg_hdr.msg_name = &names[k];
+			smsgs[nout].msg_hdr.msg_namelen =
+			    rmsgs[k].msg_hdr.msg_namelen;
+			nout++;
+			if (debug)
+				write(1, "+", 1);
+		}
+		for (k = 0; k < nout; k += n) {
+			if ((n = sendmmsg(t->sock, smsgs + k, nout - k, 0)) < 0) {
+				if (errno != ENOBUFS && errno != EAGAIN) {
+					perror("udp_replier/sendmmsg");
+					break;
+				}
+				n = 0;
+			}
+		}
+
+		if (now - lastscan >= UDP_QUIET) {
+			for (k = 0; k < UDP_PEERS; k++) {
+				p = &peers[k];
+				if (p->msgs != 0 && now - p->last >= UDP_QUIET) {
+					udp_peer_report(p);
+					memset(p, 0, sizeof (*p));
+				}
+			}
+			lastscan = now;
+		}
+	}
+
+	t->tp->close(t);
+	return (NULL);
+}
+
+test_t	*tests = NULL;
+struct sockaddr **addrs = NULL;
+int naddrs;
+
+/*
+ * addr_len returns the length of a socket address of the given family.
+ */
+static socklen_t
+addr_len(const struct sockaddr *sa)
+{
+	switch (sa->sa_family) {
+	case AF_INET:
+		return (sizeof (struct sockaddr_in));
+	case AF_INET6:
+		return (sizeof (struct sockaddr_in6));
+	case AF_UNIX:
+		return (sizeof (struct sockaddr_un));
+	default:
+		return (0);
+	}
+}
+
+/*
+ * The idle population is a large number of connections that do little
+ * but send an occasional heartbeat, alongside the flows under test, to
+ * see what each costs the system in the middle.  A few threads serve
+ * them all, each with an event loop over its share.  The connections are
+ * opened in parallel, without blocking, at up to connrate per second in
+ * all.  Once open, each sends a heartbeat every heartbeat ns, whose round
+ * trip is timed like any other message.  As every connection has the
+ * same interval, heartbeats come due in the order they were scheduled,
+ * so a simple FIFO serves where the replier needs a timer wheel.
+ */
+#define	IDLE_STEPS	10		/* population levels reported */
+
+enum idlestate {
+	IDLE_NONE,
+	IDLE_CONNECTING,
+	IDLE_OPEN,
+	IDLE_CLOSED
+};
+
+typedef struct idleconn {
+	int		fd;
+	enum idlestate	state;
+	uint64_t	due;		/* next heartbeat */
+	uint64_t	sent;		/* outstanding heartbeat, or 0 */
+	uint64_t	seqno;
+	uint32_t	rlen;
+	test_header_t	rh;		/* reply being received */
+} idleconn_t;
+
+typedef struct idler {
+	pthread_t	tid;
+	struct addrinfo	**lais;		/* local addrs to bind, by address */
+	uint32_t	first;		/* index of its first connection */
+	uint32_t	n;		/* connections to open */
+	uint32_t	started;
+	idleconn_t	*c;
+	uint32_t	*fifo;		/* heartbeats due, earliest first */
+	uint32_t	fhead;
+	uint32_t	flen;
+	double		rate;		/* connects per second, or 0 */
+	uint64_t	heartbeat;
+#ifdef HAVE_EPOLL
+	int		epfd;
+#else
+	struct pollfd	*pfd;		/* pfd[i] is for c[i] */
+#endif
+	hist_t		lat;
+	uint64_t	opened;
+	uint64_t	sent;
+	uint64_t	skipped;	/* previous heartbeat still out */
+	uint64_t	failed;
+	uint64_t	closed;		/* by the peer */
+	int		err;		/* first connect error */
+} idler_t;
+
+static volatile int idle_stop = 0;
+static uint32_t idle_open = 0;
+static uint32_t idle_target = 0;
+static uint64_t idle_marks[IDLE_STEPS + 1];	/* when each level was hit */
+
+static void
+idle_watch(idler_t *d, uint32_t i, int out)
+{
+#ifdef HAVE_EPOLL
+	struct epoll_event ev;
+
+	ev.events = out ? EPOLLOUT : EPOLLIN;
+	ev.data.u32 = i;
+	if (epoll_ctl(d->epfd, (d->c[i].state == IDLE_NONE) ? EPOLL_CTL_ADD :
+	    EPOLL_CTL_MOD, d->c[i].fd, &ev) != 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
+#else
+	d->pfd[i].fd = d->c[i].fd;
+	d->pfd[i].events = out ? POLLOUT : POLLIN;
+#endif
+}
+
+static void
+idle_close(idler_t *d, uint32_t i)
+{
+	idleconn_t *c = &d->c[i];
+
+	if (c->state == IDLE_OPEN) {
+		__atomic_sub_fetch(&idle_open, 1, __ATOMIC_RELAXED);
+	}
+	(void) close(c->fd);	/* which also takes it out of the epoll set */
+	c->fd = -1;
+	c->state = IDLE_CLOSED;
+#ifndef HAVE_EPOLL
+	d->pfd[i].fd = -1;
+#endif
+}
+
+static void
+idle_fail(idler_t *d, uint32_t i, int err)
+{
+	if (d->failed++ == 0) {
+		d->err = err;
+	}
+	idle_close(d, i);
+}
+
+/*
+ * idle_opened marks a connection as open, and schedules its first
+ * heartbeat.  The growth of the population is recorded as it passes each
+ * level, so that the latency of the flows under test can be told apart
+ * by the population that they ran alongside.
+ */
+static void
+idle_opened(idler_t *d, uint32_t i, uint64_t now)
+{
+	uint32_t n, step = max(idle_target / IDLE_STEPS, 1);
+
+	idle_watch(d, i, 0);
+	d->c[i].state = IDLE_OPEN;
+	d->opened++;
+	d->c[i].due = now + d->heartbeat;
+	d->fifo[(d->fhead + d->flen++) % d->n] = i;
+
+	n = __atomic_add_fetch(&idle_open, 1, __ATOMIC_RELAXED);
+	if ((n % step) == 0 && n / step <= IDLE_STEPS) {
+		idle_marks[n / step] = now;
+	}
+}
+
+static void
+idle_connect(idler_t *d, uint32_t i, uint64_t now)
+{
+	idleconn_t		*c = &d->c[i];
+	uint32_t		j = d->first + i;
+	struct sockaddr		*sa = addrs[j % naddrs];
+	struct addrinfo		*lai = d->lais[j % naddrs];
+	int			on = 1;
+
+	if ((c->fd = socket(sa->sa_family, SOCK_STREAM, 0)) < 0) {
+		c->state = IDLE_CLOSED;
+		if (d->failed++ == 0) {
+			d->err = errno;
+		}
+		return;
+	}
+	if (sa->sa_family != AF_UNIX) {
+		(void) setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
+		    &on, sizeof (on));
+	}
+	if ((lai != NULL &&
+	    bind(c->fd, lai->ai_addr, lai->ai_addrlen) != 0) ||
+	    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK) < 0) {
+		idle_fail(d, i, errno);
+		return;
+	}
+	if (connect(c->fd, sa, addr_len(sa)) == 0) {
+		idle_opened(d, i, now);
+	} else if (errno == EINPROGRESS) {
+		idle_watch(d, i, 1);
+		c->state = IDLE_CONNECTING;
+	} else {
+		idle_fail(d, i, errno);
+	}
+}
+
+/*
+ * idle_beat sends a connection's heartbeat, unless the last is still
+ * waiting for its reply, and schedules the next.
+ */
+static void
+idle_beat(idler_t *d, uint32_t i, uint64_t now)
+{
+	idleconn_t	*c = &d->c[i];
+	test_header_t	h;
+
+	if (c->state != IDLE_OPEN) {
+		return;		/* dropped from the FIFO */
+	}
+	if (c->sent != 0) {
+		d->skipped++;
+	} else {
+		memset(&h, 0, sizeof (h));
+		h.seqno = c->seqno++;
+		h.ssz = h.rsz = sizeof (h);
+		h.magic = HDR_MAGIC;
+		h.ts1 = now;
+		/* this fits in any socket buffer, so is never cut short */
+		if (send(c->fd, &h, sizeof (h), MSG_NOSIGNAL) != sizeof (h)) {
+			idle_fail(d, i, errno);
+			return;
+		}
+		c->sent = now;
+		d->sent++;
+	}
+	c->due = now + d->heartbeat;
+	d->fifo[(d->fhead + d->flen++) % d->n] = i;
+}
+
+/*
+ * idle_event handles a connection becoming writable (its connect has
+ * finished) or readable (a reply).
+ */
+static void
+idle_event(idler_t *d, uint32_t i, uint64_t now)
+{
+	idleconn_t	*c = &d->c[i];
+	socklen_t	len = sizeof (int);
+	int		err = 0, rv;
+
+	if (c->state == IDLE_CONNECTING) {
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) {
+			err = errno;
+		}
+		if (err != 0) {
+			idle_fail(d, i, err);
+		} else {
+			idle_opened(d, i, now);
+		}
+		return;
+	}
+	if (c->state != IDLE_OPEN) {
+		return;
+	}
+	rv = recv(c->fd, (char *)&c->rh + c->rlen, sizeof (c->rh) - c->rlen,
+	    0);
+	if (rv <= 0) {
+		if (rv < 0 && (errno == EAGAIN || errno == EINTR)) {
+			return;
+		}
+		d->closed++;
+		idle_close(d, i);
+		return;
+	}
+	c->rlen += rv;
+	if (c->rlen < sizeof (c->rh)) {
+		return;
+	}
+	c->rlen = 0;
+	if (c->sent == 0 || c->rh.seqno != c->seqno - 1 ||
+	    c->rh.ts1 != c->sent) {
+		fprintf(stderr, "idle: unexpected reply %" PRIu64 "\n",
+		    c->rh.seqno);
+		return;
+	}
+	hist_add(&d->lat, (now - c->sent) - (c->rh.ts3 - c->rh.ts2));
+	c->sent = 0;
+}
+
+/*
+ * idle_run is the pthread worker serving one share of the idle population,
+ * until main() sets idle_stop.
+ */
+static void *
+idle_run(void *arg)
+{
+	idler_t		*d = arg;
+	uint64_t	start, now, wake;
+	uint32_t	i;
+	int		nev, ms;
+#ifdef HAVE_EPOLL
+	struct epoll_event ev[256];
+	int		k;
+
+	if ((d->epfd = epoll_create1(0)) < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+#else
+	d->pfd = malloc(d->n * sizeof (struct pollfd));
+	for (i = 0; i < d->n; i++) {
+		d->pfd[i].fd = -1;
+	}
+#endif
+	d->c = calloc(d->n, sizeof (idleconn_t));
+	d->fifo = malloc(d->n * sizeof (uint32_t));
+	for (i = 0; i < d->n; i++) {
+		d->c[i].fd = -1;
+	}
+	start = gethrtime();
+
+	while (!idle_stop) {
+		now = gethrtime();
+		while (d->started < d->n && (d->rate == 0 ||
+		    d->started < (now - start) * d->rate / 1e9 + 1)) {
+			idle_connect(d, d->started++, now);
+		}
+		while (d->flen > 0 && d->c[d->fifo[d->fhead]].due <= now) {
+			i = d->fifo[d->fhead];
+			d->fhead = (d->fhead + 1) % d->n;
+			d->flen--;
+			idle_beat(d, i, now);
+		}
+
+		/* sleep until the next heartbeat or connect, or 100 ms */
+		wake = now + 100000000;
+		if (d->flen > 0) {
+			wake = min(wake, d->c[d->fifo[d->fhead]].due);
+		}
+		if (d->started < d->n && d->rate != 0) {
+			wake = min(wake, start + (uint64_t)(d->started * 1e9 /
+			    d->rate));
+		}
+		ms = (wake > now) ? (int)((wake - now + 999999) / 1000000) : 0;
+#ifdef HAVE_EPOLL
+		nev = epoll_wait(d->epfd, ev, 256, ms);
+		now = gethrtime();
+		for (k = 0; k < nev; k++) {
+			idle_event(d, ev[k].data.u32, now);
+		}
+#else
+		nev = poll(d->pfd, d->n, ms);
+		now = gethrtime();
+		for (i = 0; nev > 0 && i < d->n; i++) {
+			if (d->pfd[i].revents != 0) {
+				nev--;
+				idle_event(d, i, now);
+			}
+		}
+#endif
+	}
+
+	for (i = 0; i < d->n; i++) {
+		if (d->c[i].fd >= 0) {
+			idle_close(d, i);
+		}
+	}
+#ifdef HAVE_EPOLL
+	(void) close(d->epfd);
+#else
+	free(d->pfd);
+#endif
+	free(d->fifo);
+	free(d->c);
+	return (NULL);
+}
+
+enum mode {
+	MODE_ASYNC_SEND = 0,
+	MODE_REPLIER,
+	MODE_SYNC_SEND,
+	MODE_STREAM,
+	MODE_PROXY
+};
+
+char *myopts[] = {
+#define	SMIN		0
+	"ssize_min",
+#define	SMAX		1
+	"ssize_max",
+#define	SSIZE		2
+	"ssize",
+#define	RMIN		3
+	"rsize_min",
+#define	RMAX		4
+	"rsize_max",
+#define	RSIZE		5
+	"rsize",
+#define	THREADS		6
+	"threads",
+#define	SDELAY		7
+	"sdelay",
+#define	RDELAY		8
+	"rdelay",
+#define	SDELAY_MIN	9
+	"sdelay_min",
+#define	SDELAY_MAX	10
+	"sdelay_max",
+#define	RDELAY_MIN	11
+	"rdelay_min",
+#define	RDELAY_MAX	12
+	"rdelay_max",
+#define	RINTERVAL	13
+	"rinterval",
+#define COUNT		14
+	"count",
+#define	DUMPFILE	15
+	"dump",
+#define	BUFSIZE		16
+	"bufsize",
+#define	ECHO		17
+	"echo",
+#define	INTERVAL	18
+	"interval",
+#define	TLS		19
+	"tls",
+#define	KTLS		20
+	"ktls",
+#define	CIPHER		21
+	"cipher",
+#define	CERT		22
+	"cert",
+#define	KEY		23
+	"key",
+#define	BATCH		24
+	"batch",
+#define	WORKERS		25
+	"workers",
+#define	REORDER		26
+	"reorder",
+#define	WINDOW		27
+	"window",
+#define	TCPINFO		28
+	"tcpinfo",
+#define	SNDBUF		29
+	"sndbuf",
+#define	RCVBUF		30
+	"rcvbuf",
+#define	LOWAT		31
+	"notsent_lowat",
+#define	CC		32
+	"cc",
+#define	SLO		33
+	"slo",
+#define	RATE		34
+	"rate",
+#define	CONFIRM		35
+	"confirm",
+#define	DURATION	36
+	"duration",
+#define	WARMUP		37
+	"warmup",
+#define	COOLDOWN	38
+	"cooldown",
+#define	IDLE		39
+	"idle",
+#define	IDLETHREADS	40
+	"idle_threads",
+#define	CONNRATE	41
+	"connrate",
+#define	HEARTBEAT	42
+	"heartbeat",
+#define	ONEWAY		43
+	"oneway",
+#define	CLOCKOFFSET	44
+	"clock_offset",
+#define	CLOCKDRIFT	45
+	"clock_drift",
+#define	BREAKDOWN	46
+	"breakdown",
+#define	AB		47
+	"ab",
+#define	ABCONCURRENT	48
+	"ab_concurrent",
+#define	METRICS		49
+	"metrics",
+#define	REPLAY		50
+	"replay",
+#define	REPLAYSPEED	51
+	"replay_speed",
+#define	PERF		52
+	"perf",
+#define	JITTER		53
+	"jitter",
+#define	JITTERSTALL	54
+	"jitter_stall",
+#define	OUTLIER		55
+	"outlier",
+#define	OUTLIERLOG	56
+	"outlier_log",
+#define	CHUNKS		57
+	"chunks",
+#define	CHUNKDELAY	58
+	"chunk_delay",
+#define	BUSYPOLL	59
+	"busy_poll",
+#define	SOBUSYPOLL	60
+	"so_busy_poll",
+	NULL
+};
+
+/*
+ * Parse the local address from addrstr. If one exists, point
+ * *local_addr to it and update *addrstr to point to the rest of the
+ * address string. If no local address is found then set *local_addr
+ * to NULL and leave *addrstr unchanged.
+ *
+ * E.g.
+ *
+ * *addrstr	= "192.168.1.115,192.168.1.119:6789"
+ *
+ * then:
+ *
+ * *local_addr	= "192.168.1.115"
+ * *addstr	= "192.168.1.119:6789"
+ */
+static void
+parse_local_addr(char **addrstr, char **local_addr)
+{
+	char *delim = strchr(*addrstr, ',');
+
+	if (delim != NULL) {
+		/*
+		 * There is a local bind address specified. Split it
+		 * off from the rest of the address string.
+		 */
+		*delim = '\0';
+		*local_addr = *addrstr;
+		*addrstr = delim + 1;
+	} else {
+		*local_addr = NULL;
+	}
+}
+
+/*
+ * Parse the host and port from addrstr. If the addrstr is well formed
+ * then *host will point to the host string and *port to port.
+ * Otherwise an error will print to stderr and the program will exit.
+ *
+ *
+ * This function is destrcutive to *addrstr. It is equal to *host upon
+ * return.
+ *
+ * E.g.
+ *
+ * *addrstr	= "192.168.1.119:6789"
+ *
+ * then:
+ *
+ * *host	= "192.168.1.119"
+ * *port	= "6789"
+ * *addrstr	= "192.168.1.119"
+ */
+static void
+parse_addr(char **addrstr, char **host, char **port)
+{
+	char *delim = strrchr(*addrstr, ':');
+
+	if (delim == NULL) {
+		fprintf(stderr, "no port found: %s\n", *addrstr);
+		exit(1);
+	}
+
+	/*
+	 * Separate host from port.
+	 */
+	*delim = '\0';
+	*host = *addrstr;
+	*port = delim + 1;
+
+	/*
+	 * Strip IPv6 brackets.
+	 */
+	if ((**host == '[') && ((*host)[strlen(*host) - 1] == ']')) {
+		(*host)[strlen(*host) - 1] = '\0';
+		(*host)++;
+	}
+}
+
+#ifdef HAVE_OPENSSL
+/*
+ * tls_selfsign generates a throwaway EC key and a self-signed certificate
+ * for it, for repliers that weren't given a certificate to use.
+ */
+static void
+tls_selfsign(SSL_CTX *ctx)
+{
+	EVP_PKEY_CTX	*kctx;
+	EVP_PKEY	*pkey = NULL;
+	X509		*x;
+	X509_NAME	*name;
+
+	kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+	if (kctx == NULL || EVP_PKEY_keygen_init(kctx) <= 0 ||
+	    EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx,
+	    NID_X9_62_prime256v1) <= 0 ||
+	    EVP_PKEY_keygen(kctx, &pkey) <= 0) {
+		goto fail;
+	}
+	EVP_PKEY_CTX_free(kctx);
+
+	if ((x = X509_new()) == NULL) {
+		goto fail;
+	}
+	X509_set_version(x, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+	X509_gmtime_adj(X509_getm_notBefore(x), 0);
+	X509_gmtime_adj(X509_getm_notAfter(x), 365 * 24 * 3600L);
+	X509_set_pubkey(x, pkey);
+	name = X509_get_subject_name(x);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+	    (unsigned char *)"seqtest", -1, -1, 0);
+	X509_set_issuer_name(x, name);
+	if (X509_sign(x, pkey, EVP_sha256()) == 0 ||
+	    SSL_CTX_use_certificate(ctx, x) != 1 ||
+	    SSL_CTX_use_PrivateKey(ctx, pkey) != 1) {
+		goto fail;
+	}
+	X509_free(x);
+	EVP_PKEY_free(pkey);
+	return;
+
+fail:
+	ERR_print_errors_fp(stderr);
+	fprintf(stderr, "unable to generate self-signed certificate\n");
+	exit(1);
+}
+
+/*
+ * tls_init sets up the TLS context for the process.  The cipher may name
+ * either TLS 1.3 ciphersuites, or TLS 1.2 ciphers, in which case TLS 1.2
+ * is used.  Peers are not verified; this is a test tool.
+ */
+static void
+tls_init(int server, const char *cipher, const char *cert, const char *key,
+    int ktls)
+{
+	uint64_t	opts = 0;
+
+	tls_ctx = SSL_CTX_new(server ? TLS_server_method() :
+	    TLS_client_method());
+	if (tls_ctx == NULL) {
+		ERR_print_errors_fp(stderr);
+		exit(1);
+	}
+	SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	opts |= SSL_OP_IGNORE_UNEXPECTED_EOF;
+#endif
+	if (ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+		opts |= SSL_OP_ENABLE_KTLS;
+#else
+		fprintf(stderr, "kTLS not supported by this OpenSSL\n");
+#endif
+	}
+	SSL_CTX_set_options(tls_ctx, opts);
+	/* session tickets would arrive as non-data records under kTLS */
+	SSL_CTX_set_num_tickets(tls_ctx, 0);
+	/* the replier's output buffer may move between retried writes */
+	SSL_CTX_set_mode(tls_ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	if (cipher != NULL) {
+		if (SSL_CTX_set_ciphersuites(tls_ctx, cipher) == 1) {
+			SSL_CTX_set_min_proto_version(tls_ctx, TLS1_3_VERSION);
+		} else if (SSL_CTX_set_cipher_list(tls_ctx, cipher) == 1) {
+			SSL_CTX_set_max_proto_version(tls_ctx, TLS1_2_VERSION);
+		} else {
+			fprintf(stderr, "unknown cipher %s\n", cipher);
+			exit(1);
+		}
+		ERR_clear_error();
+	}
+
+	if (!server) {
+		return;
+	}
+	if (cert == NULL) {
+		tls_selfsign(tls_ctx);
+		return;
+	}
+	if (SSL_CTX_use_certificate_chain_file(tls_ctx, cert) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(tls_ctx, key ? key : cert,
+	    SSL_FILETYPE_PEM) != 1) {
+		ERR_print_errors_fp(stderr);
+		fprintf(stderr, "unable to load %s\n", cert);
+		exit(1);
+	}
+}
+
+/*
+ * tls_share prepares a connected test's TLS session for use by separate
+ * sender and receiver threads.  It gets a lock, and a non-blocking socket
+ * (see tls_io), unless the kernel is handling the records itself.
+ */
+static void
+tls_share(test_t *t)
+{
+	if (t->ssl != NULL && !t->tlsfast) {
+		t->tlsmx = malloc(sizeof (pthread_mutex_t));
+		pthread_mutex_init(t->tlsmx, NULL);
+		if (fcntl(t->sock, F_SETFL,
+		    fcntl(t->sock, F_GETFL) | O_NONBLOCK) < 0) {
+			perror("fcntl");
+			exit(1);
+		}
+	}
+}
+
+/*
+ * report_tls prints the distribution of handshake times, which are kept
+ * apart from the message round trip times.
+ */
+static void
+report_tls(test_t *tests, int nthreads, int step)
+{
+	uint64_t	*hs;
+	uint64_t	tot = 0;
+	int		i, n = 0, ktx = 0, krx = 0;
+
+	hs = calloc(nthreads, sizeof (uint64_t));
+	for (i = 0; i < nthreads; i += step) {
+		if (tests[i].tlsver == NULL)
+			continue;
+		hs[n++] = tests[i].hslat;
+		tot += tests[i].hslat;
+		ktx += (tests[i].ktls & 1) ? 1 : 0;
+		krx += (tests[i].ktls & 2) ? 1 : 0;
+	}
+	if (n == 0) {
+		free(hs);
+		return;
+	}
+	qsort(hs, n, sizeof (uint64_t), cmpu64);
+	printf("TLS: %s %s, kTLS tx %d/%d rx %d/%d\n",
+	    tests[0].tlsver, tests[0].tlscipher, ktx, n, krx, n);
+	printf("TLS HANDSHAKE LATENCY:\n");
+	printf("Average:  %.1f us\n", tot / n / 1000.0);
+	printf("Median:   %.1f us\n", pctile(hs, n, 50.0)/1000.0);
+	printf("99.0%%ile: %.1f us\n", pctile(hs, n, 99.0)/1000.0);
+	printf("Minimum:  %.1f us\n", hs[0]/1000.0);
+	printf("Maximum:  %.1f us\n", hs[n-1]/1000.0);
+	free(hs);
+}
+#endif /* HAVE_OPENSSL */
+
+/*
+ * report_udp prints the datagram accounting for each flow, and overall.
+ */
+static void
+report_udp(test_t *tests, int nthreads, uint64_t elapsed)
+{
+	uint64_t	sent = 0, expect = 0, got = 0, dups = 0, reord = 0;
+	uint64_t	sumdist = 0, maxdist = 0;
+	int		i;
+
+	printf("DATAGRAMS:\n");
+	for (i = 0; i < nthreads; i += 2) {
+		test_t *s = &tests[i];
+		seqtrack_t *st = &tests[i + 1].st;
+
+		printf("Flow %d: sent %" PRIu64 ", replies %" PRIu64
+		    "/%" PRIu64 ", lost %" PRIu64 ", duplicate %" PRIu64
+		    ", reordered %" PRIu64 " (max distance %" PRIu64 ")\n",
+		    i / 2, s->sseqno, st->unique, s->expect,
+		    s->expect - min(st->unique, s->expect), st->dups,
+		    st->reordered, st->maxdist);
+		sent += s->sseqno;
+		expect += s->expect;
+		got += min(st->unique, s->expect);
+		dups += st->dups;
+		reord += st->reordered;
+		sumdist += st->sumdist;
+		maxdist = max(maxdist, st->maxdist);
+	}
+	printf("Sent:       %" PRIu64 " (%.0f/s)\n", sent,
+	    elapsed ? sent * 1e9 / elapsed : 0.0);
+	printf("Lost:       %" PRIu64 " of %" PRIu64 " replies (%.3f%%)\n",
+	    expect - got, expect,
+	    expect ? (expect - got) * 100.0 / expect : 0.0);
+	printf("Duplicated: %" PRIu64 "\n", dups);
+	printf("Reordered:  %" PRIu64 " (mean distance %.1f, max %" PRIu64
+	    ")\n", reord, reord ? (double)sumdist / reord : 0.0, maxdist);
+}
+
+/*
+ * report_hist prints a summary of a histogram of nanosecond values.
+ */
+static void
+report_hist(const char *title, const hist_t *h)
+{
+	printf("%s:\n", title);
+	printf("Count:    %" PRIu64 "\n", h->count);
+	printf("Average:  %.1f us\n", h->count ? h->sum / h->count / 1000.0 : 0);
+	printf("Median:   %.1f us\n", hist_pctile(h, 50.0)/1000.0);
+	printf("99.0%%ile: %.1f us\n", hist_pctile(h, 99.0)/1000.0);
+	printf("99.9%%ile: %.1f us\n", hist_pctile(h, 99.9)/1000.0);
+	printf("Maximum:  %.1f us\n", h->max/1000.0);
+}
+
+/*
+ * report_idle describes the idle population, and then the latency of the
+ * flows under test at each level of population that they ran alongside.
+ */
+static void
+report_idle(idler_t *idlers, int nidlers, test_t *tests, int nthreads)
+{
+	hist_t		lat;
+	uint64_t	opened = 0, sent = 0, skipped = 0, failed = 0;
+	uint64_t	closed = 0, *lv[IDLE_STEPS + 1], nlv[IDLE_STEPS + 1];
+	uint32_t	step = max(idle_target / IDLE_STEPS, 1);
+	int		i, k, top = 0, err = 0;
+	uint64_t	ii;
+
+	memset(&lat, 0, sizeof (lat));
+	for (i = 0; i < nidlers; i++) {
+		idler_t *d = &idlers[i];
+		hist_merge(&lat, &d->lat);
+		opened += d->opened;
+		sent += d->sent;
+		skipped += d->skipped;
+		failed += d->failed;
+		closed += d->closed;
+		if (err == 0) {
+			err = d->err;
+		}
+	}
+	for (k = 1; k <= IDLE_STEPS; k++) {
+		if (idle_marks[k] != 0) {
+			top = k;
+		}
+	}
+
+	printf("IDLE CONNECTIONS:\n");
+	printf("Opened:   %" PRIu64 " of %u, %" PRIu64 " failed%s%s\n",
+	    opened, idle_target, failed, err ? ": " : "",
+	    err ? strerror(err) : "");
+	if (top > 0) {
+		printf("Reached:  %u open after %.3f s\n", top * step,
+		    (idle_marks[top] - idle_marks[0]) / 1e9);
+	}
+	printf("Closed:   %" PRIu64 " by the peer\n", closed);
+	printf("Heartbeats: %" PRIu64 " sent, %" PRIu64
+	    " skipped awaiting a reply\n", sent, skipped);
+	report_hist("HEARTBEAT LATENCY", &lat);
+
+	/* sort the flows' replies by the population when they were sent */
+	memset(nlv, 0, sizeof (nlv));
+	for (k = 0; k <= IDLE_STEPS; k++) {
+		lv[k] = calloc(1, sizeof (uint64_t));
+	}
+	for (i = 0; i < nthreads; i++) {
+		test_t *t = &tests[i];
+		for (ii = 0; ii < min(t->replies, t->nsamples); ii++) {
+			sample_t *sp = &t->samples[ii];
+			if (!in_window(t, sp->when)) {
+				continue;
+			}
+			for (k = top; k > 0; k--) {
+				if (idle_marks[k] != 0 &&
+				    idle_marks[k] <= sp->when) {
+					break;
+				}
+			}
+			if ((nlv[k] & (nlv[k] - 1)) == 0) {
+				lv[k] = realloc(lv[k],
+				    2 * max(nlv[k], 1) * sizeof (uint64_t));
+			}
+			lv[k][nlv[k]++] = sp->lat;
+		}
+	}
+	printf("LATENCY BY IDLE POPULATION:\n");
+	printf("%9s %10s %10s %10s\n", "idle", "replies", "p50 (us)",
+	    "p99 (us)");
+	for (k = 0; k <= IDLE_STEPS; k++) {
+		if (nlv[k] != 0) {
+			qsort(lv[k], nlv[k], sizeof (uint64_t), cmpu64);
+			printf("%9u %10" PRIu64 " %10.1f %10.1f\n", k * step,
+			    nlv[k], pctile(lv[k], nlv[k], 50.0) / 1000.0,
+			    pctile(lv[k], nlv[k], 99.0) / 1000.0);
+		}
+		free(lv[k]);
+	}
+}
+
+/*
+ * report_reorder shows how often replies were overtaken by those to later
+ * requests, and by how many (the depth), when the replier reorders them.
+ */
+static void
+report_reorder(test_t *tests, int nthreads)
+{
+	uint64_t	got = 0, reord = 0, sumdist = 0, maxdist = 0;
+	int		i;
+
+	for (i = 0; i < nthreads; i++) {
+		seqtrack_t *st = &tests[i].st;
+
+		got += st->unique;
+		reord += st->reordered;
+		sumdist += st->sumdist;
+		maxdist = max(maxdist, st->maxdist);
+	}
+	printf("REORDERED REPLIES:\n");
+	printf("Reordered:  %" PRIu64 " of %" PRIu64 " (%.1f%%)\n",
+	    reord, got, got ? reord * 100.0 / got : 0.0);
+	printf("Depth:      mean %.1f, max %" PRIu64 "\n",
+	    reord ? (double)sumdist / reord : 0.0, maxdist);
+}
+
+/*
+ * tcpinfo_stat prints the min, mean and max of one tcpsample field.
+ */
+static void
+tcpinfo_stat(const char *name, const tcpsample_t *s, uint32_t n, size_t off,
+    const char *unit)
+{
+	uint32_t	v, lo = UINT32_MAX, hi = 0, i;
+	double		sum = 0;
+
+	for (i = 0; i < n; i++) {
+		memcpy(&v, (const char *)&s[i] + off, sizeof (v));
+		lo = min(lo, v);
+		hi = max(hi, v);
+		sum += v;
+	}
+	printf("  %-11s min %u, mean %.0f, max %u %s\n",
+	    name, lo, sum / n, hi, unit);
+}
+
+#define	TCPI_SLOWEST	5
+
+/*
+ * report_tcpinfo summarises the TCP_INFO samples for each connection, and
+ * then, for the slowest messages, shows what TCP was doing when each
+ * completed: the nearest sample after it, and what changed since the one
+ * before.  This tells retransmits, a collapsed window, or a receiver that
+ * wasn't reading, apart from delays in the application.
+ */
+static void
+report_tcpinfo(test_t *tests, int nthreads, uint64_t intvl,
+    uint64_t begin_time)
+{
+	sample_t	slow[TCPI_SLOWEST];
+	int		slowt[TCPI_SLOWEST];
+	int		nslow = 0, i, j;
+	uint32_t	k;
+
+	printf("TCP_INFO (every %.1f ms):\n", intvl / 1000000.0);
+	for (i = 0; i < nthreads; i++) {
+		test_t *t = &tests[i];
+		tcpsample_t *s = t->tcpinfo, *last;
+
+		if (t->ntcpinfo == 0) {
+			continue;
+		}
+		last = &s[t->ntcpinfo - 1];
+		printf("Conn %d: %u samples\n", i, t->ntcpinfo);
+		tcpinfo_stat("rtt:", s, t->ntcpinfo,
+		    offsetof(tcpsample_t, rtt), "us");
+		tcpinfo_stat("rttvar:", s, t->ntcpinfo,
+		    offsetof(tcpsample_t, rttvar), "us");
+		tcpinfo_stat("cwnd:", s, t->ntcpinfo,
+		    offsetof(tcpsample_t, cwnd), "segs");
+		tcpinfo_stat("unacked:", s, t->ntcpinfo,
+		    offsetof(tcpsample_t, unacked), "segs");
+		tcpinfo_stat("snd_wnd:", s, t->ntcpinfo,
+		    offsetof(tcpsample_t, snd_wnd), "bytes");
+		tcpinfo_stat("rcv_space:", s, t->ntcpinfo,
+		    offsetof(tcpsample_t, rcv_space), "bytes");
+		printf("  %-11s %u\n", "retrans:", last->retrans - s->retrans);
+		printf("  %-11s %.1f ms, rwnd limited %.1f%%, "
+		    "sndbuf limited %.1f%%\n", "busy:", last->busy / 1000.0,
+		    last->busy ? last->rwnd_limited * 100.0 / last->busy : 0.0,
+		    last->busy ? last->sndbuf_limited * 100.0 / last->busy :
+		    0.0);
+
+		for (k = 0; k < t->replies; k++) {
+			if (nslow == TCPI_SLOWEST &&
+			    t->samples[k].lat <= slow[nslow - 1].lat) {
+				continue;
+			}
+			j = (nslow < TCPI_SLOWEST) ? nslow++ : nslow - 1;
+			for (; j > 0 && slow[j - 1].lat < t->samples[k].lat;
+			    j--) {
+				slow[j] = slow[j - 1];
+				slowt[j] = slowt[j - 1];
+			}
+			slow[j] = t->samples[k];
+			slowt[j] = i;
+		}
+	}
+	if (nslow == 0) {
+		return;
+	}
+
+	printf("SLOWEST MESSAGES:\n");
+	for (j = 0; j < nslow; j++) {
+		test_t *t = &tests[slowt[j]];
+		uint64_t done = slow[j].when + slow[j].lat;
+		tcpsample_t *s, *p;
+		uint32_t lo = 0, hi = t->ntcpinfo - 1;
+
+		/* the first sample taken after the message completed */
+		while (lo < hi) {
+			k = (lo + hi) / 2;
+			if (t->tcpinfo[k].when < done) {
+				lo = k + 1;
+			} else {
+				hi = k;
+			}
+		}
+		s = &t->tcpinfo[lo];
+		p = lo ? s - 1 : s;
+		printf("%.1f us at %.3f s (conn %d): rtt %u us, cwnd %u, "
+		    "unacked %u, retrans +%u, rwnd limited +%" PRIu64
+		    " us, sndbuf limited +%" PRIu64 " us\n",
+		    slow[j].lat / 1000.0, (slow[j].when - begin_time) / 1e9,
+		    slowt[j], s->rtt, s->cwnd, s->unacked,
+		    s->retrans - p->retrans, s->rwnd_limited - p->rwnd_limited,
+		    s->sndbuf_limited - p->sndbuf_limited);
+	}
+}
+
+/*
+ * dump_tcpinfo writes every TCP_INFO sample, with times on the same basis
+ * as the latency dump, so that the two can be lined up.
+ */
+static void
+dump_tcpinfo(test_t *tests, int nthreads, uint64_t begin_time,
+    const char *name)
+{
+	char		path[1024];
+	FILE		*f;
+	int		i;
+	uint32_t	k;
+
+	(void) snprintf(path, sizeof (path), "%s.tcpinfo", name);
+	if ((f = fopen(path, "w")) == NULL) {
+		fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+		return;
+	}
+	fprintf(f, "# thread time rtt rttvar cwnd unacked snd_wnd rcv_space "
+	    "retrans busy rwnd_limited sndbuf_limited\n");
+	for (i = 0; i < nthreads; i++) {
+		for (k = 0; k < tests[i].ntcpinfo; k++) {
+			tcpsample_t *s = &tests[i].tcpinfo[k];
+
+			fprintf(f, "%d %" PRIu64 " %u %u %u %u %u %u %u %"
+			    PRIu64 " %" PRIu64 " %" PRIu64 "\n", i,
+			    s->when - begin_time, s->rtt, s->rttvar, s->cwnd,
+			    s->unacked, s->snd_wnd, s->rcv_space, s->retrans,
+			    s->busy, s->rwnd_limited, s->sndbuf_limited);
+		}
+	}
+	fclose(f);
+}
+
+/*
+ * report_replay prints how well a replay kept to its trace: how late each
+ * message went, and how much longer than the trace the whole run took.
+ */
+static void
+report_replay(test_t *tests, int nthreads, const trace_t *tr,
+    uint64_t elapsed)
+{
+	hist_t		*h;
+	uint64_t	behind = 0;
+	int		i;
+
+	h = calloc(1, sizeof (*h));
+	for (i = 0; i < nthreads; i += 2) {
+		hist_merge(h, &tests[i].pace.err);
+		behind += tests[i].behind;
+	}
+	printf("REPLAY: %" PRIu64 " messages on %d connections, "
+	    "%.1f ms of trace at %gx\n", tr->nmsgs, tr->nconns,
+	    tr->span / 1e6, tr->speed);
+	printf("Took %.1f ms; %" PRIu64 " messages (%.2f%%) over %.0f us "
+	    "behind schedule\n", elapsed / 1e6, behind,
+	    h->count ? behind * 100.0 / h->count : 0.0, REPLAY_LATE / 1000.0);
+	report_hist("SCHEDULE DEVIATION", h);
+	free(h);
+}
+
+/*
+ * report_chunks reports on replies that came in several chunks: how long
+ * after the request the first and the last of them arrived, and the gaps
+ * between them, as a client of a streaming server would see them.
+ */
+static void
+report_chunks(test_t *tests, int nthreads)
+{
+	hist_t		*first, *last, *gap;
+	int		i;
+
+	first = calloc(1, sizeof (*first));
+	last = calloc(1, sizeof (*last));
+	gap = calloc(1, sizeof (*gap));
+	for (i = 1; i < nthreads; i += 2) {
+		hist_merge(first, &tests[i].cfirst);
+		hist_merge(last, &tests[i].clast);
+		hist_merge(gap, &tests[i].cgap);
+	}
+	report_hist("TIME TO FIRST CHUNK", first);
+	report_hist("TIME TO LAST CHUNK", last);
+	report_hist("INTER-CHUNK GAP", gap);
+	free(first);
+	free(last);
+	free(gap);
+}
+
+/*
+ * stall_overlap says whether any of the probe's stalls overlapped the time
+ * from start to end.  The stalls are in order, and don't overlap.
+ */
+static int
+stall_overlap(const jprobe_t *jp, uint64_t start, uint64_t end)
+{
+	uint64_t	lo = 0, hi = jp->nstalls, mid;
+
+	/* find the first stall to end after start */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (jp->stalls[mid].end <= start) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo < jp->nstalls && jp->stalls[lo].start < end);
+}
+
+/*
+ * report_jitter prints what the probe saw, and how many of the slowest
+ * messages (those over the 99.9th percentile, and over 1 ms) were in
+ * flight during a stall.  If most were, the host is the place to look.
+ */
+static void
+report_jitter(const jprobe_t *jp, test_t *tests, int nthreads,
+    uint64_t p999)
+{
+	uint64_t	lim[2] = { p999, 1000000 };
+	uint64_t	slow[2] = { 0, 0 }, hit[2] = { 0, 0 };
+	uint64_t	i, k, stalled = 0, longest = 0;
+	int		j;
+
+	for (i = 0; i < jp->nstalls; i++) {
+		stalled += jp->stalls[i].end - jp->stalls[i].start;
+		longest = max(longest, jp->stalls[i].end - jp->stalls[i].start);
+	}
+	for (j = 0; j < nthreads; j++) {
+		test_t *t = &tests[j];
+		for (i = 0; i < min(t->replies, t->nsamples); i++) {
+			const sample_t *sp = &t->samples[i];
+			uint64_t rtt = sp->lat + sp->svc;
+			if (!in_window(t, sp->when)) {
+				continue;
+			}
+			for (k = 0; k < 2; k++) {
+				if (sp->lat <= lim[k]) {
+					continue;
+				}
+				slow[k]++;
+				hit[k] += stall_overlap(jp, sp->when,
+				    sp->when + rtt);
+			}
+		}
+	}
+
+	printf("SCHEDULER JITTER (every %.0f us%s):\n", jp->intvl / 1000.0,
+	    jp->rt ? ", SCHED_FIFO" : ", not real-time");
+	report_hist("Wakeup latency", &jp->late);
+	printf("Stalls over %.1f us: %" PRIu64 ", longest %.1f us, %.1f us "
+	    "in all (%.3f%% of the run)\n", jp->thresh / 1000.0,
+	    jp->nstalls + jp->dropped, longest / 1000.0, stalled / 1000.0,
+	    jp->end > jp->begin ? stalled * 100.0 / (jp->end - jp->begin) :
+	    0.0);
+	for (k = 0; k < 2; k++) {
+		printf("Latency over %s (%.1f us): %" PRIu64 ", %" PRIu64
+		    " (%.1f%%) during a stall\n", k == 0 ? "99.9%ile" : "1 ms",
+		    lim[k] / 1000.0, slow[k], hit[k],
+		    slow[k] ? hit[k] * 100.0 / slow[k] : 0.0);
+	}
+}
+
+/*
+ * report_perf prints the perf option's counters, summed over the threads
+ * in each role.
+ */
+static void
+report_perf(test_t *tests, int nthreads, int step)
+{
+	pcount_t	sum[2];
+	int		i;
+
+	memset(sum, 0, sizeof (sum));
+	for (i = 0; i < nthreads; i++) {
+		pc_merge(&sum[i % step], &tests[i].pc);
+	}
+	if (step == 1) {
+		report_pc("SENDER THREAD COUNTERS, PER ROUND TRIP", &sum[0]);
+	} else {
+		report_pc("SENDER THREAD COUNTERS, PER REQUEST", &sum[0]);
+		report_pc("RECEIVER THREAD COUNTERS, PER REPLY", &sum[1]);
+	}
+}
+
+/*
+ * report_pacing prints how late the senders were relative to their send
+ * schedules (only when there was a send delay to keep).
+ */
+static void
+report_pacing(test_t *tests, int nthreads)
+{
+	hist_t	*h;
+	int	i;
+
+	h = calloc(1, sizeof (*h));
+	for (i = 0; i < nthreads; i++) {
+		hist_merge(h, &tests[i].pace.err);
+	}
+	if (h->count != 0) {
+		report_hist("SEND PACING ERROR", h);
+	}
+	free(h);
+}
+
+/*
+ * A clockest_t is an estimate of how a connection's replier clock stands
+ * against ours: it is offset + drift * (t - base) ns ahead at time t, to
+ * within err ns either way.
+ */
+#define	CLOCK_BINS	16	/* slices of the run, for min-RTT filtering */
+#define	CLOCK_SLACK	2	/* how much slower than the fastest to use */
+
+typedef struct clockest {
+	uint64_t	base;
+	double		offset;
+	double		drift;
+	double		err;
+} clockest_t;
+
+/*
+ * clock_estimate estimates a connection's replier clock, NTP fashion, from
+ * the four timestamps of each exchange.  As neither one-way trip can be
+ * negative, each reply puts the offset within half its round trip of
+ * fwd - lat/2, so the fastest replies pin it down best: the fastest in
+ * each of CLOCK_BINS slices of the measurement window, unless it was
+ * queued behind others (taking more than CLOCK_SLACK times the fastest of
+ * all), are fitted to a line, to follow drift.  The error given is the
+ * furthest any of them is from the line, plus half its round trip.
+ * Returns -1 if there are no replies to go on.
+ */
+static int
+clock_estimate(const test_t *t, clockest_t *ce)
+{
+	const sample_t	*best[CLOCK_BINS];
+	uint64_t	lo = UINT64_MAX, hi = 0, fast = UINT64_MAX, ii, n;
+	double		mx = 0, my = 0, sxx = 0, sxy = 0, x, y;
+	int		k, nb = 0;
+
+	n = min(t->replies, t->nsamples);
+	for (ii = 0; ii < n; ii++) {
+		if (in_window(t, t->samples[ii].when)) {
+			lo = min(lo, t->samples[ii].when);
+			hi = max(hi, t->samples[ii].when);
+		}
+	}
+	if (lo > hi) {
+		return (-1);
+	}
+	memset(best, 0, sizeof (best));
+	for (ii = 0; ii < n; ii++) {
+		const sample_t *sp = &t->samples[ii];
+		if (!in_window(t, sp->when)) {
+			continue;
+		}
+		k = (int)((double)(sp->when - lo) * CLOCK_BINS / (hi - lo + 1));
+		k = min(k, CLOCK_BINS - 1);
+		if (best[k] == NULL || sp->lat < best[k]->lat) {
+			best[k] = sp;
+		}
+		fast = min(fast, sp->lat);
+	}
+	for (k = 0; k < CLOCK_BINS; k++) {
+		if (best[k] != NULL && best[k]->lat > CLOCK_SLACK * fast) {
+			best[k] = NULL;
+		}
+	}
+
+	for (k = 0; k < CLOCK_BINS; k++) {
+		if (best[k] != NULL) {
+			mx += best[k]->when - lo;
+			my += best[k]->fwd - best[k]->lat / 2.0;
+			nb++;
+		}
+	}
+	mx /= nb;
+	my /= nb;
+	for (k = 0; k < CLOCK_BINS; k++) {
+		if (best[k] != NULL) {
+			x = best[k]->when - lo - mx;
+			y = best[k]->fwd - best[k]->lat / 2.0 - my;
+			sxx += x * x;
+			sxy += x * y;
+		}
+	}
+	ce->base = lo;
+	ce->drift = (sxx > 0) ? sxy / sxx : 0;
+	ce->offset = my - ce->drift * mx;
+	ce->err = 0;
+	for (k = 0; k < CLOCK_BINS; k++) {
+		if (best[k] != NULL) {
+			x = best[k]->when - lo;
+			y = best[k]->fwd - best[k]->lat / 2.0;
+			ce->err = max(ce->err, fabs(y - ce->offset -
+			    ce->drift * x) + best[k]->lat / 2.0);
+		}
+	}
+	return (0);
+}
+
+/*
+ * report_dist prints a summary of sorted nanosecond values, under title
+ * unless that is NULL.
+ */
+static void
+report_dist(const char *title, uint64_t *v, uint64_t n)
+{
+	if (title != NULL) {
+		printf("%s:\n", title);
+	}
+	printf("Median:   %.1f us\n", pctile(v, n, 50.0)/1000.0);
+	printf("90.0%%ile: %.1f us\n", pctile(v, n, 90.0)/1000.0);
+	printf("99.0%%ile: %.1f us\n", pctile(v, n, 99.0)/1000.0);
+	printf("99.9%%ile: %.1f us\n", pctile(v, n, 99.9)/1000.0);
+	printf("Minimum:  %.1f us\n", v[0]/1000.0);
+	printf("Maximum:  %.1f us\n", v[n-1]/1000.0);
+}
+
+/*
+ * report_oneway splits each round trip into its forward and return trips,
+ * using an estimate of each connection's replier clock.  A trip is never
+ * taken to be shorter than nothing, nor longer than the round trip.
+ */
+static void
+report_oneway(test_t *tests, int nthreads)
+{
+	clockest_t	ce;
+	uint64_t	*fwd, *ret, n = 0, ii;
+	double		off, lo = INFINITY, hi = -INFINITY, sumoff = 0;
+	double		sumdrift = 0, err = 0, f;
+	int		i, nconn = 0;
+	char		title[64];
+
+	for (i = 0; i < nthreads; i++) {
+		n += min(tests[i].replies, tests[i].nsamples);
+	}
+	fwd = calloc(n ? n : 1, sizeof (uint64_t));
+	ret = calloc(n ? n : 1, sizeof (uint64_t));
+	n = 0;
+	for (i = 0; i < nthreads; i++) {
+		test_t *t = &tests[i];
+		if (clock_estimate(t, &ce) != 0) {
+			continue;
+		}
+		nconn++;
+		sumoff += ce.offset;
+		sumdrift += ce.drift;
+		lo = min(lo, ce.offset);
+		hi = max(hi, ce.offset);
+		err = max(err, ce.err);
+		for (ii = 0; ii < min(t->replies, t->nsamples); ii++) {
+			sample_t *sp = &t->samples[ii];
+			if (!in_window(t, sp->when)) {
+				continue;
+			}
+			off = ce.offset + ce.drift * (sp->when - ce.base);
+			f = min(max(sp->fwd - off, 0.0), (double)sp->lat);
+			fwd[n] = (uint64_t)f;
+			ret[n] = sp->lat - fwd[n];
+			n++;
+		}
+	}
+	if (n != 0) {
+		qsort(fwd, n, sizeof (uint64_t), cmpu64);
+		qsort(ret, n, sizeof (uint64_t), cmpu64);
+
+		printf("REPLIER CLOCK:\n");
+		printf("Offset:   %+.1f us", sumoff / nconn / 1000.0);
+		if (nconn > 1) {
+			printf(" (%.1f to %.1f us over %d connections)",
+			    lo / 1000.0, hi / 1000.0, nconn);
+		}
+		printf("\n");
+		printf("Drift:    %.3f ppm\n", sumdrift / nconn * 1e6);
+		printf("Error:    +/- %.1f us\n", err / 1000.0);
+		(void) snprintf(title, sizeof (title),
+		    "FORWARD LATENCY (+/- %.1f us)", err / 1000.0);
+		report_dist(title, fwd, n);
+		(void) snprintf(title, sizeof (title),
+		    "RETURN LATENCY (+/- %.1f us)", err / 1000.0);
+		report_dist(title, ret, n);
+	}
+	free(fwd);
+	free(ret);
+}
+
+/*
+ * report_breakdown splits the time taken by each message into its stages:
+ * the send call, the wait in the replier's receive queue (if the replier
+ * could tell), the rest of the round trip, and the service time the round
+ * trip leaves out, against the reply delay asked for.  The slowest 1% of
+ * round trips are then compared with the rest, stage by stage, to show
+ * where a tail comes from.
+ */
+static void
+report_breakdown(test_t *tests, int nthreads)
+{
+	hist_t		*scall;
+	uint64_t	*lat, *queue, *svc, *over;
+	uint64_t	n = 0, nq = 0, no = 0, ii, slow;
+	double		sum[2][4], cnt[2][2];
+	int		i, k;
+
+	for (i = 0; i < nthreads; i++) {
+		n += min(tests[i].replies, tests[i].nsamples);
+	}
+	scall = calloc(1, sizeof (*scall));
+	lat = calloc(n ? n : 1, sizeof (uint64_t));
+	queue = calloc(n ? n : 1, sizeof (uint64_t));
+	svc = calloc(n ? n : 1, sizeof (uint64_t));
+	over = calloc(n ? n : 1, sizeof (uint64_t));
+	n = 0;
+	for (i = 0; i < nthreads; i++) {
+		test_t *t = &tests[i];
+		hist_merge(scall, &t->scall);
+		for (ii = 0; ii < min(t->replies, t->nsamples); ii++) {
+			sample_t *sp = &t->samples[ii];
+			if (!in_window(t, sp->when)) {
+				continue;
+			}
+			lat[n] = sp->lat;
+			svc[n++] = sp->svc;
+			if (sp->queue >= 0) {
+				queue[nq++] = sp->queue;
+			}
+			if (sp->rdly != 0) {
+				over[no++] = sp->svc - min(sp->svc, sp->rdly);
+			}
+		}
+	}
+	if (n == 0) {
+		goto out;
+	}
+	qsort(lat, n, sizeof (uint64_t), cmpu64);
+	slow = (uint64_t)pctile(lat, n, 99.0);
+
+	/* means of each stage, over all replies ([0]) and the slowest ([1]) */
+	memset(sum, 0, sizeof (sum));
+	memset(cnt, 0, sizeof (cnt));
+	for (i = 0; i < nthreads; i++) {
+		test_t *t = &tests[i];
+		for (ii = 0; ii < min(t->replies, t->nsamples); ii++) {
+			sample_t *sp = &t->samples[ii];
+			if (!in_window(t, sp->when)) {
+				continue;
+			}
+			for (k = 0; k < 2; k++) {
+				if (k == 1 && sp->lat < slow) {
+					continue;
+				}
+				sum[k][0] += sp->lat;
+				sum[k][3] += sp->svc;
+				cnt[k][0]++;
+				if (sp->queue >= 0) {
+					sum[k][1] += sp->queue;
+					sum[k][2] += sp->lat - sp->queue;
+					cnt[k][1]++;
+				}
+			}
+		}
+	}
+
+	report_hist("SEND CALL TIME", scall);
+	if (nq != 0) {
+		qsort(queue, nq, sizeof (uint64_t), cmpu64);
+		report_dist("REPLIER QUEUE TIME", queue, nq);
+	} else {
+		printf("REPLIER QUEUE TIME: not known to the replier\n");
+	}
+	qsort(svc, n, sizeof (uint64_t), cmpu64);
+	report_dist("SERVICE TIME", svc, n);
+	if (no != 0) {
+		qsort(over, no, sizeof (uint64_t), cmpu64);
+		report_dist("SERVICE BEYOND THE DELAY ASKED", over, no);
+	}
+
+	printf("SLOWEST 1%% OF REPLIES:\n");
+	printf("%-16s %10s %10s\n", "mean (us)", "all", "slowest");
+	printf("%-16s %10.1f %10.1f\n", "Round trip:",
+	    sum[0][0] / cnt[0][0] / 1000.0, sum[1][0] / cnt[1][0] / 1000.0);
+	if (cnt[0][1] != 0) {
+		printf("%-16s %10.1f %10.1f\n", "  queued:",
+		    sum[0][1] / cnt[0][1] / 1000.0,
+		    cnt[1][1] ? sum[1][1] / cnt[1][1] / 1000.0 : 0.0);
+		printf("%-16s %10.1f %10.1f\n", "  the rest:",
+		    sum[0][2] / cnt[0][1] / 1000.0,
+		    cnt[1][1] ? sum[1][2] / cnt[1][1] / 1000.0 : 0.0);
+	}
+	printf("%-16s %10.1f %10.1f\n", "Service:",
+	    sum[0][3] / cnt[0][0] / 1000.0, sum[1][3] / cnt[1][0] / 1000.0);
+out:
+	free(scall);
+	free(lat);
+	free(queue);
+	free(svc);
+	free(over);
+}
+
+static double
+gbps(uint64_t bytes, uint64_t nsec)
+{
+	return (nsec ? (bytes * 8.0) / nsec : 0.0);
+}
+
+static uint64_t
+cputime(const struct rusage *ru)
+{
+	return ((ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000000ull +
+	    (ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1000ull);
+}
+
+/*
+ * latency_collect gathers the latency of every reply that the tests have
+ * received within their measurement windows, returning them sorted, with
+ * their number in *np.
+ */
+static uint64_t *
+latency_collect(test_t *tests, int nthreads, uint64_t *np)
+{
+	uint64_t	*samples;
+	uint64_t	n = 0;
+	int		i, ii;
+
+	for (i = 0; i < nthreads; i++) {
+		n += min(tests[i].replies, tests[i].nsamples);
+	}
+	samples = calloc(n ? n : 1, sizeof (uint64_t));
+	n = 0;
+	for (i = 0; i < nthreads; i++) {
+		test_t *t = &tests[i];
+		for (ii = 0; ii < min(t->replies, t->nsamples); ii++) {
+			if (in_window(t, t->samples[ii].when)) {
+				samples[n++] = t->samples[ii].lat;
+			}
+		}
+	}
+	qsort(samples, n, sizeof (uint64_t), cmpu64);
+	*np = n;
+	return (samples);
+}
+
+/*
+ * measure_window finds the span of time over which messages were being
+ * measured, from the first connection to begin measuring to the last to
+ * finish.  A connection that measured until the end of its trial, with
+ * no cooldown, is taken to have finished at end.
+ */
+static void
+measure_window(test_t *tests, int nthreads, uint64_t end,
+    uint64_t *wbegin, uint64_t *wend)
+{
+	int i;
+
+	*wbegin = UINT64_MAX;
+	*wend = 0;
+	for (i = 0; i < nthreads; i++) {
+		test_t *t = &tests[i];
+		if (t->skip || (t->peer != NULL && t->peer < t)) {
+			continue;	/* idle, or the receiving half */
+		}
+		*wbegin = min(*wbegin, t->mbegin);
+		*wend = max(*wend, min(t->mend, end));
+	}
+	if (*wbegin > *wend) {
+		*wbegin = *wend;
+	}
+}
+
+/*
+ * A sweep runs one trial for each combination of the thread counts, send
+ * sizes and send delays given, over the same connections, to trace out
+ * how latency grows with load.
+ */
+typedef struct sweep {
+	vlist_t		threads;
+	vlist_t		ssize;
+	vlist_t		sdelay;
+} sweep_t;
+
+typedef struct sweep_point {
+	uint64_t	threads;
+	uint64_t	ssize;
+	uint64_t	sdelay;
+	double		tput;		/* msgs/s */
+	double		p50;		/* latency percentiles (ns) */
+	double		p99;
+	double		p999;
+} sweep_point_t;
+
+/*
+ * sweep_knee finds the knee of a curve of n points: the one beyond which
+ * more throughput is bought with disproportionately more tail latency.
+ * Throughput and 99th percentile latency are each scaled to the range
+ * [0, 1] over the curve, and the knee is the point at which scaled
+ * throughput most exceeds scaled latency.
+ */
+static int
+sweep_knee(const sweep_point_t *pts, int n)
+{
+	double tmin = pts[0].tput, tmax = pts[0].tput;
+	double lmin = pts[0].p99, lmax = pts[0].p99;
+	double x, y, best = -2.0;
+	int i, knee = 0;
+
+	for (i = 1; i < n; i++) {
+		tmin = fmin(tmin, pts[i].tput);
+		tmax = fmax(tmax, pts[i].tput);
+		lmin = fmin(lmin, pts[i].p99);
+		lmax = fmax(lmax, pts[i].p99);
+	}
+	for (i = 0; i < n; i++) {
+		x = (tmax > tmin) ? (pts[i].tput - tmin) / (tmax - tmin) : 0;
+		y = (lmax > lmin) ? (pts[i].p99 - lmin) / (lmax - lmin) : 0;
+		if (x - y > best) {
+			best = x - y;
+			knee = i;
+		}
+	}
+	return (knee);
+}
+
+/*
+ * run_sweep runs every point of the sweep, printing each as it completes,
+ * and then the knee of each curve.  A curve is the run of points over
+ * which the innermost swept option varies, the others being held fixed.
+ * Tests are grouped in step's (one per connection in -S mode, a sender
+ * and receiver pair in -s mode), and only the first groups take part in
+ * a point with fewer threads than were started.
+ */
+static void
+run_sweep(const sweep_t *sw, test_t *tests, int nthreads, int step)
+{
+	sweep_point_t	*pts, *pt;
+	uint64_t	*samples, n, begin, end;
+	int		a, b, c, i, k, len, p, npts;
+
+	npts = sw->threads.n * sw->ssize.n * sw->sdelay.n;
+	pts = calloc(npts, sizeof (sweep_point_t));
+
+	printf("SWEEP:\n");
+	printf("%7s %7s %10s %12s %10s %10s %10s\n", "threads", "ssize",
+	    "sdelay", "msgs/s", "p50 (us)", "p99 (us)", "p99.9 (us)");
+	for (p = 0; p < npts; p++) {
+		/* threads vary slowest, and sdelay fastest */
+		a = p / (sw->ssize.n * sw->sdelay.n);
+		b = (p / sw->sdelay.n) % sw->ssize.n;
+		c = p % sw->sdelay.n;
+
+		pt = &pts[p];
+		pt->threads = sw->threads.v[a];
+		pt->ssize = min(maxmsg,
+		    max(sizeof (test_header_t), sw->ssize.v[b]));
+		pt->sdelay = sw->sdelay.v[c];
+
+		for (i = 0; i < nthreads; i++) {
+			test_t *t = &tests[i];
+			t->skip = (i / step >= pt->threads);
+			t->ssz_min = t->ssz_max = (uint16_t)pt->ssize;
+			t->sdly_min = t->sdly_max = (uint32_t)pt->sdelay;
+		}
+		trial_run(tests, nthreads, &begin, &end);
+		measure_window(tests, nthreads, end, &begin, &end);
+
+		samples = latency_collect(tests, nthreads, &n);
+		pt->tput = (end > begin) ? n * 1e9 / (end - begin) : 0.0;
+		if (n > 0) {
+			pt->p50 = pctile(samples, n, 50.0);
+			pt->p99 = pctile(samples, n, 99.0);
+			pt->p999 = pctile(samples, n, 99.9);
+		}
+		free(samples);
+
+		printf("%7" PRIu64 " %7" PRIu64 " %10" PRIu64
+		    " %12.1f %10.1f %10.1f %10.1f\n",
+		    pt->threads, pt->ssize, pt->sdelay, pt->tput,
+		    pt->p50 / 1000.0, pt->p99 / 1000.0, pt->p999 / 1000.0);
+		fflush(stdout);
+	}
+
+	len = (sw->sdelay.n > 1) ? sw->sdelay.n :
+	    (sw->ssize.n > 1) ? sw->ssize.n : sw->threads.n;
+	for (i = 0; i < npts; i += len) {
+		if (len < 3) {
+			printf("Knee: too few points in each curve\n");
+			break;
+		}
+		k = i + sweep_knee(&pts[i], len);
+		printf("Knee: threads %" PRIu64 " ssize %" PRIu64
+		    " sdelay %" PRIu64 ": %.1f msgs/s, p99 %.1f us\n",
+		    pts[k].threads, pts[k].ssize, pts[k].sdelay,
+		    pts[k].tput, pts[k].p99 / 1000.0);
+	}
+	free(pts);
+}
+
+/*
+ * A search looks for the highest offered rate, in messages per second
+ * over all connections, at which the latency percentile pct stays within
+ * limit.  Trials of count messages per connection bisect the rate range
+ * lo..hi, and the rate found is then confirmed by a longer trial.
+ */
+typedef struct search {
+	double		pct;
+	uint64_t	limit;		/* latency (ns) */
+	double		lo;
+	double		hi;
+	uint64_t	count;
+	uint64_t	confirm;	/* messages in the confirming trial */
+} search_t;
+
+/*
+ * A trial passes only if it also keeps up with the rate asked of it;
+ * once the sender falls behind, the latency it sees no longer reflects
+ * the offered load.
+ */
+#define	SEARCH_SLACK	0.9
+#define	SEARCH_PRECISION 0.01
+
+/*
+ * search_trial runs a trial of count messages per connection at rate,
+ * prints it, and returns 1 if it met the SLO.
+ */
+static int
+search_trial(const search_t *sr, test_t *tests, int nthreads, int step,
+    double rate, uint64_t count, uint64_t *begin, uint64_t *end)
+{
+	int		nconn = nthreads / step;
+	uint64_t	*samples, n, wbegin, wend;
+	double		lat, achieved;
+	int		i, pass;
+
+	for (i = 0; i < nthreads; i++) {
+		test_t *t = &tests[i];
+		t->count = count;
+		t->sdly_min = t->sdly_max = (uint32_t)(nconn * 1e9 / rate);
+	}
+	trial_run(tests, nthreads, begin, end);
+	measure_window(tests, nthreads, *end, &wbegin, &wend);
+
+	samples = latency_collect(tests, nthreads, &n);
+	lat = n ? pctile(samples, n, sr->pct) : INFINITY;
+	free(samples);
+	achieved = (wend > wbegin) ? nconn * count * 1e9 / (wend - wbegin) : 0;
+	pass = (lat <= sr->limit && achieved >= rate * SEARCH_SLACK);
+
+	printf("%12.1f %12.1f %12.1f  %s\n", rate, achieved, lat / 1000.0,
+	    pass ? "pass" : "fail");
+	fflush(stdout);
+	return (pass);
+}
+
+/*
+ * run_search bisects the rate range for the highest rate that meets the
+ * SLO, and confirms it.  The confirming trial is left as the last one
+ * run, with its begin and end in *begin and *end, so that its full
+ * latency distribution can be reported.  Returns 0 if a rate was found
+ * and confirmed, or -1 if not.
+ */
+static int
+run_search(const search_t *sr, test_t *tests, int nthreads, int step,
+    uint64_t *begin, uint64_t *end)
+{
+	double good, bad, mid;
+	int ok;
+
+	printf("SLO SEARCH: %.1f%%ile <= %.1f us, %.1f..%.1f msgs/s\n",
+	    sr->pct, sr->limit / 1000.0, sr->lo, sr->hi);
+	printf("%12s %12s %12s\n", "msgs/s", "achieved", "pctile (us)");
+
+	if (!search_trial(sr, tests, nthreads, step, sr->lo, sr->count,
+	    begin, end)) {
+		printf("SLO not met at %.1f msgs/s\n", sr->lo);
+		return (-1);
+	}
+	good = sr->lo;
+	bad = sr->hi;
+	if (search_trial(sr, tests, nthreads, step, sr->hi, sr->count,
+	    begin, end)) {
+		good = bad;
+	}
+	while (bad - good > good * SEARCH_PRECISION) {
+		mid = (good + bad) / 2;
+		if (search_trial(sr, tests, nthreads, step, mid, sr->count,
+		    begin, end)) {
+			good = mid;
+		} else {
+			bad = mid;
+		}
 	}
 
-	for (i = 0; i < count; i++) {
-
-		uint16_t ssz, rsz;
-		uint32_t sdly, rdly;
-		sh = (void *)sbuf;
-		sptr = sbuf;
+	printf("Confirming %.1f msgs/s with %" PRIu64
+	    " messages per connection:\n", good, sr->confirm);
+	ok = search_trial(sr, tests, nthreads, step, good, sr->confirm,
+	    begin, end);
+	printf("Sustainable: %.1f msgs/s (%s)\n", good,
+	    ok ? "confirmed" : "NOT confirmed");
+	return (ok ? 0 : -1);
+}
 
-		ssz = (uint16_t) range(t->ssz_min, t->ssz_max);
-		rsz = (uint16_t) range(t->rsz_min, t->rsz_max);
-		sdly = range(t->sdly_min, t->sdly_min);
-		rdly = range(t->rdly_min, t->rdly_min);
+/*
+ * An A/B test compares two groups of addresses, typically a backend
+ * directly (A) and through a proxy (B), over a number of rounds.  Each
+ * connection in B is paired with one in A, and both send to the same
+ * schedule.  The groups take turns within each round, in alternating
+ * order so that anything that drifts over the run weighs on both alike,
+ * or, if concurrent, run together.  Either way, noise on the host that
+ * outlasts a round is felt by both.
+ */
+typedef struct abtest {
+	int		rounds;
+	int		concurrent;
+} abtest_t;
+
+#define	AB_ROUNDS	10
+
+/* Student's t, two-sided 95%, for 1 to 30 degrees of freedom */
+static const double ab_t95[] = {
+	12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262,
+	2.228, 2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101,
+	2.093, 2.086, 2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052,
+	2.048, 2.045, 2.042
+};
 
-		sh->ssz = ssz;
-		sh->rsz = (t->rintvl && ((i % t->rintvl) == 0)) ? rsz : 0;
-		sh->rdly = sh->rsz ? rdly : 0;
-		sh->seqno = t->sseqno++;
+/*
+ * ab_delta prints one percentile for both groups, over every round, and
+ * the mean over the rounds of B's less A's, with its 95% confidence
+ * interval.
+ */
+static void
+ab_delta(const char *name, double pct, uint64_t **all, uint64_t *nall,
+    const double *d, int rounds)
+{
+	double	mean = 0, var = 0, ci;
+	int	r;
 
-		ndelay(sdly);
+	for (r = 0; r < rounds; r++) {
+		mean += d[r];
+	}
+	mean /= rounds;
+	for (r = 0; r < rounds; r++) {
+		var += (d[r] - mean) * (d[r] - mean);
+	}
+	var /= (rounds - 1);
+	ci = ((rounds - 1 <= 30) ? ab_t95[rounds - 2] : 1.96) *
+	    sqrt(var / rounds);
+	printf("%-6s %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+	    nall[0] ? pctile(all[0], nall[0], pct) / 1000.0 : 0.0,
+	    nall[1] ? pctile(all[1], nall[1], pct) / 1000.0 : 0.0,
+	    mean / 1000.0, (mean - ci) / 1000.0, (mean + ci) / 1000.0);
+}
 
-		stime = gethrtime();
-		sh->ts3 = 0;
-		sh->ts2 = 0;
-		sh->ts1 = stime;
+/*
+ * run_ab runs an A/B test.  The A connections are the first half of the
+ * tests, and the B connections the second, in the same order.
+ */
+static void
+run_ab(const abtest_t *ab, test_t *tests, int nthreads, int step,
+    uint64_t *begin, uint64_t *end)
+{
+	uint64_t	*all[2], nall[2], *samples, n, tb, te;
+	double		*d50, *d99, p50[2], p99[2];
+	int		half = nthreads / 2;
+	int		r, o, g, k, i;
+
+	d50 = calloc(ab->rounds, sizeof (double));
+	d99 = calloc(ab->rounds, sizeof (double));
+	for (g = 0; g < 2; g++) {
+		all[g] = calloc(1, sizeof (uint64_t));
+		nall[g] = 0;
+	}
 
-		while (ssz > 0) {
-			rv = send(t->sock, sptr, ssz, 0);
-			if (rv < 0) {
-				perror("sender/send");
-				goto out;
-			}
-			ssz -= rv;
-			sptr += rv;
+	printf("A/B: %d rounds, %s\n", ab->rounds,
+	    ab->concurrent ? "concurrent" : "interleaved");
+	printf("%5s %5s %10s %10s %10s %10s\n", "round", "order",
+	    "A p50 (us)", "B p50 (us)", "A p99 (us)", "B p99 (us)");
+	*begin = 0;
+	for (r = 0; r < ab->rounds; r++) {
+		/* each pair gets a fresh schedule every round */
+		for (i = 0; i < nthreads; i++) {
+			tests[i].seed = r * (half / step) + (i % half) / step + 1;
 		}
-		if (debug)
-			write(1, ">", 1);
-
-		rh = (void *)rbuf;
-		for (;;) {
-			size_t resid;
-			if (nbytes < sizeof (*rh)) {
-				/* suck in as much as we can */
-				resid = maxmsg - sizeof (*rh);
-			} else if (rh->rsz > maxmsg) {
-				fprintf(stderr, "h->rsz too big\n");
-				goto out;
-			} else if (nbytes < rh->rsz) {
-				resid = rh->rsz - nbytes;
-			} else {
-				break;
+		for (o = 0; o < (ab->concurrent ? 1 : 2); o++) {
+			g = (r % 2 == 0) ? o : 1 - o;
+			for (i = 0; i < nthreads; i++) {
+				tests[i].skip = !ab->concurrent &&
+				    (i / half != g);
 			}
-			rv = recv(t->sock, rptr, resid, 0);
-			now = gethrtime();
-			if (rv < 0) {
-				perror("rcvr/recv");
-				goto out;
+			trial_run(tests, nthreads, &tb, &te);
+			if (*begin == 0) {
+				*begin = tb;
 			}
-			if (rv == 0) {
-				fprintf(stderr,
-				    "sender: recv closed too soon "
-				    "(%d rx, expected %d)\n", i, count);
-				goto out;
+			*end = te;
+			for (k = 0; k < 2; k++) {
+				if (tests[k * half].skip) {
+					continue;
+				}
+				samples = latency_collect(tests + k * half,
+				    half, &n);
+				p50[k] = n ? pctile(samples, n, 50.0) : 0;
+				p99[k] = n ? pctile(samples, n, 99.0) : 0;
+				all[k] = realloc(all[k], (nall[k] + n + 1) *
+				    sizeof (uint64_t));
+				memcpy(all[k] + nall[k], samples,
+				    n * sizeof (uint64_t));
+				nall[k] += n;
+				free(samples);
 			}
-			nbytes += rv;
-			rptr += rv;
 		}
-		assert(nbytes >= sizeof (*rh));
-		assert(nbytes >= rh->rsz);
+		d50[r] = p50[1] - p50[0];
+		d99[r] = p99[1] - p99[0];
+		printf("%5d %5s %10.1f %10.1f %10.1f %10.1f\n", r + 1,
+		    ab->concurrent ? "A+B" : (r % 2 == 0) ? "AB" : "BA",
+		    p50[0] / 1000.0, p50[1] / 1000.0,
+		    p99[0] / 1000.0, p99[1] / 1000.0);
+		fflush(stdout);
+	}
+	for (i = 0; i < nthreads; i++) {
+		tests[i].skip = 0;
+	}
 
-		if (rh->seqno != sh->seqno) {
-			fprintf(stderr,
-			    "reply seqno out of order (%"
-			    PRIu64 " != %" PRIu64 ")!!\n",
-			    rh->seqno, sh->seqno);
-			goto out;
+	for (g = 0; g < 2; g++) {
+		qsort(all[g], nall[g], sizeof (uint64_t), cmpu64);
+	}
+	printf("A/B DIFFERENCE (B less A, mean of the rounds, 95%% CI):\n");
+	printf("%-6s %10s %10s %10s %10s %10s\n", "", "A (us)", "B (us)",
+	    "B-A (us)", "CI low", "CI high");
+	ab_delta("p50", 50.0, all, nall, d50, ab->rounds);
+	ab_delta("p99", 99.0, all, nall, d99, ab->rounds);
+
+	for (g = 0; g < 2; g++) {
+		free(all[g]);
+	}
+	free(d50);
+	free(d99);
+}
+
+/*
+ * report_stream prints the per-flow and aggregate goodput for bulk streaming
+ * mode, followed by the throughput time series.  Each flow is a streamer and
+ * streamreceiver pair; it lasts from the first send until the replier has
+ * closed its end, by which time it has consumed everything that was sent.
+ */
+static void
+report_stream(test_t *tests, int nthreads,
+    const struct rusage *ru_begin, const struct rusage *ru_finish)
+{
+	uint64_t	tx = 0, rx = 0, first = UINT64_MAX, last = 0;
+	uint64_t	cpu, dt;
+	uint32_t	n = 0, b;
+	int		echo = (tests[0].flags & FLAG_ECHO) != 0;
+	int		i;
+
+	printf("STREAM GOODPUT:\n");
+	for (i = 0; i < nthreads; i += 2) {
+		test_t *s = &tests[i];
+		test_t *r = &tests[i + 1];
+
+		dt = (r->end > s->begin) ? r->end - s->begin : 0;
+		printf("Flow %d: %" PRIu64 " bytes in %.3f s, %.3f Gbit/s",
+		    i / 2, s->sbytes, dt / 1e9, gbps(s->sbytes, dt));
+		if (echo) {
+			printf(", echo %.3f Gbit/s", gbps(r->rbytes, dt));
 		}
-		if (rh->ts3 < rh->ts2) {
-			fprintf(stderr, "negative packet processing cost\n");
-			goto out;
+		printf("\n");
+		tx += s->sbytes;
+		rx += r->rbytes;
+		first = min(first, s->begin);
+		last = max(last, r->end);
+		n = max(n, max(s->ntseries, r->ntseries));
+	}
+	/* the series grows in chunks, so ignore empty trailing intervals */
+	for (; n > 0; n--) {
+		for (i = 0; i < nthreads; i++) {
+			if (n <= tests[i].ntseries && tests[i].tseries[n - 1])
+				break;
 		}
-		if (rh->ts1 != sh->ts1) {
-			fprintf(stderr, "mismatched timestamps: %" PRIu64
-			    " != %" PRIu64 "\n", rh->ts1, sh->ts1);
-			goto out;
+		if (i < nthreads)
+			break;
+	}
+	dt = (last > first) ? last - first : 0;
+	printf("Aggregate: %" PRIu64 " bytes in %.3f s, %.3f Gbit/s\n",
+	    tx, dt / 1e9, gbps(tx, dt));
+	if (echo) {
+		printf("Aggregate echo: %" PRIu64 " bytes, %.3f Gbit/s\n",
+		    rx, gbps(rx, dt));
+	}
+
+	cpu = cputime(ru_finish) - cputime(ru_begin);
+	printf("CPU: user %.3f s, sys %.3f s, %.3f ns/byte\n",
+	    (ru_finish->ru_utime.tv_sec - ru_begin->ru_utime.tv_sec) +
+	    (ru_finish->ru_utime.tv_usec - ru_begin->ru_utime.tv_usec) / 1e6,
+	    (ru_finish->ru_stime.tv_sec - ru_begin->ru_stime.tv_sec) +
+	    (ru_finish->ru_stime.tv_usec - ru_begin->ru_stime.tv_usec) / 1e6,
+	    (tx + rx) ? (double)cpu / (tx + rx) : 0.0);
+
+	printf("THROUGHPUT TIME SERIES (%.1f ms intervals):\n",
+	    tests[0].tsintvl / 1e6);
+	for (b = 0; b < n; b++) {
+		tx = rx = 0;
+		for (i = 0; i < nthreads; i += 2) {
+			if (b < tests[i].ntseries)
+				tx += tests[i].tseries[b];
+			if (b < tests[i + 1].ntseries)
+				rx += tests[i + 1].tseries[b];
 		}
-		deltat = (now - rh->ts1) - (rh->ts3 - rh->ts2);
-		t->samples[t->rseqno].when = rh->ts1;
-		t->samples[t->rseqno].lat = deltat;
-		t->samples[t->rseqno].ssz = sh->ssz;
-		t->samples[t->rseqno].rsz = rh->rsz;
-		t->rseqno++;
-		/* if seqno dropped or duplicate, we expect many error msgs */
+		printf("%10.3f s  tx %8.3f Gbit/s",
+		    (b + 1) * tests[0].tsintvl / 1e9,
+		    gbps(tx, tests[0].tsintvl));
+		if (echo) {
+			printf("  rx %8.3f Gbit/s", gbps(rx, tests[0].tsintvl));
+		}
+		printf("\n");
+	}
+}
 
-		t->replies++;
+#ifdef SEQTEST_BENCH
+/*
+ * The benchmark build (seqtest_bench) measures the pieces of seqtest's own
+ * hot paths in isolation, so that when a latency number looks odd, the
+ * tool itself can quickly be ruled out.  Each benchmark is run BENCH_RUNS
+ * times, and the mean and standard deviation of the runs are reported.
+ */
+#define	BENCH_RUNS	10
+#define	BENCH_VALUES	4096
 
-		if (debug)
-			write(1, "<", 1);
+volatile uint64_t bench_sink;
+uint64_t bench_values[BENCH_VALUES];
 
-		nbytes -= rh->rsz;
-		memmove(rbuf, rbuf + rh->rsz, nbytes);
-		rptr = rbuf + nbytes;
+static uint64_t
+bench_gethrtime(uint64_t n)
+{
+	uint64_t start = gethrtime();
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		bench_sink += gethrtime();
 	}
-	if (i < count) {
-		fprintf(stderr,
-			"only exchanged %d out of %d messages\n", i, count);
-		goto out;
+	return (gethrtime() - start);
+}
+
+static uint64_t
+bench_range(uint64_t n)
+{
+	uint64_t start = gethrtime();
+	uint64_t i;
+
+	for (i = 0; i < n; i++) {
+		bench_sink += range(sizeof (test_header_t), maxmsg);
 	}
+	return (gethrtime() - start);
+}
 
-	good = 1;
+static uint64_t
+bench_hist(uint64_t n)
+{
+	hist_t *h = calloc(1, sizeof (*h));
+	uint64_t start = gethrtime();
+	uint64_t i;
 
-out:
-	close(t->sock);
-	free(rbuf);
-	free(sbuf);
+	for (i = 0; i < n; i++) {
+		hist_add(h, bench_values[i % BENCH_VALUES]);
+	}
+	start = gethrtime() - start;
+	bench_sink += h->count;
+	free(h);
+	return (start);
+}
 
-	if (!good) {
-		exit(1);
+static uint64_t
+bench_seqtrack(uint64_t n)
+{
+	seqtrack_t *st = calloc(1, sizeof (*st));
+	uint64_t start = gethrtime();
+	uint64_t i, j;
+
+	for (i = 0; i < n; i++) {
+		/*
+		 * Mostly in order, but every 64th arrives 7 late, after
+		 * those behind it; each is still seen only once.
+		 */
+		j = i & 63;
+		(void) seqtrack_add(st, (i < 64 || j > 7) ? i :
+		    (j < 7) ? i + 1 : i - 7, 1);
 	}
-	return (NULL);
+	start = gethrtime() - start;
+	bench_sink += st->unique;
+	free(st);
+	return (start);
 }
 
 /*
- * sender is a pthread worker that sends the initial messages.
+ * bench_frames parses a buffer full of back to back messages of random
+ * size, the way the receive loops do.
  */
-void *
-sender(void *arg)
+static uint64_t
+bench_frames(uint64_t n)
 {
-	test_t		*t = arg;
-	char		*buf, *ptr;
-	uint64_t	count = 0, stime;
-	int		rv;
-	test_header_t	*h;
-	int		i;
+	static char	*buf;
+	static uint32_t	len, nframes;
+	test_header_t	h;
+	uint64_t	start, seqno = 0, done = 0, errs = 0;
+	uint32_t	off;
+	int		flen;
+
+	if (buf == NULL) {
+		buf = calloc(1, 256 * 1024);
+		memset(&h, 0, sizeof (h));
+		h.magic = HDR_MAGIC;
+		for (len = 0; ; len += h.ssz, nframes++) {
+			h.ssz = range(sizeof (h), 512);
+			if (len + h.ssz > 256 * 1024)
+				break;
+			h.seqno = nframes;
+			memcpy(buf + len, &h, sizeof (h));
+		}
+	}
 
-	buf = malloc(maxmsg);
+	start = gethrtime();
+	while (done < n) {
+		seqno = 0;
+		for (off = 0; (flen = frame_len(buf + off, len - off, 0)) > 0;
+		    off += flen) {
+			memcpy(&h, buf + off, sizeof (h));
+			if (h.seqno != seqno++)
+				errs++;
+		}
+		done += nframes;
+	}
+	start = gethrtime() - start;
+	bench_sink += errs;
+	/* account for whole buffers, even if we went past n */
+	return (start * n / done);
+}
 
-	count = t->count;
+static void
+bench_fire(reply_t *r)
+{
+	bench_sink += r->due;
+}
 
-	if (count < 1) {
-		fprintf(stderr, "count must be at least 1\n");
-		exit(1);
+/*
+ * bench_wheel schedules replies with delays of up to 200us, as
+ * time moves on by 100ns per reply, so that timers are added, cascaded
+ * and fired at about the rate they would be in a busy replier.
+ */
+static uint64_t
+bench_wheel(uint64_t n)
+{
+	wheel_t		*w = calloc(1, sizeof (*w));
+	reply_t		*r = calloc(BENCH_VALUES, sizeof (*r));
+	uint64_t	start = gethrtime();
+	uint64_t	i, now = 0;
+
+	for (i = 0; i < n; i++) {
+		now += 100;
+		wheel_advance(w, now, bench_fire);
+		/* the oldest entry has long since fired, so reuse it */
+		r[i % BENCH_VALUES].due = now + bench_values[i % BENCH_VALUES] %
+		    (BENCH_VALUES * 50);
+		wheel_add(w, &r[i % BENCH_VALUES]);
 	}
+	wheel_advance(w, UINT64_MAX >> 1, bench_fire);
+	start = gethrtime() - start;
+	free(r);
+	free(w);
+	return (start);
+}
 
-	for (i = 0; i < count; i++) {
+static const struct {
+	const char	*name;
+	uint64_t	ops;
+	uint64_t	(*fn)(uint64_t);
+} benches[] = {
+	{ "gethrtime",	1000000,	bench_gethrtime },
+	{ "range",	1000000,	bench_range },
+	{ "hist_add",	10000000,	bench_hist },
+	{ "seqtrack",	10000000,	bench_seqtrack },
+	{ "frame_parse", 10000000,	bench_frames },
+	{ "timer_wheel", 10000000,	bench_wheel },
+	{ NULL }
+};
 
-		uint16_t ssz, rsz;
-		uint32_t sdly, rdly;
-		h = (void *)buf;
-		ptr = buf;
+static const uint32_t bench_delays[] = {
+	1000, 10000, 100000, 900000, 1500000, 10000000
+};
 
-		ssz = (uint16_t) range(t->ssz_min, t->ssz_max);
-		rsz = (uint16_t) range(t->rsz_min, t->rsz_max);
-		sdly = range(t->sdly_min, t->sdly_min);
-		rdly = range(t->rdly_min, t->rdly_min);
+static int
+bench_selected(const char *name, int argc, char **argv)
+{
+	int i;
 
-		h->ssz = ssz;
-		h->rsz = (t->rintvl && ((i % t->rintvl) == 0)) ? rsz : 0;
-		h->rdly = h->rsz ? rdly : 0;
-		h->seqno = t->sseqno++;
+	if (argc < 2) {
+		return (1);
+	}
+	for (i = 1; i < argc; i++) {
+		if (strstr(name, argv[i]) != NULL)
+			return (1);
+	}
+	return (0);
+}
 
-		ndelay(sdly);
+/*
+ * bench runs the benchmarks whose names contain any of the arguments (or
+ * all of them), printing the cost per operation.  ndelay is measured for
+ * its accuracy instead: how late it returned, and the CPU it burned.
+ */
+static int
+bench(int argc, char **argv)
+{
+	double		v[BENCH_RUNS], mean, var;
+	struct rusage	r0, r1;
+	uint64_t	start, late, cpu, wall;
+	int		i, j, n;
 
-		stime = gethrtime();
-		h->ts3 = 0;
-		h->ts2 = 0;
-		h->ts1 = stime;
+	for (i = 0; i < BENCH_VALUES; i++) {
+		bench_values[i] = range(0, 1000000) << range(0, 12);
+	}
 
-		while (ssz > 0) {
-			rv = send(t->sock, ptr, ssz, 0);
-			if (rv < 0) {
-				perror("sender/send");
-				return (NULL);
-			}
-			ssz -= rv;
-			ptr += rv;
+	printf("%-20s %12s %12s\n", "benchmark", "ns/op", "stddev");
+	for (i = 0; benches[i].name != NULL; i++) {
+		if (!bench_selected(benches[i].name, argc, argv))
+			continue;
+		(void) benches[i].fn(benches[i].ops / 10);	/* warm up */
+		mean = var = 0;
+		for (j = 0; j < BENCH_RUNS; j++) {
+			v[j] = (double)benches[i].fn(benches[i].ops) /
+			    benches[i].ops;
+			mean += v[j] / BENCH_RUNS;
 		}
-		if (debug)
-			write(1, ">", 1);
+		for (j = 0; j < BENCH_RUNS; j++) {
+			var += (v[j] - mean) * (v[j] - mean) / BENCH_RUNS;
+		}
+		printf("%-20s %12.2f %12.2f\n", benches[i].name, mean, sqrt(var));
 	}
-	free(buf);
-	return (NULL);
+
+	if (!bench_selected("ndelay", argc, argv)) {
+		return (0);
+	}
+	printf("\npace margin is %" PRIu64 " ns\n", pace_margin);
+	printf("%-20s %12s %12s %12s %8s\n", "benchmark", "late ns",
+	    "stddev", "max", "cpu %");
+	for (i = 0; i < sizeof (bench_delays) / sizeof (bench_delays[0]); i++) {
+		char name[32];
+
+		n = (bench_delays[i] >= 1000000) ? 20 : 200;
+		mean = var = 0;
+		late = 0;
+		wall = 0;
+		(void) getrusage(RUSAGE_SELF, &r0);
+		for (j = 0; j < n; j++) {
+			double d;
+
+			start = gethrtime();
+			ndelay(bench_delays[i]);
+			d = (double)(gethrtime() - start) - bench_delays[i];
+			wall += gethrtime() - start;
+			late = max(late, (uint64_t)d);
+			mean += d / n;
+			var += d * d / n;
+		}
+		(void) getrusage(RUSAGE_SELF, &r1);
+		cpu = cputime(&r1) - cputime(&r0);
+		var -= mean * mean;
+		(void) snprintf(name, sizeof (name), "ndelay(%u)",
+		    bench_delays[i]);
+		printf("%-20s %12.0f %12.0f %12" PRIu64 " %8.1f\n", name, mean,
+		    sqrt(var > 0 ? var : 0), late, cpu * 100.0 / wall);
+	}
+	return (0);
 }
+#endif /* SEQTEST_BENCH */
 
 /*
- * receiver is a pthread worker that receives any replies.  It runs in the
- * same process as sender.
+ * The metrics endpoint is a minimal HTTP server, answering each request
+ * with the current counters in the OpenMetrics text format, for a
+ * Prometheus scraper to collect during a long run.  Every block of every
+ * target is summed, so each counter covers all of a target's connections,
+ * past and present.  For the replier, the latency is the service time
+ * (ts3 - ts2), and for the proxy, the time bytes were held in its pipes.
  */
-void *
-receiver(void *arg)
+static void
+metrics_label(FILE *f, const char *v)
 {
-	test_t		*t = arg;
-	char		*buf, *ptr;
-	uint32_t	exp;
-	uint32_t	nbytes = 0;
-	uint64_t	ltime = 0, now = 0, deltat = 0;
-	test_header_t	*h;
-	int		rv;
+	for (; *v != '\0'; v++) {
+		if (*v == '\\' || *v == '"') {
+			(void) fprintf(f, "\\%c", *v);
+		} else if (*v == '\n') {
+			(void) fputs("\\n", f);
+		} else {
+			(void) fputc(*v, f);
+		}
+	}
+}
 
-	buf = malloc(maxmsg);
-	ptr = buf;
-	exp = t->rintvl ? t->count / t->rintvl : 0;
+static void
+metrics_sample(FILE *f, const char *name, const mtarget_t *mt,
+    const char *le, uint64_t v)
+{
+	(void) fprintf(f, "%s{mode=\"%s\",dest=\"", name, metric_mode);
+	metrics_label(f, mt->dest);
+	if (le != NULL) {
+		(void) fprintf(f, "\",le=\"%s", le);
+	}
+	(void) fprintf(f, "\"} %" PRIu64 "\n", v);
+}
 
-	while (t->count == 0 || (exp > 0)) {
-		h = (void *)buf;
-		for (;;) {
-			size_t resid;
-			if (nbytes < sizeof (*h)) {
-				/* suck in as much as we can */
-				resid = maxmsg - sizeof (*h);
-			} else if (h->rsz > maxmsg) {
-				fprintf(stderr, "h->rsz too big\n");
-				goto out;
-			} else if (nbytes < h->rsz) {
-				resid = h->rsz - nbytes;
+/*
+ * metrics_sum adds up a target's blocks.  Their owners carry on writing
+ * while this reads, so a scrape may see one counter a little ahead of
+ * another, but each value is one that was really there.
+ */
+static void
+metrics_sum(mtarget_t *mt, mblock_t *sum)
+{
+	const mblock_t	*m;
+	int		i;
+
+	memset(sum, 0, sizeof (*sum));
+	for (m = __atomic_load_n(&mt->blocks, __ATOMIC_ACQUIRE); m != NULL;
+	    m = m->next) {
+		sum->sent += __atomic_load_n(&m->sent, __ATOMIC_RELAXED);
+		sum->received += __atomic_load_n(&m->received,
+		    __ATOMIC_RELAXED);
+		sum->sbytes += __atomic_load_n(&m->sbytes, __ATOMIC_RELAXED);
+		sum->rbytes += __atomic_load_n(&m->rbytes, __ATOMIC_RELAXED);
+		sum->errors += __atomic_load_n(&m->errors, __ATOMIC_RELAXED);
+		sum->latsum += __atomic_load_n(&m->latsum, __ATOMIC_RELAXED);
+		for (i = 0; i <= METRIC_BUCKETS; i++) {
+			sum->lat[i] += __atomic_load_n(&m->lat[i],
+			    __ATOMIC_RELAXED);
+		}
+	}
+}
+
+static void
+metrics_write(FILE *f)
+{
+	static const struct {
+		const char	*name;
+		const char	*help;
+		const char	*unit;
+		size_t		off;
+	} counters[] = {
+		{ "seqtest_sent_messages", "Messages sent.", NULL,
+		    offsetof(mblock_t, sent) },
+		{ "seqtest_received_messages", "Messages received.", NULL,
+		    offsetof(mblock_t, received) },
+		{ "seqtest_sent_bytes", "Bytes sent.", "bytes",
+		    offsetof(mblock_t, sbytes) },
+		{ "seqtest_received_bytes", "Bytes received.", "bytes",
+		    offsetof(mblock_t, rbytes) },
+		{ "seqtest_errors", "Errors detected.", NULL,
+		    offsetof(mblock_t, errors) },
+	};
+	mtarget_t	*mt;
+	mblock_t	*sums;
+	char		name[64], le[32];
+	uint64_t	cum;
+	int		n, i, j, k;
+
+	n = 0;
+	for (mt = __atomic_load_n(&mtargets, __ATOMIC_ACQUIRE); mt != NULL;
+	    mt = mt->next) {
+		n++;
+	}
+	if ((sums = calloc(max(n, 1), sizeof (*sums))) == NULL) {
+		return;
+	}
+	/* targets are only ever added at the head, so the first n stay */
+	mt = __atomic_load_n(&mtargets, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++, mt = mt->next) {
+		metrics_sum(mt, &sums[i]);
+	}
+
+	for (j = 0; j < (int)(sizeof (counters) / sizeof (counters[0]));
+	    j++) {
+		(void) fprintf(f, "# TYPE %s counter\n", counters[j].name);
+		if (counters[j].unit != NULL) {
+			(void) fprintf(f, "# UNIT %s %s\n", counters[j].name,
+			    counters[j].unit);
+		}
+		(void) fprintf(f, "# HELP %s %s\n", counters[j].name,
+		    counters[j].help);
+		(void) snprintf(name, sizeof (name), "%s_total",
+		    counters[j].name);
+		mt = __atomic_load_n(&mtargets, __ATOMIC_ACQUIRE);
+		for (i = 0; i < n; i++, mt = mt->next) {
+			metrics_sample(f, name, mt, NULL,
+			    *(uint64_t *)((char *)&sums[i] + counters[j].off));
+		}
+	}
+
+	(void) fprintf(f, "# TYPE seqtest_latency_seconds histogram\n"
+	    "# UNIT seqtest_latency_seconds seconds\n"
+	    "# HELP seqtest_latency_seconds Message latency.\n");
+	mt = __atomic_load_n(&mtargets, __ATOMIC_ACQUIRE);
+	for (i = 0; i < n; i++, mt = mt->next) {
+		for (k = 0, cum = 0; k <= METRIC_BUCKETS; k++) {
+			cum += sums[i].lat[k];
+			if (k < METRIC_BUCKETS) {
+				(void) snprintf(le, sizeof (le), "%g",
+				    metric_le[k] / 1e9);
 			} else {
-				break;
-			}
-			rv = recv(t->sock, ptr, resid, 0);
-			now = gethrtime();
-			if (rv < 0) {
-				perror("rcvr/recv");
-				goto out;
-			}
-			if (rv == 0) {
-				fprintf(stderr, "receiver: recv closed too soon\n");
-				goto out;
+				strlcpy(le, "+Inf", sizeof (le));
 			}
-			nbytes += rv;
-			ptr += rv;
+			metrics_sample(f, "seqtest_latency_seconds_bucket", mt,
+			    le, cum);
 		}
-		assert(nbytes >= sizeof (*h));
-		assert(nbytes >= h->rsz);
+		metrics_sample(f, "seqtest_latency_seconds_count", mt, NULL,
+		    cum);
+		(void) fprintf(f, "seqtest_latency_seconds_sum{mode=\"%s\","
+		    "dest=\"", metric_mode);
+		metrics_label(f, mt->dest);
+		(void) fprintf(f, "\"} %.9f\n", sums[i].latsum / 1e9);
+	}
+	(void) fprintf(f, "# EOF\n");
+	free(sums);
+}
 
-		if (h->ts1 < ltime) {
-			fprintf(stderr, "ts1 backwards %" PRIu64
-			    " < %" PRIu64 " !!\n",
-			    h->ts1, ltime);
+/*
+ * metrics_serve answers one request at a time; a scraper only comes by
+ * every few seconds, and a slow one is cut off by the receive timeout.
+ */
+static void *
+metrics_serve(void *arg)
+{
+	int		l = (int)(intptr_t)arg;
+	int		fd, n, len;
+	char		req[2048], head[256];
+	char		*body, *hdr;
+	size_t		bodylen, off;
+	ssize_t		rv;
+	struct timeval	tv;
+	FILE		*f;
+
+	tv.tv_sec = 2;
+	tv.tv_usec = 0;
+	for (;;) {
+		if ((fd = accept(l, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			perror("metrics/accept");
+			return (NULL);
 		}
-		if (now < ltime) {
-			fprintf(stderr, "time-travelling packet\n");
+		(void) setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv,
+		    sizeof (tv));
+		(void) setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv,
+		    sizeof (tv));
+
+		/* only the request line matters; the headers are ignored */
+		for (len = 0; len < (int)sizeof (req) - 1; len += n) {
+			if ((n = recv(fd, req + len, sizeof (req) - 1 - len,
+			    0)) <= 0) {
+				break;
+			}
+			req[len + n] = '\0';
+			if (strstr(req, "\r\n\r\n") != NULL ||
+			    strstr(req, "\n\n") != NULL) {
+				len += n;
+				break;
+			}
 		}
-		if (h->ts3 < h->ts2) {
-			fprintf(stderr, "negative packet processing cost\n");
+		req[len] = '\0';
+
+		body = NULL;
+		bodylen = 0;
+		if ((f = open_memstream(&body, &bodylen)) == NULL) {
+			(void) close(fd);
+			continue;
 		}
-		deltat = (now - h->ts1) - (h->ts3 - h->ts2);
-		ltime = h->ts1;
-		if (h->seqno != t->rseqno) {
-			fprintf(stderr,
-			    "reply seqno out of order (%" PRIu64
-			    " != %" PRIu64 ")!!\n",
-			    h->seqno, t->rseqno);
+		if (strncmp(req, "GET /metrics ", 13) == 0 ||
+		    strncmp(req, "GET / ", 6) == 0) {
+			metrics_write(f);
+			hdr = "200 OK\r\nContent-Type: application/"
+			    "openmetrics-text; version=1.0.0; charset=utf-8";
+		} else {
+			(void) fprintf(f, "not found\n");
+			hdr = "404 Not Found\r\nContent-Type: text/plain";
+		}
+		(void) fclose(f);
+		n = snprintf(head, sizeof (head), "HTTP/1.1 %s\r\n"
+		    "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+		    hdr, bodylen);
+		if (send(fd, head, n, MSG_NOSIGNAL) == n) {
+			for (off = 0; off < bodylen; off += rv) {
+				if ((rv = send(fd, body + off, bodylen - off,
+				    MSG_NOSIGNAL)) <= 0) {
+					break;
+				}
+			}
 		}
-		t->samples[t->rseqno].when = h->ts1;
-		t->samples[t->rseqno].lat = deltat;
-		t->samples[t->rseqno].ssz = 0;	/* probably of no use here */
-		t->samples[t->rseqno].rsz = 0;
+		free(body);
+		(void) close(fd);
+	}
+}
 
-		t->rseqno++;
-		/* if seqno dropped or duplicate, we expect many error msgs */
+/*
+ * metrics_start opens the metrics endpoint on [host:]port, and starts its
+ * thread.  An address without a host listens on every interface.
+ */
+static void
+metrics_start(const char *addr)
+{
+	struct addrinfo		hints, *ai;
+	struct sockaddr_storage	sa;
+	socklen_t		slen = sizeof (sa);
+	char			*str, *host, *port, name[128];
+	pthread_t		tid;
+	int			l, rv, one = 1;
+
+	str = strdup(addr);
+	if (strchr(str, ':') == NULL) {
+		host = NULL;
+		port = str;
+	} else {
+		parse_addr(&str, &host, &port);
+		if (*host == '\0') {
+			host = NULL;
+		}
+	}
+	memset(&hints, 0, sizeof (hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if ((rv = getaddrinfo(host, port, &hints, &ai)) != 0) {
+		fprintf(stderr, "failed to resolve metrics %s: %s\n", addr,
+		    gai_strerror(rv));
+		exit(1);
+	}
+	if ((l = socket(ai->ai_family, SOCK_STREAM, 0)) < 0 ||
+	    setsockopt(l, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one)) < 0 ||
+	    bind(l, ai->ai_addr, ai->ai_addrlen) < 0 || listen(l, 16) < 0) {
+		perror("metrics");
+		exit(1);
+	}
+	freeaddrinfo(ai);
+	free(str);
 
-		/* XXX: we could check timestamps, figure latency, etc. */
-		t->replies++;
+	metrics_on = 1;
+	if (getsockname(l, (struct sockaddr *)&sa, &slen) == 0) {
+		addr_name((struct sockaddr *)&sa, slen, name, sizeof (name));
+		printf("Metrics on %s\n", name);
+	}
+	pthread_create(&tid, NULL, metrics_serve, (void *)(intptr_t)l);
+	pthread_detach(tid);
+}
 
-		if (debug)
-			write(1, "<", 1);
+static int
+cmptentry(const void *p1, const void *p2)
+{
+	const tentry_t *e1 = p1, *e2 = p2;
 
-		nbytes -= h->rsz;
-		memmove(buf, buf + h->rsz, nbytes);
-		ptr = buf + nbytes;
-		if (exp > 0)
-			exp--;
+	if (e1->conn != e2->conn) {
+		return (e1->conn < e2->conn ? -1 : 1);
 	}
-
-out:
-	free(buf);
-	return (NULL);
+	if (e1->when != e2->when) {
+		return (e1->when < e2->when ? -1 : 1);
+	}
+	return (0);
 }
 
 /*
- * replier is a pthread worker that services the initial sent messages,
- * checking them for correctness and optionally sending a reply.  Note that
- * the nature of the reply is driven by the message received, rather than
- * by the test.  This allows this to run mostly configuration free.
+ * trace_load reads a trace to replay.  Each line gives a message as
+ *
+ *	<time> <conn> <ssize> <rsize> <rdelay>
+ *
+ * where the time is in ns, or in seconds if it has a decimal point, conn
+ * is any number naming the connection, and rdelay is in ns; an rsize of 0
+ * asks for no reply.  A file written by the dump option is also taken,
+ * each sample becoming a message sent at the same time, with a reply.
+ * The times are made relative to the first message, and divided by
+ * speed.
  */
-void *
-replier(void *arg)
+static void
+trace_load(trace_t *tr, const char *path, double speed)
 {
-	test_t		*t = arg;
-	char		*sbuf, *sptr;
-	char		*rbuf, *rptr;
-	uint32_t	nbytes = 0;
-	uint64_t	ltime = 0, now = 0;
-	test_header_t	*h;
-	uint32_t	rdly;
-	uint16_t	rsz, ssz;
-	int		rv;
-
-	rbuf = malloc(maxmsg);
-	sbuf = malloc(maxmsg);
-	rptr = rbuf;
-	sptr = sbuf;
-
-	for (;;) {
-		h = (void *)rbuf;
-		for (;;) {
-			size_t resid;
-			if (nbytes < sizeof (*h)) {
-				/* suck in as much as we can */
-				resid = t->ssz_max - nbytes;
-			} else if (h->ssz > maxmsg) {
-				fprintf(stderr, "h->ssz too big\n");
-				goto out;
-			} else if (nbytes < h->ssz) {
-				resid = h->ssz - nbytes;
-			} else {
-				break;
+	FILE		*f;
+	char		*line = NULL, tbuf[64], *frac;
+	size_t		linesz = 0;
+	tentry_t	*all = NULL, *e;
+	uint64_t	n = 0, nalloc = 0, first = UINT64_MAX, last = 0;
+	uint64_t	conn, lat, j;
+	unsigned	ssz, rsz, rdly;
+	int		dump = 0, lineno = 0, c;
+
+	if ((f = fopen(path, "r")) == NULL) {
+		fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+		exit(1);
+	}
+	while (getline(&line, &linesz, f) >= 0) {
+		lineno++;
+		if (strncmp(line, "# thread time latency", 21) == 0) {
+			dump = 1;
+		}
+		if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#') {
+			continue;
+		}
+		if (n == nalloc) {
+			nalloc = max(nalloc * 2, 1024);
+			if ((all = realloc(all, nalloc * sizeof (*all))) ==
+			    NULL) {
+				perror("realloc");
+				exit(1);
 			}
-			rv = recv(t->sock, rptr, resid, 0);
-			now = gethrtime();
-			if (rv < 0) {
-				perror("replier/recv");
-				goto out;
+		}
+		e = &all[n];
+		if (dump) {
+			/* thread time latency rsz ssz; every one had a reply */
+			if (sscanf(line, "%" SCNu64 " %" SCNu64 " %" SCNu64
+			    " %u %u", &conn, &e->when, &lat, &rsz, &ssz) != 5) {
+				goto bad;
 			}
-			if (rv == 0) {
-				goto out;
+			rsz = max(rsz, sizeof (test_header_t));
+			rdly = 0;
+		} else {
+			if (sscanf(line, "%63s %" SCNu64 " %u %u %u", tbuf,
+			    &conn, &ssz, &rsz, &rdly) != 5) {
+				goto bad;
+			}
+			if (!isdigit((unsigned char)tbuf[0])) {
+				goto bad;
+			}
+			/* whole ns, as a double would lose them from epochs */
+			e->when = strtoull(tbuf, &frac, 10);
+			if (*frac == '.') {
+				e->when *= 1000000000ull;
+				for (j = 100000000ull, frac++;
+				    isdigit((unsigned char)*frac); j /= 10, frac++) {
+					e->when += (*frac - '0') * j;
+				}
 			}
-			rptr += rv;
-			nbytes += rv;
 		}
-		if (debug)
-			write(1, "-", 1);
-		assert(nbytes >= sizeof (*h));
-		assert(nbytes >= h->ssz);
+		e->conn = conn;
+		e->ssz = (uint16_t)max(min(ssz, maxmsg), sizeof (test_header_t));
+		e->rsz = (rsz == 0) ? 0 :
+		    (uint16_t)max(min(rsz, maxmsg), sizeof (test_header_t));
+		e->rdly = rdly;
+		first = min(first, e->when);
+		last = max(last, e->when);
+		n++;
+	}
+	free(line);
+	(void) fclose(f);
+	if (n == 0) {
+		fprintf(stderr, "%s: no messages to replay\n", path);
+		exit(1);
+	}
 
-		if (h->ts1 < ltime) {
-			fprintf(stderr, "replier: ts1 backwards!!\n");
+	qsort(all, n, sizeof (*all), cmptentry);
+	memset(tr, 0, sizeof (*tr));
+	for (j = 0; j < n; j++) {
+		all[j].when = (uint64_t)((all[j].when - first) / speed);
+		if (j == 0 || all[j].conn != all[j - 1].conn) {
+			tr->nconns++;
+		}
+	}
+	tr->e = calloc(tr->nconns, sizeof (*tr->e));
+	tr->n = calloc(tr->nconns, sizeof (*tr->n));
+	for (j = 0, c = -1; j < n; j++) {
+		if (j == 0 || all[j].conn != all[j - 1].conn) {
+			tr->e[++c] = &all[j];
+		}
+		tr->n[c]++;
+	}
+	/* as with any -s run, the last message must have a reply */
+	for (c = 0; c < tr->nconns; c++) {
+		e = &tr->e[c][tr->n[c] - 1];
+		if (e->rsz == 0) {
+			e->rsz = sizeof (test_header_t);
 		}
+	}
+	tr->nmsgs = n;
+	tr->span = (uint64_t)((last - first) / speed);
+	tr->speed = speed;
+	return;
+
+bad:
+	fprintf(stderr, "%s:%d: bad trace line\n", path, lineno);
+	exit(1);
+}
 
-		ltime = h->ts1;
-		rdly = h->rdly;
-		rsz = h->rsz;
-		ssz = h->ssz;
+/*
+ * print_listener reports where a replier is listening.  This matters when
+ * port 0 was asked for, and the system chose the port.
+ */
+static void
+print_listener(test_t *t)
+{
+	struct sockaddr_storage	sa;
+	socklen_t		slen = sizeof (sa);
+	char			hbuf[64], pbuf[16];
+
+	if (t->addr->sa_family == AF_UNIX ||
+	    getsockname(t->sock, (struct sockaddr *)&sa, &slen) != 0 ||
+	    getnameinfo((struct sockaddr *)&sa, slen, hbuf, sizeof (hbuf),
+	    pbuf, sizeof (pbuf), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+		return;
+	}
+	printf("Listening on Host %s Port %s\n", hbuf, pbuf);
+	fflush(stdout);
+}
 
-		if (h->seqno != t->sseqno++) {
-			fprintf(stderr, "reply seqno out of order!!\n");
-		}
-		/* if seqno dropped or duplicate, we expect many error msgs */
+/*
+ * Addresses of the form unix:<path> name Unix domain sockets.  These get
+ * an addrinfo of our own making, so that they can be handled along with
+ * the resolved IP addresses.
+ */
+static struct addrinfo *
+unix_addrinfo(const char *path)
+{
+	struct addrinfo		*ai;
+	struct sockaddr_un	*sun;
 
-		nbytes -= ssz;
-		memmove(rbuf, rptr, nbytes);
-		rptr = rbuf + nbytes;
+	ai = calloc(1, sizeof (*ai));
+	sun = calloc(1, sizeof (*sun));
+	if (strlen(path) >= sizeof (sun->sun_path)) {
+		fprintf(stderr, "path too long: %s\n", path);
+		exit(1);
+	}
+	sun->sun_family = AF_UNIX;
+	strlcpy(sun->sun_path, path, sizeof (sun->sun_path));
+	ai->ai_family = AF_UNIX;
+	ai->ai_socktype = SOCK_STREAM;
+	ai->ai_addr = (struct sockaddr *)sun;
+	ai->ai_addrlen = sizeof (*sun);
+	return (ai);
+}
 
-		if ((nbytes = rsz) == 0) {
-			continue;
-		}
+#ifdef HAVE_PROXY
+/*
+ * Proxy mode relays each connection accepted on a listening address to
+ * an upstream address, as a reference for the proxy under test: the
+ * bytes are moved with splice() through a pipe in each direction, so
+ * they never pass through user space, and a pool of workers each run an
+ * epoll loop over their connections.  A direction reads into its pipe
+ * only while the pipe has room, so a slow reader on one side pushes back
+ * on the writer at the other.
+ */
+typedef struct pdir {
+	int		from;
+	int		to;
+	int		pipe[2];
+	uint32_t	psz;		/* pipe capacity */
+	uint32_t	inpipe;		/* bytes waiting in the pipe */
+	uint64_t	since;		/* when the pipe last became non-empty */
+	int		eof;		/* from has no more to send */
+	int		shut;		/* and to has been told so */
+	uint64_t	bytes;
+	uint64_t	splices;	/* reads from the socket */
+	hist_t		held;		/* how long bytes spent in the pipe */
+	mblock_t	*m;		/* the connection's metrics, if any */
+	int		down;		/* counts as received */
+} pdir_t;
+
+typedef struct pconn pconn_t;
+
+typedef struct pside {
+	pconn_t		*c;
+	int		i;
+} pside_t;
+
+struct pconn {
+	int		fd[2];		/* the client, and upstream */
+	pdir_t		d[2];		/* d[i] reads from fd[i] */
+	pside_t		side[2];	/* epoll's handle on fd[i] */
+	uint32_t	ev[2];		/* events watched on fd[i] */
+	int		dead;
+	pconn_t		*next;		/* on the list of those to free */
+	char		name[80];	/* the client's address */
+	mtarget_t	*mt;
+	mblock_t	*m;
+};
 
-		ndelay(h->rdly);
+typedef struct proxy {
+	test_t		l;		/* listening */
+	test_t		up;		/* upstream, as a template */
+	pthread_t	tid;
+} proxy_t;
 
-		h = (void *)sbuf;
-		sptr = (void *)sbuf;
+typedef struct pworker {
+	pthread_t	tid;
+	int		epfd;
+	int		wake[2];	/* new connections arrive here */
+} pworker_t;
 
-		h->seqno = t->rseqno++;
-		h->ssz = ssz;
-		h->rsz = rsz;
-		h->ts1 = ltime;
-		h->rdly = rdly;
-		h->ts2 = now;
-		h->ts3 = gethrtime();
-		while (nbytes) {
-			rv = send(t->sock, sptr, nbytes, 0);
-			if (rv < 0) {
-				perror("send");
-				goto out;
+static pworker_t	*pworkers;
+static int		npworkers;
+static uint32_t		proxy_pipesz;
+
+/*
+ * pdir_pump moves what it can in one direction: from the socket into the
+ * pipe, if there is room, and from the pipe to the other socket.  Once
+ * the sender is done and the pipe is empty, the receiver is told.
+ * Returns -1 if the connection failed.
+ */
+static int
+pdir_pump(pdir_t *d, uint64_t now)
+{
+	ssize_t	n;
+
+	if (!d->eof && d->inpipe < d->psz) {
+		n = splice(d->from, NULL, d->pipe[1], NULL,
+		    d->psz - d->inpipe, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			if (d->inpipe == 0) {
+				d->since = now;
 			}
-			nbytes -= rv;
-			sptr += rv;
+			d->inpipe += n;
+			d->splices++;
+		} else if (n == 0) {
+			d->eof = 1;
+		} else if (errno != EAGAIN && errno != EINTR) {
+			return (-1);
 		}
-		if (debug) {
-			write(1, "+", 1);
+	}
+	if (d->inpipe > 0) {
+		n = splice(d->pipe[0], NULL, d->to, NULL, d->inpipe,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			d->inpipe -= n;
+			d->bytes += n;
+			if (d->down) {
+				metric_rx(d->m, 0, n);
+			} else {
+				metric_tx(d->m, 0, n);
+			}
+			if (d->inpipe == 0) {
+				uint64_t held = gethrtime() - d->since;
+				hist_add(&d->held, held);
+				metric_lat(d->m, held);
+			}
+		} else if (n < 0 && errno != EAGAIN && errno != EINTR) {
+			return (-1);
 		}
 	}
-
-out:
-	close(t->sock);
-	free(sbuf);
-	free(rbuf);
-	free(arg);
-	return (NULL);
+	if (d->eof && d->inpipe == 0 && !d->shut) {
+		(void) shutdown(d->to, SHUT_WR);
+		d->shut = 1;
+	}
+	return (0);
 }
 
 /*
- * acceptor runs in the replier's process, and is reponsible for firing
- * off a replier for each inbound connection.
+ * pconn_watch updates the events watched for on each of a connection's
+ * sockets: input while its direction's pipe has room, and output while
+ * the other direction has bytes waiting for it.
  */
-void *
-acceptor(void *arg)
+static void
+pconn_watch(pworker_t *w, pconn_t *c, int add)
 {
-	test_t		*t = arg;
-	test_t		*newt;
-	int s;
-	for (;;) {
-		socklen_t slen;
-		struct sockaddr_storage sa;
-		slen = sizeof (sa);
-		s  = accept(t->sock, (void *)&sa, &slen);
-		if (s < 0) {
-			perror("accept");
-			close(t->sock);
-			return (NULL);
+	struct epoll_event	ev;
+	int			i;
+
+	for (i = 0; i < 2; i++) {
+		memset(&ev, 0, sizeof (ev));
+		if (!c->d[i].eof && c->d[i].inpipe < c->d[i].psz) {
+			ev.events |= EPOLLIN;
+		}
+		if (c->d[1 - i].inpipe > 0) {
+			ev.events |= EPOLLOUT;
+		}
+		if (!add && ev.events == c->ev[i]) {
+			continue;
+		}
+		c->ev[i] = ev.events;
+		ev.data.ptr = &c->side[i];
+		if (epoll_ctl(w->epfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+		    c->fd[i], &ev) != 0) {
+			perror("epoll_ctl");
+			exit(1);
 		}
-		newt = malloc(sizeof (*newt));
-		memcpy(newt, t, sizeof (*newt));
-		newt->sock = s;
-		newt->tid = 0;
-		pthread_create(&newt->tid, NULL, replier, newt);
-		pthread_detach(newt->tid);
 	}
 }
 
-test_t	*tests = NULL;
-struct sockaddr **addrs = NULL;
-int naddrs;
+/*
+ * pconn_report prints a connection's counters once it has closed.
+ */
+static void
+pconn_report(const pconn_t *c, int failed)
+{
+	static const char	*dir[2] = { "up", "down" };
+	int			i;
+
+	printf("Proxied %s%s:", c->name, failed ? " (failed)" : "");
+	for (i = 0; i < 2; i++) {
+		const pdir_t *d = &c->d[i];
+		printf(" %s %" PRIu64 " bytes in %" PRIu64
+		    " reads, held %.1f us p50, %.1f us p99%s", dir[i],
+		    d->bytes, d->splices, hist_pctile(&d->held, 50.0) / 1000.0,
+		    hist_pctile(&d->held, 99.0) / 1000.0, i == 0 ? ";" : "\n");
+	}
+	fflush(stdout);
+}
 
-enum mode {
-	MODE_ASYNC_SEND = 0,
-	MODE_REPLIER,
-	MODE_SYNC_SEND
-};
+static void
+pconn_free(pconn_t *c)
+{
+	int i;
 
-char *myopts[] = {
-#define	SMIN		0
-	"ssize_min",
-#define	SMAX		1
-	"ssize_max",
-#define	SSIZE		2
-	"ssize",
-#define	RMIN		3
-	"rsize_min",
-#define	RMAX		4
-	"rsize_max",
-#define	RSIZE		5
-	"rsize",
-#define	THREADS		6
-	"threads",
-#define	SDELAY		7
-	"sdelay",
-#define	RDELAY		8
-	"rdelay",
-#define	SDELAY_MIN	9
-	"sdelay_min",
-#define	SDELAY_MAX	10
-	"sdelay_max",
-#define	RDELAY_MIN	11
-	"rdelay_min",
-#define	RDELAY_MAX	12
-	"rdelay_max",
-#define	RINTERVAL	13
-	"rinterval",
-#define COUNT		14
-	"count",
-#define	DUMPFILE	15
-	"dump",
-	NULL
-};
+	for (i = 0; i < 2; i++) {
+		(void) close(c->fd[i]);
+		(void) close(c->d[i].pipe[0]);
+		(void) close(c->d[i].pipe[1]);
+	}
+	if (c->m != NULL) {
+		mblock_put(c->mt, c->m);
+	}
+	free(c);
+}
 
-void
-check_ndelay(void)
+static void *
+proxy_run(void *arg)
 {
-	/* some timing tests to make sure our implementation doesn't suck */
-	uint64_t start, finish;
-	printf("randtime is %llu\n", (unsigned long long)randtime());
-	start = gethrtime();
-	ndelay(1000000);
-	finish = gethrtime();
-	printf("ndelay 1 msec took %llu ns\n", (unsigned long long)(finish - start));
-	start = gethrtime();
-	ndelay(1000000000);
-	finish = gethrtime();
-	printf("ndelay 1 sec took %llu ns\n", (unsigned long long)(finish - start));
-
-	start = gethrtime();
-	sleep(1);
-	finish = gethrtime();
-	printf("sleep 1 sec took %llu ns\n", (unsigned long long)(finish - start));
+	pworker_t		*w = arg;
+	struct epoll_event	evs[64];
+	pconn_t			*c, *gone;
+	pside_t			*ps;
+	uint64_t		now;
+	int			i, n, bad;
 
-	start = gethrtime();
-	usleep(10000);
-	finish = gethrtime();
-	printf("usleep(10ms) took %llu ns\n", (unsigned long long)(finish - start));
+	for (;;) {
+		n = epoll_wait(w->epfd, evs, 64, -1);
+		if (n < 0 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(1);
+		}
+		now = gethrtime();
+		gone = NULL;
+		for (i = 0; i < n; i++) {
+			if ((ps = evs[i].data.ptr) == NULL) {
+				if (read(w->wake[0], &c, sizeof (c)) ==
+				    sizeof (c)) {
+					pconn_watch(w, c, 1);
+				}
+				continue;
+			}
+			c = ps->c;
+			if (c->dead) {
+				continue;
+			}
+			bad = pdir_pump(&c->d[0], now) != 0 ||
+			    pdir_pump(&c->d[1], now) != 0;
+			if (bad || (c->d[0].shut && c->d[1].shut)) {
+				if (bad) {
+					metric_err(c->m);
+				}
+				pconn_report(c, bad);
+				c->dead = 1;
+				c->next = gone;
+				gone = c;
+				continue;
+			}
+			pconn_watch(w, c, 0);
+		}
+		/* later events in the batch may still have referred to these */
+		while ((c = gone) != NULL) {
+			gone = c->next;
+			pconn_free(c);
+		}
+	}
+	return (NULL);
 }
 
-
 /*
- * Parse the local address from addrstr. If one exists, point
- * *local_addr to it and update *addrstr to point to the rest of the
- * address string. If no local address is found then set *local_addr
- * to NULL and leave *addrstr unchanged.
- *
- * E.g.
- *
- * *addrstr	= "192.168.1.115,192.168.1.119:6789"
- *
- * then:
- *
- * *local_addr	= "192.168.1.115"
- * *addstr	= "192.168.1.119:6789"
+ * proxy_accept takes connections on one listening address, connects each
+ * to its upstream, and hands the pair to a worker.
  */
-static void
-parse_local_addr(char **addrstr, char **local_addr)
+static void *
+proxy_accept(void *arg)
 {
-	char *delim = strchr(*addrstr, ',');
+	static pthread_mutex_t	mx = PTHREAD_MUTEX_INITIALIZER;
+	static uint32_t		next = 0;
+	proxy_t			*p = arg;
+	struct sockaddr_storage	sa;
+	socklen_t		slen;
+	char			hbuf[64], pbuf[16];
+	test_t			up;
+	pconn_t			*c;
+	pworker_t		*w;
+	int			fd, i;
+
+	for (;;) {
+		slen = sizeof (sa);
+		if ((fd = accept(p->l.sock, (void *)&sa, &slen)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			perror("proxy/accept");
+			return (NULL);
+		}
+		up = p->up;
+		if (up.tp->open(&up) != 0 || up.tp->connect(&up) != 0) {
+			perror("proxy/connect");
+			if (up.sock >= 0) {
+				(void) close(up.sock);
+			}
+			(void) close(fd);
+			continue;
+		}
 
-	if (delim != NULL) {
-		/*
-		 * There is a local bind address specified. Split it
-		 * off from the rest of the address string.
-		 */
-		*delim = '\0';
-		*local_addr = *addrstr;
-		*addrstr = delim + 1;
-	} else {
-		*local_addr = NULL;
+		c = calloc(1, sizeof (*c));
+		c->fd[0] = fd;
+		c->fd[1] = up.sock;
+		if ((c->mt = up.mt) != NULL) {
+			c->m = mblock_get(c->mt);
+		}
+		if (p->l.addr->sa_family == AF_UNIX ||
+		    getnameinfo((struct sockaddr *)&sa, slen, hbuf,
+		    sizeof (hbuf), pbuf, sizeof (pbuf),
+		    NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+			strlcpy(c->name, "local", sizeof (c->name));
+		} else {
+			(void) snprintf(c->name, sizeof (c->name), "%s:%s",
+			    hbuf, pbuf);
+		}
+		for (i = 0; i < 2; i++) {
+			pdir_t *d = &c->d[i];
+			if (pipe(d->pipe) != 0) {
+				perror("pipe");
+				exit(1);
+			}
+			/* the kernel may round this up, or cap it */
+			if (proxy_pipesz != 0) {
+				(void) fcntl(d->pipe[1], F_SETPIPE_SZ,
+				    proxy_pipesz);
+			}
+			d->psz = fcntl(d->pipe[1], F_GETPIPE_SZ);
+			d->from = c->fd[i];
+			d->to = c->fd[1 - i];
+			d->m = c->m;
+			d->down = i;
+			if (fcntl(c->fd[i], F_SETFL,
+			    fcntl(c->fd[i], F_GETFL) | O_NONBLOCK) < 0) {
+				perror("fcntl");
+				exit(1);
+			}
+			c->side[i].c = c;
+			c->side[i].i = i;
+		}
+
+		pthread_mutex_lock(&mx);
+		w = &pworkers[next++ % npworkers];
+		pthread_mutex_unlock(&mx);
+		if (write(w->wake[1], &c, sizeof (c)) != sizeof (c)) {
+			perror("write");
+			exit(1);
+		}
 	}
 }
 
 /*
- * Parse the host and port from addrstr. If the addrstr is well formed
- * then *host will point to the host string and *port to port.
- * Otherwise an error will print to stderr and the program will exit.
- *
- *
- * This function is destrcutive to *addrstr. It is equal to *host upon
- * return.
- *
- * E.g.
- *
- * *addrstr	= "192.168.1.119:6789"
- *
- * then:
- *
- * *host	= "192.168.1.119"
- * *port	= "6789"
- * *addrstr	= "192.168.1.119"
+ * proxy_main runs proxy mode, over pairs of listening and upstream
+ * addresses.  It only returns on failure.
  */
-static void
-parse_addr(char **addrstr, char **host, char **port)
+static int
+proxy_main(struct addrinfo **ais, int nais, uint32_t bufsz)
 {
-	char *delim = strrchr(*addrstr, ':');
-
-	if (delim == NULL) {
-		fprintf(stderr, "no port found: %s\n", *addrstr);
-		exit(1);
+	struct epoll_event	ev;
+	proxy_t			*px;
+	int			i;
+
+	proxy_pipesz = bufsz;
+	npworkers = max(nworkers, 1);
+	pworkers = calloc(npworkers, sizeof (pworker_t));
+	for (i = 0; i < npworkers; i++) {
+		pworker_t *w = &pworkers[i];
+		if ((w->epfd = epoll_create1(0)) < 0 || pipe(w->wake) != 0) {
+			perror("proxy");
+			return (1);
+		}
+		memset(&ev, 0, sizeof (ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wake[0], &ev) != 0) {
+			perror("epoll_ctl");
+			return (1);
+		}
+		pthread_create(&w->tid, NULL, proxy_run, w);
 	}
 
-	/*
-	 * Separate host from port.
-	 */
-	*delim = '\0';
-	*host = *addrstr;
-	*port = delim + 1;
-
-	/*
-	 * Strip IPv6 brackets.
-	 */
-	if ((**host == '[') && ((*host)[strlen(*host) - 1] == ']')) {
-		(*host)[strlen(*host) - 1] = '\0';
-		(*host)++;
+	px = calloc(nais / 2, sizeof (proxy_t));
+	for (i = 0; i < nais / 2; i++) {
+		proxy_t *p = &px[i];
+
+		p->l.addr = ais[2 * i]->ai_addr;
+		p->l.addrlen = addr_len(p->l.addr);
+		p->l.tp = transport_for(p->l.addr, 0);
+		p->up.addr = ais[2 * i + 1]->ai_addr;
+		p->up.addrlen = addr_len(p->up.addr);
+		p->up.tp = transport_for(p->up.addr, 0);
+		p->up.sock = -1;
+		if (metrics_on) {
+			p->up.mt = mtarget_get(p->up.addr, p->up.addrlen);
+		}
+		if (p->l.tp->open(&p->l) != 0 || p->l.tp->listen(&p->l) < 0) {
+			perror("listen");
+			return (1);
+		}
+		print_listener(&p->l);
+		pthread_create(&p->tid, NULL, proxy_accept, p);
 	}
+	for (i = 0; i < nais / 2; i++) {
+		pthread_join(px[i].tid, NULL);
+	}
+	return (1);
 }
+#endif	/* HAVE_PROXY */
 
 int
 main(int argc, char **argv)
@@ -857,12 +7616,52 @@ main(int argc, char **argv)
 	uint32_t rintvl;
 	uint32_t nthreads;
 	uint32_t count;
+	uint32_t bufsz;
+	uint32_t batch;
+	uint32_t window;
+	uint32_t flags;
+	uint64_t tsintvl;
 	enum mode mode;
 	int nais;
 	struct addrinfo **ais;
 	struct addrinfo **lais;
 	FILE *dumpfile = NULL;
-	uint64_t begin_time, finish_time;
+	const char *dumpname = NULL;
+	sampler_t sampler;
+	sweep_t sweep;
+	int sweeping;
+	search_t search;
+	int searching, search_failed = 0;
+	abtest_t ab;
+	int absplit = -1, naddrs_a = 0;
+	double dval;
+	uint64_t lo, hi;
+	span_t warmup, cooldown, span;
+	uint64_t duration;
+	uint64_t nsamples;
+	idler_t *idlers = NULL;
+	uint32_t nidlers = 1;
+	double connrate = 0;
+	uint64_t heartbeat = 1000000000;
+	int oneway = 0;
+	int breakdown = 0;
+	char *metricaddr = NULL;
+	char *replay = NULL;
+	double replay_speed = 1.0;
+	trace_t trace;
+	jprobe_t jprobe;
+	int jitter = 0;
+	char *outlier = NULL, *outlierlog = NULL;
+	uint64_t olim = 0;
+	double opct = 0;
+	ologger_t ologger;
+	uint32_t nchunk = 1;
+	uint64_t cdly = 0;
+	struct rlimit rl;
+	uint64_t begin_time, finish_time, epoch;
+	struct rusage ru_begin, ru_finish;
+	char *cipher = NULL, *cert = NULL, *key = NULL;
+	int nstart, nudp = 0;
 	int i;
 
 	ssz_min = ssz_max = rsz_min = rsz_max = sizeof (test_header_t);
@@ -871,12 +7670,30 @@ main(int argc, char **argv)
 	rintvl = 1;
 	nthreads = 1;
 	count = 1;
+	bufsz = 256 * 1024;
+	batch = 32;
+	window = 1;
+	memset(&sampler, 0, sizeof (sampler));
+	memset(&sweep, 0, sizeof (sweep));
+	memset(&search, 0, sizeof (search));
+	memset(&ab, 0, sizeof (ab));
+	memset(&jprobe, 0, sizeof (jprobe));
+	jprobe.thresh = 100000;
+	memset(&warmup, 0, sizeof (warmup));
+	memset(&cooldown, 0, sizeof (cooldown));
+	duration = 0;
+	flags = 0;
+	tsintvl = 100000000;
 	mode = MODE_ASYNC_SEND;
 
-	/* initialize the timer */
-	(void) randtime();
+	/* learn how precisely we can sleep */
+	pace_calibrate();
+
+#ifdef SEQTEST_BENCH
+	return (bench(argc, argv));
+#endif
 
-	while ((c = getopt(argc, argv, "o:srdS")) != EOF) {
+	while ((c = getopt(argc, argv, "o:srdSbp")) != EOF) {
 		switch (c) {
 		case 'd':
 			debug++;
@@ -890,6 +7707,12 @@ main(int argc, char **argv)
 		case 'r':
 			mode = MODE_REPLIER;
 			break;
+		case 'b':
+			mode = MODE_STREAM;
+			break;
+		case 'p':
+			mode = MODE_PROXY;
+			break;
 		case 'o':
 			options = optarg;
 			while (*options != '\0') {
@@ -899,118 +7722,490 @@ main(int argc, char **argv)
 						fprintf(stderr, "no value\n");
 						exit(1);
 					}
-					ssz_min = atoi(optval);
+					ssz_min = atoi(optval);
+					break;
+				case SMAX:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					ssz_max = atoi(optval);
+					break;
+				case SSIZE:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					if (vlist_parse(&sweep.ssize,
+					    optval) != 0) {
+						fprintf(stderr, "bad ssize %s\n",
+						    optval);
+						exit(1);
+					}
+					ssz_max = ssz_min = sweep.ssize.v[0];
+					break;
+				case RMIN:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					rsz_min = atoi(optval);
+					break;
+				case RMAX:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					rsz_max = atoi(optval);
+					break;
+				case RSIZE:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					rsz_max = rsz_min = atoi(optval);
+					break;
+
+				case THREADS:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					if (vlist_parse(&sweep.threads,
+					    optval) != 0) {
+						fprintf(stderr, "bad threads %s\n",
+						    optval);
+						exit(1);
+					}
+					nthreads = vlist_max(&sweep.threads);
+					break;
+				case RDELAY_MIN:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					rdly_min = atoi(optval);
+					break;
+				case RDELAY_MAX:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					rdly_max = atoi(optval);
+					break;
+				case RDELAY:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					rdly_min = rdly_max = atoi(optval);
+					break;
+				case SDELAY_MIN:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					sdly_min = atoi(optval);
+					break;
+				case SDELAY_MAX:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					sdly_max = atoi(optval);
+					break;
+				case SDELAY:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					if (vlist_parse(&sweep.sdelay,
+					    optval) != 0) {
+						fprintf(stderr, "bad sdelay %s\n",
+						    optval);
+						exit(1);
+					}
+					sdly_min = sdly_max = sweep.sdelay.v[0];
+					break;
+				case RINTERVAL:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					rintvl = atoi(optval);
+					break;
+				case COUNT:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					count = atoi(optval);
+					break;
+				case DUMPFILE:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					dumpname = optval;
+					dumpfile = fopen(optval, "w+");
+					if (dumpfile == NULL) {
+						fprintf(stderr, "open %s: %s\n", optval,
+						    strerror(errno));
+						exit(1);
+					}
+					break;
+				case BUFSIZE:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					bufsz = atoi(optval);
+					break;
+				case ECHO:
+					if (optval == NULL || atoi(optval) != 0) {
+						flags |= FLAG_ECHO;
+					} else {
+						flags &= ~FLAG_ECHO;
+					}
+					break;
+				case INTERVAL:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					tsintvl = strtoull(optval, NULL, 10);
+					break;
+				case TLS:
+					if (optval == NULL || atoi(optval) != 0) {
+						flags |= FLAG_TLS;
+					} else {
+						flags &= ~FLAG_TLS;
+					}
+					break;
+				case KTLS:
+					if (optval == NULL || atoi(optval) != 0) {
+						flags |= FLAG_TLS | FLAG_KTLS;
+					} else {
+						flags &= ~FLAG_KTLS;
+					}
+					break;
+				case CIPHER:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					cipher = optval;
+					flags |= FLAG_TLS;
+					break;
+				case CERT:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					cert = optval;
+					break;
+				case KEY:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					key = optval;
+					break;
+				case BATCH:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					batch = max(atoi(optval), 1);
+					break;
+				case WORKERS:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					nworkers = atoi(optval);
+					break;
+				case REORDER:
+					if (optval == NULL || atoi(optval) != 0) {
+						flags |= FLAG_REORDER;
+					} else {
+						flags &= ~FLAG_REORDER;
+					}
+					break;
+				case WINDOW:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					window = max(atoi(optval), 1);
+					break;
+				case TCPINFO:
+#ifndef HAVE_TCPINFO
+					fprintf(stderr, "tcpinfo is not "
+					    "supported on this system\n");
+					exit(1);
+#endif
+					sampler.intvl = (optval == NULL) ?
+					    10000000 : strtoull(optval, NULL, 10);
+					break;
+				case SNDBUF:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					sock_sndbuf = atoi(optval);
+					break;
+				case RCVBUF:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					sock_rcvbuf = atoi(optval);
+					break;
+				case LOWAT:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					sock_lowat = atoi(optval);
+					break;
+				case CC:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
+						exit(1);
+					}
+					sock_cc = optval;
+					break;
+				case SLO:
+					if (optval == NULL ||
+					    sscanf(optval, "%lf:%lf", &search.pct,
+					    &dval) != 2 || search.pct <= 0 ||
+					    search.pct >= 100 || dval <= 0) {
+						fprintf(stderr, "slo needs "
+						    "<pct>:<us>\n");
+						exit(1);
+					}
+					search.limit = (uint64_t)(dval * 1000);
 					break;
-				case SMAX:
-					if (optval == NULL) {
-						fprintf(stderr, "no value\n");
+				case RATE:
+					/* integers, as "%lf.." would eat a dot */
+					if (optval == NULL ||
+					    sscanf(optval, "%" SCNu64 "..%" SCNu64,
+					    &lo, &hi) != 2 || lo == 0 || hi < lo) {
+						fprintf(stderr, "rate needs "
+						    "<lo>..<hi>\n");
 						exit(1);
 					}
-					ssz_max = atoi(optval);
+					search.lo = lo;
+					search.hi = hi;
 					break;
-				case SSIZE:
+				case CONFIRM:
 					if (optval == NULL) {
 						fprintf(stderr, "no value\n");
 						exit(1);
 					}
-					ssz_max = ssz_min = atoi(optval);
+					search.confirm = atoi(optval);
 					break;
-				case RMIN:
-					if (optval == NULL) {
-						fprintf(stderr, "no value\n");
+				case DURATION:
+					if (optval == NULL ||
+					    span_parse(&span, optval) != 0 ||
+					    span.v == 0) {
+						fprintf(stderr, "bad duration\n");
 						exit(1);
 					}
-					rsz_min = atoi(optval);
+					/* a bare number is in ns, as for sdelay */
+					duration = span.v;
 					break;
-				case RMAX:
-					if (optval == NULL) {
-						fprintf(stderr, "no value\n");
+				case WARMUP:
+					if (optval == NULL ||
+					    span_parse(&warmup, optval) != 0) {
+						fprintf(stderr, "bad warmup\n");
 						exit(1);
 					}
-					rsz_max = atoi(optval);
 					break;
-				case RSIZE:
-					if (optval == NULL) {
-						fprintf(stderr, "no value\n");
+				case COOLDOWN:
+					if (optval == NULL ||
+					    span_parse(&cooldown, optval) != 0) {
+						fprintf(stderr, "bad cooldown\n");
 						exit(1);
 					}
-					rsz_max = rsz_min = atoi(optval);
 					break;
-
-				case THREADS:
+				case IDLE:
 					if (optval == NULL) {
 						fprintf(stderr, "no value\n");
 						exit(1);
 					}
-					nthreads = atoi(optval);
+					idle_target = atoi(optval);
 					break;
-				case RDELAY_MIN:
+				case IDLETHREADS:
 					if (optval == NULL) {
 						fprintf(stderr, "no value\n");
 						exit(1);
 					}
-					rdly_min = atoi(optval);
+					nidlers = max(atoi(optval), 1);
 					break;
-				case RDELAY_MAX:
+				case CONNRATE:
 					if (optval == NULL) {
 						fprintf(stderr, "no value\n");
 						exit(1);
 					}
-					rdly_max = atoi(optval);
+					connrate = atof(optval);
 					break;
-				case RDELAY:
-					if (optval == NULL) {
-						fprintf(stderr, "no value\n");
+				case HEARTBEAT:
+					if (optval == NULL ||
+					    span_parse(&span, optval) != 0 ||
+					    span.v == 0) {
+						fprintf(stderr, "bad heartbeat\n");
 						exit(1);
 					}
-					rdly_min = rdly_max = atoi(optval);
+					heartbeat = span.v;
 					break;
-				case SDELAY_MIN:
-					if (optval == NULL) {
-						fprintf(stderr, "no value\n");
+				case ONEWAY:
+					oneway = 1;
+					break;
+				case BREAKDOWN:
+					breakdown = 1;
+					break;
+				case AB:
+					ab.rounds = optval ? atoi(optval) :
+					    AB_ROUNDS;
+					if (ab.rounds < 2) {
+						fprintf(stderr, "ab needs at "
+						    "least 2 rounds\n");
 						exit(1);
 					}
-					sdly_min = atoi(optval);
 					break;
-				case SDELAY_MAX:
+				case ABCONCURRENT:
+					ab.concurrent = 1;
+					break;
+				case METRICS:
 					if (optval == NULL) {
 						fprintf(stderr, "no value\n");
 						exit(1);
 					}
-					sdly_max = atoi(optval);
+					metricaddr = optval;
 					break;
-				case SDELAY:
-					if (optval == NULL) {
-						fprintf(stderr, "no value\n");
+				case PERF:
+					perfcount = 1;
+					break;
+				case JITTER:
+					if (optval != NULL &&
+					    (span_parse(&span, optval) != 0 ||
+					    span.v == 0)) {
+						fprintf(stderr, "bad jitter\n");
 						exit(1);
 					}
-					sdly_min = sdly_max = atoi(optval);
+					jitter = 1;
+					jprobe.intvl = optval ? span.v : 100000;
 					break;
-				case RINTERVAL:
+				case OUTLIER:
 					if (optval == NULL) {
 						fprintf(stderr, "no value\n");
 						exit(1);
 					}
-					rintvl = atoi(optval);
+					outlier = optval;
+					if (optval[strlen(optval) - 1] == '%') {
+						opct = atof(optval);
+						if (opct <= 0 || opct >= 100) {
+							fprintf(stderr,
+							    "bad outlier\n");
+							exit(1);
+						}
+					} else if (span_parse(&span, optval) !=
+					    0) {
+						fprintf(stderr,
+						    "bad outlier\n");
+						exit(1);
+					} else {
+						olim = span.v;
+					}
 					break;
-				case COUNT:
+				case OUTLIERLOG:
 					if (optval == NULL) {
 						fprintf(stderr, "no value\n");
 						exit(1);
 					}
-					count = atoi(optval);
+					outlierlog = optval;
 					break;
-				case DUMPFILE:
+				case CHUNKS:
+					if (optval == NULL ||
+					    (nchunk = atoi(optval)) < 1 ||
+					    nchunk > UINT16_MAX) {
+						fprintf(stderr, "bad chunks\n");
+						exit(1);
+					}
+					break;
+				case BUSYPOLL:
+					if (optval != NULL &&
+					    span_parse(&span, optval) != 0) {
+						fprintf(stderr,
+						    "bad busy_poll\n");
+						exit(1);
+					}
+					busy_poll = 1;
+					spin_limit = optval ? span.v : 0;
+					break;
+				case SOBUSYPOLL:
+					if (optval == NULL ||
+					    (sock_busypoll = atoi(optval)) <= 0) {
+						fprintf(stderr,
+						    "bad so_busy_poll\n");
+						exit(1);
+					}
+					break;
+				case CHUNKDELAY:
+					if (optval == NULL ||
+					    span_parse(&span, optval) != 0 ||
+					    span.v > UINT32_MAX) {
+						fprintf(stderr,
+						    "bad chunk_delay\n");
+						exit(1);
+					}
+					cdly = span.v;
+					break;
+				case JITTERSTALL:
+					if (optval == NULL ||
+					    span_parse(&span, optval) != 0 ||
+					    span.v == 0) {
+						fprintf(stderr,
+						    "bad jitter_stall\n");
+						exit(1);
+					}
+					jprobe.thresh = span.v;
+					break;
+				case REPLAY:
 					if (optval == NULL) {
 						fprintf(stderr, "no value\n");
 						exit(1);
 					}
-					dumpfile = fopen(optval, "w+");
-					if (dumpfile == NULL) {
-						fprintf(stderr, "open %s: %s\n", optval,
-						    strerror(errno));
+					replay = optval;
+					break;
+				case REPLAYSPEED:
+					if (optval == NULL ||
+					    (replay_speed = atof(optval)) <= 0) {
+						fprintf(stderr,
+						    "bad replay_speed\n");
+						exit(1);
+					}
+					break;
+				case CLOCKOFFSET:
+					if (optval == NULL ||
+					    span_parse(&span, optval +
+					    (*optval == '-')) != 0 ||
+					    (span.v != 0 && !span.time)) {
+						fprintf(stderr,
+						    "bad clock_offset\n");
+						exit(1);
+					}
+					clock_offset = (*optval == '-') ?
+					    -(int64_t)span.v : (int64_t)span.v;
+					break;
+				case CLOCKDRIFT:
+					if (optval == NULL) {
+						fprintf(stderr, "no value\n");
 						exit(1);
 					}
+					clock_drift = atof(optval);
 					break;
 				default:
 					fprintf(stderr, "bad option %s\n",
@@ -1021,6 +8216,36 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (flags & FLAG_TLS) {
+#ifdef HAVE_OPENSSL
+		tls_init(mode == MODE_REPLIER, cipher, cert, key,
+		    (flags & FLAG_KTLS) != 0);
+#else
+		(void) cipher;
+		(void) cert;
+		(void) key;
+		fprintf(stderr, "built without TLS support\n");
+		exit(1);
+#endif
+	}
+
+	/* with ab, a lone "/" divides the A addresses from the B */
+	for (i = optind; i < argc; i++) {
+		if (strcmp(argv[i], "/") == 0) {
+			absplit = i - optind;
+			memmove(&argv[i], &argv[i + 1],
+			    (argc - i - 1) * sizeof (char *));
+			argc--;
+			break;
+		}
+	}
+	if ((ab.rounds != 0) != (absplit >= 0) || absplit == 0 ||
+	    absplit == argc - optind) {
+		fprintf(stderr, "ab needs addresses both before and after "
+		    "a \"/\", and \"/\" needs ab\n");
+		exit(1);
+	}
+
 	/* addresses */
 	if ((nais = (argc - optind)) == 0)  {
 		fprintf(stderr, "no address!\n");
@@ -1045,10 +8270,24 @@ main(int argc, char **argv)
 		 */
 		strlcpy(hstr, argv[i + optind], arglen + 1);
 		lais[i] = NULL;
+
+		if (strncmp(hstr, "unix:", 5) == 0) {
+			ais[i] = unix_addrinfo(hstr + 5);
+			free(hstr);
+			continue;
+		}
 		memset(&hints, 0, sizeof (hints));
 		hints.ai_socktype = SOCK_STREAM;
 
-		if (mode == MODE_REPLIER) {
+		if (strncmp(hstr, "udp:", 4) == 0) {
+			memmove(hstr, hstr + 4, arglen - 3);
+			hints.ai_socktype = SOCK_DGRAM;
+			flags |= FLAG_UDP;
+			nudp++;
+		}
+
+		if (mode == MODE_REPLIER ||
+		    (mode == MODE_PROXY && (i % 2) == 0)) {
 			hints.ai_flags = AI_PASSIVE;
 		}
 
@@ -1081,6 +8320,152 @@ main(int argc, char **argv)
 		free(hstr);
 	}
 
+	if (nudp != 0 && nudp != nais) {
+		fprintf(stderr, "cannot mix udp and stream addresses\n");
+		exit(1);
+	}
+	if ((flags & FLAG_UDP) && (mode == MODE_SYNC_SEND ||
+	    mode == MODE_STREAM || mode == MODE_PROXY ||
+	    (flags & FLAG_TLS))) {
+		fprintf(stderr, "udp supports only -s and -r, without tls\n");
+		exit(1);
+	}
+	if (metricaddr != NULL) {
+		static const char *names[] = {
+			"async", "replier", "sync", "stream", "proxy"
+		};
+		metric_mode = names[mode];
+		metrics_start(metricaddr);
+	}
+	if (jitter && (mode == MODE_REPLIER || mode == MODE_PROXY)) {
+		/* these run until killed, so say what they see as they go */
+		jitter_start(&jprobe, 1);
+	}
+	if (mode == MODE_PROXY) {
+#ifdef HAVE_PROXY
+		if ((nais % 2) != 0 || (flags & FLAG_TLS)) {
+			fprintf(stderr, "proxy needs pairs of listening and "
+			    "upstream addresses, without tls\n");
+			exit(1);
+		}
+		return (proxy_main(ais, nais, bufsz));
+#else
+		fprintf(stderr, "built without proxy support\n");
+		exit(1);
+#endif
+	}
+	if ((flags & FLAG_REORDER) && mode == MODE_STREAM) {
+		fprintf(stderr, "reorder is not supported in stream mode\n");
+		exit(1);
+	}
+	sweeping = (sweep.threads.n > 1 || sweep.ssize.n > 1 ||
+	    sweep.sdelay.n > 1);
+	if (sweeping && ((mode != MODE_SYNC_SEND &&
+	    mode != MODE_ASYNC_SEND) || (flags & FLAG_UDP))) {
+		fprintf(stderr, "sweeps are supported only by -S and -s, "
+		    "without udp\n");
+		exit(1);
+	}
+	searching = (search.limit != 0);
+	if (searching != (search.hi != 0)) {
+		fprintf(stderr, "slo and rate must be given together\n");
+		exit(1);
+	}
+	if (searching && (sweeping || (mode != MODE_SYNC_SEND &&
+	    mode != MODE_ASYNC_SEND) || (flags & FLAG_UDP))) {
+		fprintf(stderr, "slo searches are supported only by -S and "
+		    "-s, without udp or a sweep\n");
+		exit(1);
+	}
+	if (searching) {
+		search.count = count;
+		if (search.confirm == 0) {
+			search.confirm = 10 * (uint64_t)count;
+		}
+	}
+	if ((duration != 0 || warmup.v != 0 || cooldown.v != 0) &&
+	    ((mode != MODE_SYNC_SEND && mode != MODE_ASYNC_SEND) ||
+	    (flags & FLAG_UDP))) {
+		fprintf(stderr, "duration, warmup and cooldown are supported "
+		    "only by -S and -s, without udp\n");
+		exit(1);
+	}
+	if (idle_target != 0 && ((mode != MODE_SYNC_SEND &&
+	    mode != MODE_ASYNC_SEND) || (flags & (FLAG_UDP | FLAG_TLS)))) {
+		fprintf(stderr, "idle connections are supported only by -S "
+		    "and -s, without udp or tls\n");
+		exit(1);
+	}
+	if (duration != 0 && searching) {
+		fprintf(stderr, "duration cannot be used with slo\n");
+		exit(1);
+	}
+	if (ab.rounds != 0 && (sweeping || searching ||
+	    (mode != MODE_SYNC_SEND && mode != MODE_ASYNC_SEND) ||
+	    (flags & FLAG_UDP))) {
+		fprintf(stderr, "ab is supported only by -S and -s, without "
+		    "udp, a sweep or slo\n");
+		exit(1);
+	}
+	if ((sweeping || ab.rounds != 0) && dumpfile != NULL) {
+		fprintf(stderr, "dump is not supported with a sweep or ab\n");
+		exit(1);
+	}
+	if ((sweeping || ab.rounds != 0) && (oneway || breakdown)) {
+		fprintf(stderr, "oneway and breakdown are not supported "
+		    "with a sweep or ab\n");
+		exit(1);
+	}
+	if (replay != NULL && (mode != MODE_ASYNC_SEND ||
+	    (flags & FLAG_UDP) || sweeping || searching || ab.rounds != 0 ||
+	    duration != 0 || warmup.v != 0 || cooldown.v != 0)) {
+		fprintf(stderr, "replay is supported only by -s, without udp, "
+		    "a sweep, slo, ab, duration, warmup or cooldown\n");
+		exit(1);
+	}
+	if (replay != NULL) {
+		/* a connection for each in the trace, of its messages */
+		trace_load(&trace, replay, replay_speed);
+		nthreads = trace.nconns;
+		count = 0;
+		for (i = 0; i < trace.nconns; i++) {
+			count = max(count, trace.n[i]);
+		}
+	}
+	if (perfcount && ((mode != MODE_SYNC_SEND &&
+	    mode != MODE_ASYNC_SEND && mode != MODE_REPLIER) ||
+	    (flags & FLAG_UDP))) {
+		fprintf(stderr, "perf is supported only by -S, -s and -r, "
+		    "without udp\n");
+		exit(1);
+	}
+	if ((nchunk > 1 || cdly != 0) && (mode != MODE_ASYNC_SEND ||
+	    (flags & (FLAG_UDP | FLAG_REORDER)) || sweeping || searching ||
+	    ab.rounds != 0)) {
+		fprintf(stderr, "chunks are supported only by -s, without udp, "
+		    "reorder, a sweep, slo or ab\n");
+		exit(1);
+	}
+	if (busy_poll && ((mode != MODE_SYNC_SEND &&
+	    mode != MODE_ASYNC_SEND && mode != MODE_REPLIER) ||
+	    (flags & (FLAG_UDP | FLAG_TLS)))) {
+		fprintf(stderr, "busy_poll is supported only by -S, -s and -r, "
+		    "without udp or tls\n");
+		exit(1);
+	}
+	if (outlier != NULL && mode != MODE_SYNC_SEND &&
+	    mode != MODE_ASYNC_SEND) {
+		fprintf(stderr, "outlier is supported only by -S and -s\n");
+		exit(1);
+	}
+	if ((clock_offset != 0 || clock_drift != 0) &&
+	    mode != MODE_REPLIER) {
+		fprintf(stderr, "clock_offset and clock_drift are for "
+		    "the replier\n");
+		exit(1);
+	}
+	clock_epoch = gethrtime();
+
 	naddrs = 0;
 
 	for (i = 0; i < nais; i++) {
@@ -1088,9 +8473,14 @@ main(int argc, char **argv)
 		for (ai = ais[i]; ai; ai = ai->ai_next) {
 			naddrs++;
 		}
+		if (i == absplit - 1) {
+			naddrs_a = naddrs;
+		}
 	}
 	if (mode == MODE_REPLIER) {
 		nthreads = naddrs;
+		/* a sender gone before its replies is an error, not fatal */
+		(void) signal(SIGPIPE, SIG_IGN);
 	}
 	addrs = malloc(naddrs * sizeof (struct sockaddr *));
 	naddrs = 0;
@@ -1100,6 +8490,12 @@ main(int argc, char **argv)
 		struct addrinfo *ai;
 
 		for (ai = ais[i]; ai; ai = ai->ai_next) {
+			if (ai->ai_family == AF_UNIX) {
+				printf("Address %d: Path %s\n", naddrs,
+				    ((struct sockaddr_un *)ai->ai_addr)->sun_path);
+				addrs[naddrs++] = ai->ai_addr;
+				continue;
+			}
 			if (getnameinfo(ai->ai_addr, ai->ai_addrlen, hbuf,
 			    sizeof (hbuf), pbuf, sizeof (pbuf),
 			    NI_NUMERICHOST | NI_NUMERICSERV)) {
@@ -1113,18 +8509,86 @@ main(int argc, char **argv)
 	}
 
 	if (nthreads == 0) {
-		nthreads = naddrs;
+		nthreads = (ab.rounds != 0) ?
+		    max(naddrs_a, naddrs - naddrs_a) : naddrs;
+	}
+	if (ab.rounds != 0) {
+		/* threads gives the connections in each group */
+		nthreads *= 2;
+	}
+	if (idle_target != 0) {
+		/* every idle connection needs a descriptor of its own */
+		rlim_t need = idle_target + 2 * (rlim_t)nthreads + 64;
+
+		if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < need) {
+			if (rl.rlim_max != RLIM_INFINITY &&
+			    rl.rlim_max < need) {
+				fprintf(stderr, "idle needs %llu descriptors, "
+				    "but the limit is %llu\n",
+				    (unsigned long long)need,
+				    (unsigned long long)rl.rlim_max);
+				exit(1);
+			}
+			rl.rlim_cur = need;
+			if (setrlimit(RLIMIT_NOFILE, &rl) != 0) {
+				perror("setrlimit");
+				exit(1);
+			}
+		}
+	}
+	if (sweeping) {
+		/* options not being swept keep their single value */
+		vlist_default(&sweep.threads, nthreads);
+		vlist_default(&sweep.ssize, ssz_min);
+		vlist_default(&sweep.sdelay, sdly_min);
+		for (i = 0; i < sweep.threads.n; i++) {
+			if (sweep.threads.v[i] == 0) {
+				fprintf(stderr, "a sweep needs at least "
+				    "one thread\n");
+				exit(1);
+			}
+		}
+	}
+	if (searching) {
+		/* each connection's send interval must fit the 32-bit sdelay */
+		uint64_t least = ((uint64_t)nthreads * 1000000000ull +
+		    UINT32_MAX - 1) / UINT32_MAX;
+
+		if (search.lo < least) {
+			fprintf(stderr, "the lowest rate %d connection(s) can "
+			    "be paced at is %" PRIu64 " msgs/s\n", nthreads,
+			    least);
+			exit(1);
+		}
 	}
-	if (mode == MODE_ASYNC_SEND) {
+	if (mode == MODE_ASYNC_SEND || mode == MODE_STREAM) {
 		/* one for sender, and one for receiver */
 		nthreads *= 2;
 	}
+	bufsz = max(bufsz, maxmsg);
 
 	begin_time = gethrtime();
 	tests = calloc(sizeof (test_t), nthreads);
 
 	for (i = 0; i < nthreads; i++) {
 		test_t *t = &tests[i];
+		int a, conn, nconn;
+
+		/* each connection's address; with ab, the first half are A */
+		if (mode == MODE_ASYNC_SEND || mode == MODE_STREAM) {
+			conn = i / 2;
+			nconn = nthreads / 2;
+		} else {
+			conn = i;
+			nconn = nthreads;
+		}
+		if (ab.rounds == 0) {
+			a = conn % naddrs;
+		} else if (conn < nconn / 2) {
+			a = conn % naddrs_a;
+		} else {
+			a = naddrs_a + (conn - nconn / 2) % (naddrs - naddrs_a);
+		}
 
 		t->ssz_min = (uint16_t) min(ssz_min, maxmsg);
 		t->ssz_min = (uint16_t) max(sizeof (test_header_t), t->ssz_min);
@@ -1144,97 +8608,230 @@ main(int argc, char **argv)
 		t->sdly_min = sdly_min;
 		t->sdly_max = sdly_max;
 		t->rintvl = rintvl;
+		t->bufsz = bufsz;
+		t->flags = flags;
+		t->tsintvl = tsintvl;
+		t->batch = batch;
+		t->window = window;
+		t->nchunk = (uint16_t)nchunk;
+		t->cdly = (uint32_t)cdly;
 		t->sock = -1;
 		t->rseqno = 0;
 		t->sseqno = 0;
-		t->samples = calloc(count, sizeof (sample_t));
+		t->warmup = warmup;
+		t->cooldown = cooldown;
+		t->duration = duration;
+		t->mbegin = 0;
+		t->mend = UINT64_MAX;
+		t->seed = i + 1;
+		if (replay != NULL) {
+			t->trace = trace.e[i / 2];
+			t->count = trace.n[i / 2];
+		}
+		if (outlier != NULL &&
+		    (mode == MODE_SYNC_SEND || (i % 2) != 0)) {
+			/* only those that receive replies */
+			if ((t->oring = calloc(1, sizeof (oring_t))) == NULL) {
+				perror("calloc");
+				exit(1);
+			}
+			t->oring->thread = i;
+			t->oring->pct = opct;
+			t->oring->lim = (opct != 0) ? UINT64_MAX : olim;
+		}
 
-		if (mode == MODE_ASYNC_SEND) {
-			t->addr = addrs[(i / 2) % naddrs];
+		/*
+		 * Touch the samples now, rather than taking page faults on
+		 * them during the run; with a duration, they grow as needed.
+		 */
+		nsamples = max(count, search.confirm);
+		nsamples += warmup.time ? 0 : warmup.v;
+		nsamples += cooldown.time ? 0 : cooldown.v;
+		t->nsamples = nsamples;
+		t->samples = malloc(nsamples * sizeof (sample_t));
+		memset(t->samples, 0, nsamples * sizeof (sample_t));
+
+		if (mode == MODE_ASYNC_SEND || mode == MODE_STREAM) {
+			t->addr = addrs[a];
 			if ((i % 2) != 0) {
 				t->sock = tests[i-1].sock;
+				t->tp = tests[i-1].tp;
+				t->peer = &tests[i-1];
+				tests[i-1].peer = t;
+#ifdef HAVE_OPENSSL
+				t->ssl = tests[i-1].ssl;
+				t->tlsmx = tests[i-1].tlsmx;
+				t->tlsfast = tests[i-1].tlsfast;
+#endif
 			}
 
 		} else {
-			t->addr = addrs[i % naddrs];
-			t->lai = lais[i % naddrs];
+			t->addr = addrs[a];
+			t->lai = lais[a];
 		}
-		switch (t->addr->sa_family) {
-		case AF_INET:
-			t->addrlen = sizeof (struct sockaddr_in);
-			break;
-		case AF_INET6:
-			t->addrlen = sizeof (struct sockaddr_in6);
-			break;
-		default:
-			t->addrlen = 0;
-			break;
+		t->addrlen = addr_len(t->addr);
+		if (metrics_on && mode != MODE_REPLIER) {
+			t->mt = mtarget_get(t->addr, t->addrlen);
+			t->m = mblock_get(t->mt);
 		}
 
 		if (t->sock < 0) {
-			int on = 1;
-			t->sock = socket(t->addr->sa_family, SOCK_STREAM, 0);
-
-			if (setsockopt(t->sock, IPPROTO_TCP, TCP_NODELAY,
-			    &on, sizeof (on)) != 0)
-				perror("setting TCP_NODELAY");
-
-			if (t->lai != NULL) {
-				if (bind(t->sock,
-				    (struct sockaddr *) t->lai->ai_addr,
-				    t->lai->ai_addrlen) == -1) {
-					perror("binding sender");
-					exit(1);
-				}
+			t->tp = transport_for(t->addr, flags);
+			if (t->tp->open(t) != 0) {
+				perror("socket");
+				exit(1);
 			}
 		}
-		if (t->sock == -1) {
-			perror("socket");
-			exit(1);
-		}
 		if ((mode == MODE_ASYNC_SEND) && ((i % 2) == 0)) {
-			if (connect(t->sock, t->addr, t->addrlen) != 0) {
+			if (t->tp->connect(t) != 0) {
 				perror("connect");
 				exit(1);
 			}
-			pthread_create(&t->tid, NULL, sender, t);
+#ifdef HAVE_OPENSSL
+			tls_share(t);
+#endif
+			trial_live += !(flags & FLAG_UDP);
+			pthread_create(&t->tid, NULL,
+			    (flags & FLAG_UDP) ? udp_sender : sender, t);
 
 		} else if (mode == MODE_ASYNC_SEND) {
-			pthread_create(&t->tid, NULL, receiver, t);
+			trial_live += !(flags & FLAG_UDP);
+			pthread_create(&t->tid, NULL,
+			    (flags & FLAG_UDP) ? udp_receiver : receiver, t);
+
+		} else if ((mode == MODE_STREAM) && ((i % 2) == 0)) {
+			if (t->tp->connect(t) != 0) {
+				perror("connect");
+				exit(1);
+			}
+#ifdef HAVE_OPENSSL
+			tls_share(t);
+#endif
+			pthread_create(&t->tid, NULL, streamer, t);
+
+		} else if (mode == MODE_STREAM) {
+			pthread_create(&t->tid, NULL, streamreceiver, t);
 
 		} else if (mode == MODE_SYNC_SEND) {
-			if (connect(t->sock, t->addr, t->addrlen) != 0) {
+			if (t->tp->connect(t) != 0) {
 				perror("connect");
 				exit(1);
 			}
+			trial_live++;
 			pthread_create(&t->tid, NULL, senderreceiver, t);
 
 		} else if (mode == MODE_REPLIER) {
-			if (bind(t->sock, t->addr, t->addrlen) < 0) {
-				perror("bind");
-				exit(1);
+			if (i == 0 && !(flags & FLAG_UDP) && nworkers != 0) {
+				int w;
+
+				workers = calloc(nworkers, sizeof (worker_t));
+				for (w = 0; w < nworkers; w++) {
+					worker_new(&workers[w], 1);
+					pthread_create(&workers[w].tid, NULL,
+					    replier, &workers[w]);
+				}
 			}
-			if (listen(t->sock, 128) < 0) {
+			if (t->tp->listen(t) < 0) {
 				perror("listen");
 				exit(1);
 			}
-			pthread_create(&t->tid, NULL, acceptor, t);
+			print_listener(t);
+			if (metrics_on) {
+				struct sockaddr_storage sa;
+				socklen_t slen = sizeof (sa);
+
+				/* by the port given, if it was 0 */
+				t->mt = (getsockname(t->sock,
+				    (struct sockaddr *)&sa, &slen) == 0) ?
+				    mtarget_get((struct sockaddr *)&sa, slen) :
+				    mtarget_get(t->addr, t->addrlen);
+				/* connections take their own, as added */
+				if (flags & FLAG_UDP) {
+					t->m = mblock_get(t->mt);
+				}
+			}
+			pthread_create(&t->tid, NULL,
+			    (flags & FLAG_UDP) ? udp_replier : acceptor, t);
 		}
 	}
 
-#ifdef TIMETEST
-	check_ndelay();
-#endif
-	/* start all threads together */
-	if (mode == MODE_SYNC_SEND) {
+	/* start all threads together; in stream mode only the senders wait */
+	if (mode == MODE_STREAM) {
+		nstart = nthreads / 2;
 		pthread_mutex_lock(&startmx);
-		while (start_wait < nthreads) {
+		while (start_wait < nstart) {
 			pthread_cond_wait(&waitcv, &startmx);
 		}
+		begin_time = start_time = gethrtime();
 		start_ready = 1;
 		pthread_cond_broadcast(&startcv);
 		pthread_mutex_unlock(&startmx);
-		begin_time = gethrtime();
+	}
+	(void) getrusage(RUSAGE_SELF, &ru_begin);
+	epoch = gethrtime();
+
+	if (jitter && mode != MODE_REPLIER) {
+		jitter_start(&jprobe, 0);
+	}
+	if (outlier != NULL) {
+		memset(&ologger, 0, sizeof (ologger));
+		ologger.tests = tests;
+		ologger.ntests = nthreads;
+		ologger.epoch = gethrtime();
+		ologger.f = stdout;
+		if (outlierlog != NULL &&
+		    (ologger.f = fopen(outlierlog, "w")) == NULL) {
+			fprintf(stderr, "open %s: %s\n", outlierlog,
+			    strerror(errno));
+			exit(1);
+		}
+		pthread_create(&ologger.tid, NULL, outlier_run, &ologger);
+	}
+
+	/* sample the connections on which latency is measured */
+	if (sampler.intvl != 0 && mode != MODE_REPLIER &&
+	    !(flags & FLAG_UDP)) {
+		sampler.tests = tests;
+		sampler.ntests = nthreads;
+		sampler.first = (mode == MODE_SYNC_SEND) ? 0 : 1;
+		sampler.step = (mode == MODE_SYNC_SEND) ? 1 : 2;
+		pthread_create(&sampler.tid, NULL, sampler_run, &sampler);
+	}
+
+	/* the idle population grows while the flows under test run */
+	if (idle_target != 0) {
+		nidlers = min(nidlers, idle_target);
+		idlers = calloc(nidlers, sizeof (idler_t));
+		idle_marks[0] = gethrtime();
+		for (i = 0; i < nidlers; i++) {
+			idler_t *d = &idlers[i];
+			d->lais = lais;
+			d->first = (uint64_t)idle_target * i / nidlers;
+			d->n = (uint64_t)idle_target * (i + 1) / nidlers -
+			    d->first;
+			d->rate = connrate / nidlers;
+			d->heartbeat = heartbeat;
+			pthread_create(&d->tid, NULL, idle_run, d);
+		}
+	}
+
+	/* -S and -s (but not udp) run their messages as trials */
+	if (trial_live > 0) {
+		if (sweeping) {
+			run_sweep(&sweep, tests, nthreads,
+			    (mode == MODE_SYNC_SEND) ? 1 : 2);
+		} else if (searching) {
+			search_failed = run_search(&search, tests, nthreads,
+			    (mode == MODE_SYNC_SEND) ? 1 : 2,
+			    &begin_time, &finish_time) != 0;
+		} else if (ab.rounds != 0) {
+			run_ab(&ab, tests, nthreads,
+			    (mode == MODE_SYNC_SEND) ? 1 : 2,
+			    &begin_time, &finish_time);
+		} else {
+			trial_run(tests, nthreads, &begin_time, &finish_time);
+		}
+		trial_end();
 	}
 
 	for (i = 0; i < nthreads; i++) {
@@ -1242,32 +8839,82 @@ main(int argc, char **argv)
 		pthread_join(t->tid, NULL);
 	}
 
-	finish_time = gethrtime();
+	if (!trial_over) {
+		finish_time = gethrtime();
+	}
+	if (jitter && mode != MODE_REPLIER) {
+		jprobe.stop = 1;
+		pthread_join(jprobe.tid, NULL);
+	}
+	if (outlier != NULL) {
+		uint64_t dropped = 0;
+
+		ologger.stop = 1;
+		pthread_join(ologger.tid, NULL);
+		for (i = 0; i < nthreads; i++) {
+			if (tests[i].oring != NULL) {
+				dropped += tests[i].oring->dropped;
+			}
+		}
+		if (ologger.f != stdout) {
+			fclose(ologger.f);
+		}
+		printf("Outliers over %s: %" PRIu64 " logged%s%s, %" PRIu64
+		    " dropped\n", outlier, ologger.logged,
+		    outlierlog ? " to " : "", outlierlog ? outlierlog : "",
+		    dropped);
+	}
+	if (idlers != NULL) {
+		idle_stop = 1;
+		for (i = 0; i < nidlers; i++) {
+			pthread_join(idlers[i].tid, NULL);
+		}
+	}
+	(void) getrusage(RUSAGE_SELF, &ru_finish);
+
+	if (sampler.tests != NULL) {
+		sampler.stop = 1;
+		pthread_join(sampler.tid, NULL);
+		report_tcpinfo(tests, nthreads, sampler.intvl, epoch);
+		if (dumpname != NULL) {
+			dump_tcpinfo(tests, nthreads, epoch, dumpname);
+		}
+	}
+
+#ifdef HAVE_OPENSSL
+	if (flags & FLAG_TLS) {
+		report_tls(tests, nthreads, (mode == MODE_SYNC_SEND) ? 1 : 2);
+	}
+#endif
+	if (mode == MODE_STREAM) {
+		report_stream(tests, nthreads, &ru_begin, &ru_finish);
+	}
+	if (flags & FLAG_UDP) {
+		report_udp(tests, nthreads, finish_time - begin_time);
+	}
+	if (idlers != NULL) {
+		report_idle(idlers, nidlers, tests, nthreads);
+	}
+	if (sweeping || ab.rounds != 0) {
+		/* each point, or round, has been reported as it was run */
+		return (0);
+	}
+	if ((flags & FLAG_REORDER) && mode != MODE_REPLIER) {
+		report_reorder(tests, nthreads);
+	}
+	if (mode != MODE_REPLIER && replay == NULL) {
+		report_pacing(tests, nthreads);
+	}
 
-	if (mode == MODE_ASYNC_SEND || mode == MODE_SYNC_SEND) {
+	if (mode == MODE_ASYNC_SEND || mode == MODE_SYNC_SEND ||
+	    (mode == MODE_STREAM && (flags & FLAG_ECHO))) {
 		uint64_t totmsgs = 0;
 		uint64_t latency = 0;
 		uint64_t mean = 0;
 		uint64_t variance = 0;
 		uint64_t *samples;
-		uint64_t sampno = 0;
-		int i, ii;
-
-		for (i = 0; i < nthreads; i++) {
-			test_t *t = &tests[i];
-			totmsgs += t->replies;
-		}
-
-		samples = calloc(totmsgs, sizeof (uint64_t));
-
-		for (i = 0; i < nthreads; i++) {
-			test_t *t = &tests[i];
-			for (ii = 0; ii < t->replies; ii++) {
-				samples[sampno++] = t->samples[ii].lat;
-			}
-		}
 
-		qsort(samples, totmsgs, sizeof (uint64_t), cmpu64);
+		samples = latency_collect(tests, nthreads, &totmsgs);
 
 		for (i = 0; i < totmsgs; i++) {
 			latency += samples[i];
@@ -1282,17 +8929,74 @@ main(int argc, char **argv)
 			variance /= totmsgs;
 		}
 
-		printf("Received %" PRIu64 " replies\n", totmsgs);
-		printf("Time: %.1f us\n", (finish_time - begin_time) / 1000.0);
+		if (duration != 0 || warmup.v != 0 || cooldown.v != 0) {
+			uint64_t wbegin, wend, all = 0;
+
+			measure_window(tests, nthreads, finish_time,
+			    &wbegin, &wend);
+			for (i = 0; i < nthreads; i++) {
+				all += tests[i].replies;
+			}
+			printf("Received %" PRIu64 " replies\n", all);
+			printf("Time: %.1f us\n",
+			    (finish_time - begin_time) / 1000.0);
+			printf("Measured %" PRIu64 " replies in %.1f us\n",
+			    totmsgs, (wend - wbegin) / 1000.0);
+			printf("Throughput: %.1f msgs/s\n", (wend > wbegin) ?
+			    totmsgs * 1e9 / (wend - wbegin) : 0.0);
+		} else {
+			printf("Received %" PRIu64 " replies\n", totmsgs);
+			printf("Time: %.1f us\n",
+			    (finish_time - begin_time) / 1000.0);
+			printf("Throughput: %.1f msgs/s\n",
+			    (finish_time > begin_time) ? totmsgs * 1e9 /
+			    (finish_time - begin_time) : 0.0);
+		}
+		if (totmsgs == 0) {
+			/* only possible with udp, where all may be lost */
+			return (1);
+		}
 		printf("ROUND TRIP LATENCY:\n");
 		printf("Average:  %.1f us\n", mean / 1000.0);
 		printf("Stddev:   %.1f us\n", sqrt((double)variance)/1000.0);
-		printf("Median:   %.1f us\n", pctile(samples, totmsgs, 50.0)/1000.0);
-		printf("90.0%%ile: %.1f us\n", pctile(samples, totmsgs, 90.0)/1000.0);
-		printf("99.0%%ile: %.1f us\n", pctile(samples, totmsgs, 99.0)/1000.0);
-		printf("99.9%%ile: %.1f us\n", pctile(samples, totmsgs, 99.9)/1000.0);
-		printf("Minimum:  %.1f us\n", samples[0]/1000.0);
-		printf("Maximum:  %.1f us\n", samples[totmsgs-1]/1000.0);
+		report_dist(NULL, samples, totmsgs);
+		if (oneway) {
+			report_oneway(tests, nthreads);
+		}
+		if (breakdown) {
+			report_breakdown(tests, nthreads);
+		}
+		if (nchunk > 1) {
+			report_chunks(tests, nthreads);
+		}
+		if (replay != NULL) {
+			report_replay(tests, nthreads, &trace,
+			    finish_time - begin_time);
+		}
+		if (perfcount) {
+			report_perf(tests, nthreads,
+			    (mode == MODE_SYNC_SEND) ? 1 : 2);
+		}
+		if (jitter) {
+			report_jitter(&jprobe, tests, nthreads,
+			    pctile(samples, totmsgs, 99.9));
+		}
+		if (busy_poll) {
+			spin_t spin;
+			int nrecv = 0;
+
+			memset(&spin, 0, sizeof (spin));
+			for (i = 0; i < nthreads; i++) {
+				spin_t *sp = &tests[i].spin;
+				nrecv += (sp->recvs != 0);
+				spin.recvs += sp->recvs;
+				spin.waits += sp->waits;
+				spin.blocked += sp->blocked;
+				spin.spun += sp->spun;
+			}
+			report_spin("BUSY POLL", &spin,
+			    (finish_time - begin_time) * nrecv);
+		}
 
 		if (dumpfile != NULL) {
 			int i, ii;
@@ -1313,5 +9017,5 @@ main(int argc, char **argv)
 			fclose(dumpfile);
 		}
 	}
-	return (0);
+	return (search_failed);
 }
@@ -0,0 +1,167 @@
+#!/bin/sh
+#
+# loopback.sh -- loopback regression gate for seqtest
+#
+# usage: loopback.sh <seqtest> <baseline> <name>
+#
+# Runs the configuration called <name> from the baseline file: a replier
+# (-r) is started on the loopback, the sender is run against it, and the
+# results are checked.  The test fails if the sender reports any error,
+# if fewer or more replies arrive than expected, if throughput drops
+# below the baseline, or if the median or 99th percentile latency rises
+# above it, by more than the tolerances given for that configuration.
+# Loopback timings are at the mercy of everything else on the host, so a
+# run that only misses on performance is retried, up to SEQTEST_ATTEMPTS
+# (default 3) times in all; errors fail at once.
+#
+# With SEQTEST_UPDATE_BASELINE set in the environment the measured values
+# are written back into the baseline file instead of being compared.
+# The stored numbers are only meaningful for the machine on which they
+# were recorded, so update them when moving the gate to a new host.
+#
+
+SEQTEST=$1
+BASELINE=$2
+NAME=$3
+
+if [ $# -ne 3 ] || [ ! -x "$SEQTEST" ] || [ ! -r "$BASELINE" ]; then
+	echo "usage: $0 <seqtest> <baseline> <name>" >&2
+	exit 2
+fi
+
+line=$(awk -v n="$NAME" '$1 == n' "$BASELINE")
+if [ -z "$line" ]; then
+	echo "$NAME: no such configuration in $BASELINE" >&2
+	exit 2
+fi
+set -- $line
+transport=$2 mode=$3 sopts=$4 ropts=$5 replies=$6
+tput=$7 p50=$8 p99=$9 ttol=${10} ltol=${11}
+
+# a throughput tolerance of 1 or more could never fail
+if ! awk -v t="$ttol" -v l="$ltol" \
+    'BEGIN { exit !(t > 0 && t < 1 && l > 0) }'; then
+	echo "$NAME: bad tolerances $ttol $ltol in $BASELINE" >&2
+	exit 2
+fi
+
+tmp=$(mktemp -d "${TMPDIR:-/tmp}/seqtest.XXXXXX") || exit 2
+rpid=
+cleanup() {
+	[ -n "$rpid" ] && kill "$rpid" 2>/dev/null && wait "$rpid" 2>/dev/null
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+trap 'exit 2' HUP INT TERM
+
+fail() {
+	echo "$NAME: FAIL: $*" >&2
+	echo "--- sender:" >&2
+	cat "$tmp/s.out" "$tmp/s.err" >&2 2>/dev/null
+	echo "--- replier:" >&2
+	cat "$tmp/r.out" "$tmp/r.err" >&2 2>/dev/null
+	exit 1
+}
+
+# run starts a replier, runs the sender against it, and checks the result.
+run() {
+	case $transport in
+	tcp)	raddr=127.0.0.1:0 ;;
+	udp)	raddr=udp:127.0.0.1:0 ;;
+	unix)	raddr=unix:$tmp/sock; rm -f "$tmp/sock" ;;
+	*)	echo "$NAME: unknown transport $transport" >&2; exit 2 ;;
+	esac
+
+	if [ "$ropts" = "-" ]; then
+		"$SEQTEST" -r "$raddr" > "$tmp/r.out" 2> "$tmp/r.err" &
+	else
+		"$SEQTEST" -r -o "$ropts" "$raddr" > "$tmp/r.out" 2> "$tmp/r.err" &
+	fi
+	rpid=$!
+
+	# Wait for the replier to come up, and learn the port it was given.
+	i=0
+	while :; do
+		if [ "$transport" = unix ]; then
+			[ -S "$tmp/sock" ] && break
+		else
+			port=$(awk '/^Listening on/ { print $NF; exit }' \
+			    "$tmp/r.out")
+			[ -n "$port" ] && break
+		fi
+		kill -0 "$rpid" 2>/dev/null || fail "replier did not start"
+		i=$((i + 1))
+		[ $i -ge 50 ] && fail "replier did not start"
+		sleep 0.1
+	done
+
+	case $transport in
+	tcp)	saddr=127.0.0.1:$port ;;
+	udp)	saddr=udp:127.0.0.1:$port ;;
+	unix)	saddr=unix:$tmp/sock ;;
+	esac
+
+	"$SEQTEST" "$mode" -o "$sopts" "$saddr" > "$tmp/s.out" 2> "$tmp/s.err" ||
+	    fail "sender exited with status $?"
+	[ -s "$tmp/s.err" ] && fail "sender reported errors"
+	[ -s "$tmp/r.err" ] && fail "replier reported errors"
+
+	got=$(awk '/^Received [0-9]+ replies/ { print $2 }' "$tmp/s.out")
+	mtput=$(awk '/^Throughput:/ { print $2 }' "$tmp/s.out")
+	mp50=$(awk '/^ROUND TRIP LATENCY:/ { r = 1 }
+	    r && /^Median:/ { print $2; exit }' "$tmp/s.out")
+	mp99=$(awk '/^ROUND TRIP LATENCY:/ { r = 1 }
+	    r && /^99.0%ile:/ { print $2; exit }' "$tmp/s.out")
+
+	[ -n "$got" ] && [ -n "$mtput" ] && [ -n "$mp50" ] && [ -n "$mp99" ] ||
+	    fail "unable to parse sender report"
+	[ "$got" -eq "$replies" ] ||
+	    fail "received $got replies, expected $replies"
+
+	kill "$rpid" 2>/dev/null && wait "$rpid" 2>/dev/null
+	rpid=
+}
+
+if [ -n "$SEQTEST_UPDATE_BASELINE" ]; then
+	run
+	awk -v n="$NAME" -v t="$mtput" -v a="$mp50" -v b="$mp99" '
+	    $1 == n {
+		printf("%-10s %-5s %-4s %-36s %-8s %8s %10.0f %8.1f %8.1f " \
+		    "%5s %5s\n", $1, $2, $3, $4, $5, $6, t, a, b, $10, $11)
+		next
+	    }
+	    { print }' "$BASELINE" > "$tmp/baseline" &&
+	    cat "$tmp/baseline" > "$BASELINE"
+	echo "$NAME: recorded $mtput msgs/s, p50 $mp50 us, p99 $mp99 us"
+	exit 0
+fi
+
+attempt=1
+while :; do
+	run
+	awk -v n="$NAME" -v ttol="$ttol" -v ltol="$ltol" \
+	    -v tput="$tput" -v p50="$p50" -v p99="$p99" \
+	    -v mtput="$mtput" -v mp50="$mp50" -v mp99="$mp99" 'BEGIN {
+		bad = 0
+		printf("%s: throughput %.0f msgs/s (baseline %.0f)\n",
+		    n, mtput, tput)
+		printf("%s: median %.1f us (baseline %.1f)\n", n, mp50, p50)
+		printf("%s: 99th %.1f us (baseline %.1f)\n", n, mp99, p99)
+		if (mtput < tput * (1 - ttol)) {
+			printf("%s: throughput regressed\n", n)
+			bad = 1
+		}
+		if (mp50 > p50 * (1 + ltol)) {
+			printf("%s: median latency regressed\n", n)
+			bad = 1
+		}
+		if (mp99 > p99 * (1 + ltol)) {
+			printf("%s: 99th percentile latency regressed\n", n)
+			bad = 1
+		}
+		exit bad
+	}' && exit 0
+	[ $attempt -ge "${SEQTEST_ATTEMPTS:-3}" ] &&
+	    fail "outside tolerances after $attempt attempts"
+	attempt=$((attempt + 1))
+done